@@ -209,6 +209,7 @@ mevent_add(int tfd, enum ev_type type,
 	mevp->me_type = type;
 	mevp->me_func = func;
 	mevp->me_param = param;
+	mevp->me_state = MEV_ENABLE;
 
 	ee.events = mevent_kq_filter(mevp);
 	ee.data.ptr = mevp;
@@ -225,16 +226,45 @@ mevent_add(int tfd, enum ev_type type,
 	}
 }
 
+/*
+ * Enabling/disabling re-registers the fd with epoll rather than clearing
+ * its event mask: an fd left in the set with no events would still report
+ * EPOLLHUP/EPOLLERR. Both calls are idempotent and may be made from any
+ * thread, including from the event's own callback.
+ */
+static int
+mevent_update(struct mevent *evp, int newstate)
+{
+	struct epoll_event ee;
+	int ret = 0;
+
+	if (evp == NULL)
+		return -1;
+
+	mevent_qlock();
+	if (evp->me_state != newstate) {
+		ee.events = mevent_kq_filter(evp);
+		ee.data.ptr = evp;
+		ret = epoll_ctl(epoll_fd, newstate == MEV_ENABLE ?
+			EPOLL_CTL_ADD : EPOLL_CTL_DEL, evp->me_fd, &ee);
+		if (ret == 0)
+			evp->me_state = newstate;
+	}
+	mevent_qunlock();
+
+	return ret;
+}
+
 int
 mevent_enable(struct mevent *evp)
 {
-	return 0;
+	return mevent_update(evp, MEV_ENABLE);
 }
 
 int
 mevent_disable(struct mevent *evp)
 {
-	return 0;
+	return mevent_update(evp, MEV_DISABLE);
 }
 
 static int
@@ -167,6 +167,11 @@ static void handshake_acrn_dm(struct vmm_msg *msg, struct msg_sender *sender,
 	write_msg_to(sender->fd, &handshake_ok, TIMEOUT_USEC);
 }
 
+int monitor_reply(struct msg_sender *sender, struct vmm_msg *msg)
+{
+	return write_msg_to(sender->fd, msg, TIMEOUT_USEC);
+}
+
 static struct monitor_msg_handle handle_handshake = {
 	.msg = {.msgid = MSG_HANDSHAKE},
 	.callback = handshake_acrn_dm,
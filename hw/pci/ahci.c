@@ -113,6 +113,7 @@ static FILE *dbg;
 
 struct ahci_ioreq {
 	struct blockif_req io_req;
+	struct iovec io_iov[BLOCKIF_IOV_MAX];
 	struct ahci_port *io_pr;
 
 	STAILQ_ENTRY(ahci_ioreq) io_flist;
@@ -2026,6 +2027,7 @@ pci_ahci_ioreq_init(struct ahci_port *pr)
 	for (i = 0; i < pr->ioqsz; i++) {
 		vr = &pr->ioreq[i];
 		vr->io_pr = pr;
+		vr->io_req.iov = vr->io_iov;
 		if (!pr->atapi)
 			vr->io_req.callback = ata_ioreq_cb;
 		else
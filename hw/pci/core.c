@@ -790,6 +790,7 @@ pci_emul_deinit(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	pci_emul_free_bars(fi->fi_devi);
 	if (fi->fi_devi)
 		free(fi->fi_devi);
+	fi->fi_devi = NULL;
 }
 
 void
@@ -1694,6 +1695,33 @@ pci_walk_lintr(int bus, pci_lintr_cb cb, void *arg)
 	}
 }
 
+/*
+ * Call cb for every emulated device on every bus.
+ */
+void
+pci_walk_vdev(pci_vdev_cb cb, void *arg)
+{
+	struct businfo *bi;
+	struct slotinfo *si;
+	struct pci_vdev *dev;
+	int bus, slot, func;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			si = &bi->slotinfo[slot];
+			for (func = 0; func < MAXFUNCS; func++) {
+				dev = si->si_funcs[func].fi_devi;
+				if (dev != NULL)
+					cb(dev, arg);
+			}
+		}
+	}
+}
+
 /*
  * Return 1 if the emulated device in 'slot' is a multi-function device.
  * Return 0 otherwise.
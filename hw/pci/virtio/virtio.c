@@ -29,11 +29,16 @@
 #include <sys/uio.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include "dm.h"
 #include "pci_core.h"
 #include "virtio.h"
+#include "monitor.h"
 
 /*
  * Functions for dealing with generalized "virtual devices" as
@@ -47,6 +52,9 @@
  */
 #define DEV_STRUCT(vs) ((void *)(vs))
 
+static pthread_once_t virtio_stats_once = PTHREAD_ONCE_INIT;
+static void virtio_stats_init(void);
+
 /*
  * Link a virtio_base to its constants, the virtio device, and
  * the PCI emulation.
@@ -60,6 +68,7 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 
 	/* base and pci_virtio_dev addresses must match */
 	assert((void *)base == pci_virtio_dev);
+	pthread_once(&virtio_stats_once, virtio_stats_init);
 	base->vops = vops;
 	base->dev = dev;
 	dev->arg = base;
@@ -68,6 +77,7 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	for (i = 0; i < vops->nvq; i++) {
 		queues[i].base = base;
 		queues[i].num = i;
+		pthread_mutex_init(&queues[i].mtx, NULL);
 	}
 }
 
@@ -350,8 +360,12 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	 */
 	idx = vq->last_avail;
 	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
-	if (ndesc == 0)
+	if (ndesc == 0) {
+		vq->stats.ring_empty++;
 		return 0;
+	}
+	if (ndesc == vq->qsize)
+		vq->stats.ring_full++;
 	if (ndesc > vq->qsize) {
 		/* XXX need better way to diagnose issues */
 		fprintf(stderr,
@@ -433,8 +447,11 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 				}
 			}
 		}
-		if ((vdir->flags & VRING_DESC_F_NEXT) == 0)
+		if ((vdir->flags & VRING_DESC_F_NEXT) == 0) {
+			vq->stats.chains++;
+			vq->stats.descs += i;
 			return i;
+		}
 	}
 loopy:
 	fprintf(stderr,
@@ -455,6 +472,16 @@ vq_retchain(struct virtio_vq_info *vq)
 	vq->last_avail--;
 }
 
+/*
+ * Return the last n_chains chains obtained by vq_getchain() back to
+ * the available queue, most recent first.
+ */
+void
+vq_retchains(struct virtio_vq_info *vq, uint16_t n_chains)
+{
+	vq->last_avail -= n_chains;
+}
+
 /*
  * Return specified request chain to the guest, setting its I/O length
  * to the provided value.
@@ -487,6 +514,37 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	vue->idx = idx;
 	vue->tlen = iolen;
 	vuh->idx = uidx;
+
+	vq->stats.bytes += iolen;
+}
+
+/*
+ * Return several request chains to the guest at once.  The used
+ * entries are all filled in before the used index moves, so the guest
+ * sees either none or all of them (as merged rx buffers require).
+ */
+void
+vq_relchains(struct virtio_vq_info *vq, uint16_t *idx, uint32_t *iolen,
+	     int n)
+{
+	uint16_t uidx, mask;
+	volatile struct vring_used *vuh;
+	volatile struct virtio_used *vue;
+	int i;
+
+	mask = vq->qsize - 1;
+	vuh = vq->used;
+
+	uidx = vuh->idx;
+	for (i = 0; i < n; i++) {
+		vue = &vuh->ring[uidx++ & mask];
+		vue->idx = idx[i];
+		vue->tlen = iolen[i];
+		vq->stats.bytes += iolen[i];
+	}
+	/* entries must be visible before the index that covers them */
+	mb();
+	vuh->idx = uidx;
 }
 
 /*
@@ -540,6 +598,8 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	}
 	if (intr)
 		vq_interrupt(base, vq);
+	else if (new_idx != old_idx)
+		vq->stats.intr_suppressed++;
 }
 
 struct config_reg {
@@ -627,6 +687,41 @@ virtio_find_modern_cr(int offset) {
 		offset);
 }
 
+/*
+ * Dispatch a guest queue notification to the device.
+ *
+ * The caller holds the device-wide lock, unless the device asked for
+ * per-queue locking, in which case we only take the queue's own lock.
+ */
+static void
+virtio_queue_notify(struct virtio_base *base, uint64_t idx)
+{
+	struct virtio_vq_info *vq;
+	struct virtio_ops *vops;
+
+	vops = base->vops;
+	if (idx >= vops->nvq) {
+		fprintf(stderr, "%s: queue %lu notify out of range\r\n",
+			vops->name, idx);
+		return;
+	}
+
+	vq = &base->queues[idx];
+	if (base->flags & VIRTIO_VQ_LOCKING)
+		VQ_LOCK(vq);
+	vq->stats.kicks++;
+	if (vq->notify)
+		(*vq->notify)(DEV_STRUCT(base), vq);
+	else if (vops->qnotify)
+		(*vops->qnotify)(DEV_STRUCT(base), vq);
+	else
+		fprintf(stderr,
+			"%s: qnotify queue %lu: missing vq/vops notify\r\n",
+			vops->name, idx);
+	if (base->flags & VIRTIO_VQ_LOCKING)
+		VQ_UNLOCK(vq);
+}
+
 /*
  * Handle pci config space reads.
  * If it's to the MSI-X info, do that.
@@ -763,6 +858,13 @@ virtio_pci_legacy_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 	/* XXX probably should do something better than just assert() */
 	assert(baridx == base->legacy_pio_bar_idx);
 
+	/* queue kicks don't need the device-wide lock, see virtio.h */
+	if ((base->flags & VIRTIO_VQ_LOCKING) &&
+	    offset == VIRTIO_CR_QNOTIFY && size == 2) {
+		virtio_queue_notify(base, value);
+		return;
+	}
+
 	if (base->mtx)
 		pthread_mutex_lock(base->mtx);
 
@@ -834,20 +936,7 @@ bad:
 		base->curq = value;
 		break;
 	case VIRTIO_CR_QNOTIFY:
-		if (value >= vops->nvq) {
-			fprintf(stderr, "%s: queue %d notify out of range\r\n",
-				name, (int)value);
-			goto done;
-		}
-		vq = &base->queues[value];
-		if (vq->notify)
-			(*vq->notify)(DEV_STRUCT(base), vq);
-		else if (vops->qnotify)
-			(*vops->qnotify)(DEV_STRUCT(base), vq);
-		else
-			fprintf(stderr,
-			    "%s: qnotify queue %d: missing vq/vops notify\r\n",
-				name, (int)value);
+		virtio_queue_notify(base, value);
 		break;
 	case VIRTIO_CR_STATUS:
 		base->status = value;
@@ -1387,30 +1476,8 @@ virtio_notify_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 			uint64_t value)
 {
 	struct virtio_base *base = dev->arg;
-	struct virtio_vq_info *vq;
-	struct virtio_ops *vops;
-	const char *name;
-	uint64_t idx;
-
-	idx = offset / VIRTIO_MODERN_NOTIFY_OFF_MULT;
-	vops = base->vops;
-	name = vops->name;
-
-	if (idx >= vops->nvq) {
-		fprintf(stderr,
-			"%s: queue %lu notify out of range\r\n", name, idx);
-		return;
-	}
 
-	vq = &base->queues[idx];
-	if (vq->notify)
-		(*vq->notify)(DEV_STRUCT(base), vq);
-	else if (vops->qnotify)
-		(*vops->qnotify)(DEV_STRUCT(base), vq);
-	else
-		fprintf(stderr,
-			"%s: qnotify queue %lu: missing vq/vops notify\r\n",
-			name, idx);
+	virtio_queue_notify(base, offset / VIRTIO_MODERN_NOTIFY_OFF_MULT);
 }
 
 static uint32_t
@@ -1501,6 +1568,13 @@ virtio_pci_modern_mmio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		return;
 	}
 
+	if ((base->flags & VIRTIO_VQ_LOCKING) &&
+	    capid == VIRTIO_PCI_CAP_NOTIFY_CFG) {
+		offset -= VIRTIO_CAP_NOTIFY_OFFSET;
+		virtio_notify_cfg_write(dev, offset, size, value);
+		return;
+	}
+
 	if (base->mtx)
 		pthread_mutex_lock(base->mtx);
 
@@ -1544,16 +1618,14 @@ virtio_pci_modern_pio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 			    uint64_t value)
 {
 	struct virtio_base *base = dev->arg;
-	struct virtio_vq_info *vq;
 	struct virtio_ops *vops;
 	const char *name;
-	uint64_t idx;
+	bool vq_locking;
 
 	assert(base->modern_pio_bar_idx == baridx);
 
 	vops = base->vops;
 	name = vops->name;
-	idx = value;
 
 	if (size != 1 && size != 2 && size != 4) {
 		fprintf(stderr,
@@ -1562,26 +1634,13 @@ virtio_pci_modern_pio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		return;
 	}
 
-	if (idx >= vops->nvq) {
-		fprintf(stderr,
-			"%s: queue %lu notify out of range\r\n", name, idx);
-		return;
-	}
-
-	if (base->mtx)
+	vq_locking = base->flags & VIRTIO_VQ_LOCKING;
+	if (base->mtx && !vq_locking)
 		pthread_mutex_lock(base->mtx);
 
-	vq = &base->queues[idx];
-	if (vq->notify)
-		(*vq->notify)(DEV_STRUCT(base), vq);
-	else if (vops->qnotify)
-		(*vops->qnotify)(DEV_STRUCT(base), vq);
-	else
-		fprintf(stderr,
-			"%s: qnotify queue %lu: missing vq/vops notify\r\n",
-			name, idx);
+	virtio_queue_notify(base, value);
 
-	if (base->mtx)
+	if (base->mtx && !vq_locking)
 		pthread_mutex_unlock(base->mtx);
 }
 
@@ -1650,3 +1709,229 @@ virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 	fprintf(stderr, "%s: write unexpected baridx %d\r\n",
 		base->vops->name, baridx);
 }
+
+/*
+ * Worker thread of a virtqueue pair.  Sleeps until kicked, then runs
+ * the device handler with no locks held.
+ */
+static void *
+virtio_vq_pair_thread(void *param)
+{
+	struct virtio_vq_pair *vqp = param;
+
+	pthread_mutex_lock(&vqp->mtx);
+	for (;;) {
+		while (!vqp->kicked && !vqp->closing) {
+			if (vqp->busy) {
+				vqp->busy = 0;
+				pthread_cond_broadcast(&vqp->idle);
+			}
+			pthread_cond_wait(&vqp->cond, &vqp->mtx);
+		}
+		if (vqp->closing)
+			break;
+		vqp->kicked = 0;
+		vqp->busy = 1;
+		pthread_mutex_unlock(&vqp->mtx);
+
+		(*vqp->handler)(DEV_STRUCT(vqp->base), vqp);
+
+		pthread_mutex_lock(&vqp->mtx);
+	}
+	vqp->busy = 0;
+	pthread_cond_broadcast(&vqp->idle);
+	pthread_mutex_unlock(&vqp->mtx);
+
+	return NULL;
+}
+
+void
+virtio_vq_pair_init(struct virtio_base *base, struct virtio_vq_pair *vqp,
+		    int idx, void (*handler)(void *, struct virtio_vq_pair *),
+		    void *priv)
+{
+	assert(2 * idx + 1 < base->vops->nvq);
+
+	memset(vqp, 0, sizeof(*vqp));
+	vqp->base = base;
+	vqp->rx = &base->queues[2 * idx];
+	vqp->tx = &base->queues[2 * idx + 1];
+	vqp->idx = idx;
+	vqp->cpu = -1;
+	vqp->handler = handler;
+	vqp->priv = priv;
+	pthread_mutex_init(&vqp->mtx, NULL);
+	pthread_cond_init(&vqp->cond, NULL);
+	pthread_cond_init(&vqp->idle, NULL);
+}
+
+int
+virtio_vq_pair_start(struct virtio_vq_pair *vqp, const char *name, int cpu)
+{
+	cpu_set_t cpuset;
+	long ncpus;
+	int rc;
+
+	rc = pthread_create(&vqp->tid, NULL, virtio_vq_pair_thread, vqp);
+	if (rc) {
+		fprintf(stderr, "%s: failed to create pair %d worker: %d\r\n",
+			vqp->base->vops->name, vqp->idx, rc);
+		return -1;
+	}
+	vqp->started = 1;
+	if (name)
+		pthread_setname_np(vqp->tid, name);
+
+	if (cpu < 0)
+		return 0;
+
+	/* wrap around if there are more pairs than host CPUs */
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus > 0)
+		cpu %= ncpus;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	rc = pthread_setaffinity_np(vqp->tid, sizeof(cpuset), &cpuset);
+	if (rc)
+		fprintf(stderr, "%s: failed to pin pair %d to cpu %d: %d\r\n",
+			vqp->base->vops->name, vqp->idx, cpu, rc);
+	else
+		vqp->cpu = cpu;
+
+	return 0;
+}
+
+void
+virtio_vq_pair_kick(struct virtio_vq_pair *vqp)
+{
+	pthread_mutex_lock(&vqp->mtx);
+	vqp->kicked = 1;
+	if (!vqp->busy)
+		pthread_cond_signal(&vqp->cond);
+	pthread_mutex_unlock(&vqp->mtx);
+}
+
+void
+virtio_vq_pair_wait_idle(struct virtio_vq_pair *vqp)
+{
+	pthread_mutex_lock(&vqp->mtx);
+	while (vqp->busy)
+		pthread_cond_wait(&vqp->idle, &vqp->mtx);
+	pthread_mutex_unlock(&vqp->mtx);
+}
+
+void
+virtio_vq_pair_stop(struct virtio_vq_pair *vqp)
+{
+	void *jval;
+
+	if (!vqp->started)
+		return;
+
+	pthread_mutex_lock(&vqp->mtx);
+	vqp->closing = 1;
+	pthread_cond_broadcast(&vqp->cond);
+	pthread_mutex_unlock(&vqp->mtx);
+
+	pthread_join(vqp->tid, &jval);
+	vqp->started = 0;
+}
+
+/*
+ * Virtqueue statistics, reported through the monitor socket.
+ *
+ * A REQ_VQ_STATS request is answered with one MSG_STR message per
+ * virtio device, holding one line of counters per virtqueue.
+ */
+struct virtio_stats_req {
+	struct msg_sender *sender;
+	char	buf[VMM_MSG_MAX_LEN];
+	size_t	len;
+};
+
+static void
+virtio_stats_flush(struct virtio_stats_req *req)
+{
+	struct vmm_msg *msg = (struct vmm_msg *)req->buf;
+
+	if (req->len == sizeof(struct vmm_msg))
+		return;
+
+	msg->magic = VMM_MSG_MAGIC;
+	msg->msgid = MSG_STR;
+	req->buf[req->len++] = '\0';
+	msg->len = req->len;
+	monitor_reply(req->sender, msg);
+	req->len = sizeof(struct vmm_msg);
+}
+
+static void
+virtio_stats_dev(struct pci_vdev *dev, void *arg)
+{
+	struct virtio_stats_req *req = arg;
+	struct virtio_base *base;
+	struct virtio_vq_stats *st;
+	char line[512];
+	int i, n;
+
+	/* only virtio devices have their bars handled by the virtio layer */
+	if (dev->dev_ops->vdev_barread != virtio_pci_read || !dev->arg)
+		return;
+
+	base = dev->arg;
+	for (i = 0; i < base->vops->nvq; i++) {
+		st = &base->queues[i].stats;
+		n = snprintf(line, sizeof(line),
+			"%02x:%02x.%x %s q%d size=%u kicks=%lu chains=%lu "
+			"descs=%lu bytes=%lu intr=%lu intr_suppressed=%lu "
+			"empty=%lu full=%lu avg_chain=%lu.%02lu drops=%lu "
+			"batches=%lu avg_batch=%lu ns_per_chain=%lu "
+			"busy_pps=%lu polls=%lu poll_hits=%lu poll_ns=%lu "
+			"throttled=%lu throttle_ns=%lu\n",
+			dev->bus, dev->slot, dev->func, base->vops->name, i,
+			base->queues[i].qsize, st->kicks, st->chains,
+			st->descs, st->bytes, st->intr_sent,
+			st->intr_suppressed, st->ring_empty, st->ring_full,
+			st->chains ? st->descs / st->chains : 0,
+			st->chains ? st->descs * 100 / st->chains % 100 : 0,
+			st->drops, st->batches,
+			st->batches ? st->chains / st->batches : 0,
+			st->chains ? st->svc_ns / st->chains : 0,
+			st->svc_ns ? (uint64_t)((double)st->chains *
+				1000000000.0 / st->svc_ns) : 0,
+			st->polls, st->poll_hits, st->poll_ns,
+			st->throttled, st->throttle_ns);
+		if (n >= sizeof(line))
+			n = sizeof(line) - 1;
+		if (req->len + n + 1 > sizeof(req->buf))
+			virtio_stats_flush(req);
+		memcpy(req->buf + req->len, line, n);
+		req->len += n;
+	}
+	virtio_stats_flush(req);
+}
+
+static void
+virtio_stats_handler(struct vmm_msg *msg, struct msg_sender *sender,
+		     void *priv)
+{
+	struct virtio_stats_req *req;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return;
+
+	req->sender = sender;
+	req->len = sizeof(struct vmm_msg);
+	pci_walk_vdev(virtio_stats_dev, req);
+	free(req);
+}
+
+static void
+virtio_stats_init(void)
+{
+	struct vmm_msg msg = { .msgid = REQ_VQ_STATS };
+
+	/* fails harmlessly if the monitor is not running */
+	monitor_register_handler(&msg, virtio_stats_handler, NULL);
+}
@@ -47,8 +47,27 @@
 #include "pci_core.h"
 #include "virtio.h"
 #include "block_if.h"
+#include "monitor.h"
 
-#define VIRTIO_BLK_RINGSZ	64
+#define VIRTIO_BLK_RINGSZ	64	/* default, see ringsz= */
+#define VIRTIO_BLK_RINGSZ_MAX	1024
+#define VIRTIO_BLK_MAXQ		16	/* request queues, see mq= */
+
+/*
+ * Data segments per request, see seg_max=.  virtio.c gives up on chains
+ * of more than 512 descriptors, which must include header and status.
+ */
+#define VIRTIO_BLK_SEG_MAX	510
+
+/* requests blockif can hold at most, all queues together */
+#define VIRTIO_BLK_DEPTH_MAX	4096
+
+/* largest single segment we advertise */
+#define VIRTIO_BLK_SIZE_MAX	(4 * 1024 * 1024)
+
+/* limits for DISCARD and WRITE_ZEROES requests */
+#define VIRTIO_BLK_MAX_DISCARD_SEG	32
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS	(1 << 22)	/* 2GB */
 
 #define VIRTIO_BLK_S_OK	0
 #define VIRTIO_BLK_S_IOERR	1
@@ -57,18 +76,24 @@
 #define	VIRTIO_BLK_BLK_ID_BYTES	20
 
 /* Capability bits */
+#define	VIRTIO_BLK_F_SIZE_MAX	(1 << 1)	/* Maximum segment size */
 #define	VIRTIO_BLK_F_SEG_MAX	(1 << 2)	/* Maximum request segments */
 #define	VIRTIO_BLK_F_BLK_SIZE	(1 << 6)	/* cfg block size valid */
 #define	VIRTIO_BLK_F_FLUSH	(1 << 9)	/* Cache flush support */
 #define	VIRTIO_BLK_F_TOPOLOGY	(1 << 10)	/* Optimal I/O alignment */
+#define	VIRTIO_BLK_F_CONFIG_WCE	(1 << 11)	/* Writeback mode in config */
+#define	VIRTIO_BLK_F_MQ		(1 << 12)	/* Multiple request queues */
+#define	VIRTIO_BLK_F_DISCARD	(1 << 13)	/* DISCARD is supported */
+#define	VIRTIO_BLK_F_WRITE_ZEROES (1 << 14)	/* WRITE_ZEROES is supported */
 
 /*
- * Host capabilities
+ * Host capabilities.  FLUSH and CONFIG_WCE are added per disk when the
+ * backing store has a write cache.
  */
 #define VIRTIO_BLK_S_HOSTCAPS      \
-	(VIRTIO_BLK_F_SEG_MAX |						    \
+	(VIRTIO_BLK_F_SIZE_MAX |					    \
+	VIRTIO_BLK_F_SEG_MAX |						    \
 	VIRTIO_BLK_F_BLK_SIZE |						    \
-	VIRTIO_BLK_F_FLUSH    |						    \
 	VIRTIO_BLK_F_TOPOLOGY |						    \
 	VIRTIO_RING_F_INDIRECT_DESC)	/* indirect descriptors */
 
@@ -92,6 +117,15 @@ struct virtio_blk_config {
 		uint32_t opt_io_size;
 	} topology;
 	uint8_t	writeback;
+	uint8_t	unused0;
+	uint16_t num_queues;
+	uint32_t max_discard_sectors;
+	uint32_t max_discard_seg;
+	uint32_t discard_sector_alignment;
+	uint32_t max_write_zeroes_sectors;
+	uint32_t max_write_zeroes_seg;
+	uint8_t	write_zeroes_may_unmap;
+	uint8_t	unused1[3];
 } __attribute__((packed));
 
 /*
@@ -103,12 +137,24 @@ struct virtio_blk_hdr {
 #define	VBH_OP_FLUSH		4
 #define	VBH_OP_FLUSH_OUT	5
 #define	VBH_OP_IDENT		8
+#define	VBH_OP_DISCARD		11
+#define	VBH_OP_WRITE_ZEROES	13
 #define	VBH_FLAG_BARRIER	0x80000000	/* OR'ed into type */
 	uint32_t type;
 	uint32_t ioprio;
 	uint64_t sector;
 } __attribute__((packed));
 
+/*
+ * Payload of DISCARD and WRITE_ZEROES, one per segment
+ */
+struct virtio_blk_discard_write_zeroes {
+	uint64_t sector;
+	uint32_t num_sectors;
+	uint32_t flags;
+#define	VBDW_FLAG_UNMAP		0x1	/* WRITE_ZEROES may deallocate */
+} __attribute__((packed));
+
 /*
  * Debug printf
  */
@@ -119,21 +165,43 @@ static int virtio_blk_debug;
 struct virtio_blk_ioreq {
 	struct blockif_req req;
 	struct virtio_blk *blk;
+	struct virtio_vq_info *vq;
 	uint8_t *status;
 	uint16_t idx;
+	struct blockif_range ranges[VIRTIO_BLK_MAX_DISCARD_SEG];
+};
+
+/*
+ * Per-device options, apart from those passed on to blockif
+ */
+struct virtio_blk_opts {
+	int nq;			/* mq= */
+	int ringsz;		/* ringsz= */
+	int seg_max;		/* seg_max= */
+	int depth;		/* depth=, at least a full ring per queue */
 };
 
 /*
- * Per-device struct
+ * Per-device struct.  Each request queue is serviced under its own
+ * vq lock and has its own slice of ios[], ringsz long, and of the
+ * chain_iov[]/chain_flags[] scratch space, seg_max + 2 long; all of
+ * them feed the one blockif context.
  */
 struct virtio_blk {
 	struct virtio_base base;
+	struct virtio_ops ops;
 	pthread_mutex_t mtx;
-	struct virtio_vq_info vq;
+	int nq;
+	int ringsz;
+	int seg_max;
+	struct virtio_vq_info vqs[VIRTIO_BLK_MAXQ];
+	struct iovec *chain_iov;
+	uint16_t *chain_flags;
+	struct iovec *iovs;	/* seg_max per request */
 	struct virtio_blk_config cfg;
 	struct blockif_ctxt *bc;
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+	struct virtio_blk_ioreq *ios;
 };
 
 static void virtio_blk_reset(void *);
@@ -143,7 +211,7 @@ static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
 
 static struct virtio_ops virtio_blk_ops = {
 	"virtio_blk",		/* our name */
-	1,			/* we support 1 virtqueue */
+	1,			/* 1 virtqueue, grown by mq= */
 	sizeof(struct virtio_blk_config), /* config reg size */
 	virtio_blk_reset,	/* reset */
 	virtio_blk_notify,	/* device-wide qnotify */
@@ -161,14 +229,16 @@ virtio_blk_reset(void *vdev)
 
 	DPRINTF(("virtio_blk: device reset requested !\n"));
 	virtio_reset_dev(&blk->base);
+	blockif_set_wce(blk->bc, 1);
+	blk->cfg.writeback = blockif_get_wce(blk->bc);
 }
 
+/*
+ * Complete a request.  The caller holds the lock of the request's queue.
+ */
 static void
-virtio_blk_done(struct blockif_req *br, int err)
+virtio_blk_complete(struct virtio_blk_ioreq *io, int err)
 {
-	struct virtio_blk_ioreq *io = br->param;
-	struct virtio_blk *blk = io->blk;
-
 	/* convert errno into a virtio block error return */
 	if (err == EOPNOTSUPP || err == ENOSYS)
 		*io->status = VIRTIO_BLK_S_UNSUPP;
@@ -181,10 +251,112 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	vq_relchain(&blk->vq, io->idx, 1);
-	vq_endchains(&blk->vq, 0);
-	pthread_mutex_unlock(&blk->mtx);
+	vq_relchain(io->vq, io->idx, 1);
+	vq_endchains(io->vq, 0);
+}
+
+static void
+virtio_blk_done(struct blockif_req *br, int err)
+{
+	struct virtio_blk_ioreq *io = br->param;
+
+	VQ_LOCK(io->vq);
+	virtio_blk_complete(io, err);
+	VQ_UNLOCK(io->vq);
+}
+
+/*
+ * Turn the segments of a DISCARD or WRITE_ZEROES request into one
+ * batched blockif request, merging segments that are back to back.
+ * Returns an errno for a request that cannot be carried out.
+ */
+static int
+virtio_blk_ranges(struct virtio_blk *blk, struct virtio_blk_ioreq *io,
+		  struct iovec *iov, int niov, int type)
+{
+	struct virtio_blk_discard_write_zeroes seg[VIRTIO_BLK_MAX_DISCARD_SEG];
+	struct blockif_range *r;
+	size_t len, clen;
+	uint32_t okflags;
+	int i, nseg;
+
+	len = 0;
+	for (i = 0; i < niov; i++) {
+		clen = MIN(iov[i].iov_len, sizeof(seg) - len);
+		if (clen < iov[i].iov_len)
+			return EINVAL;
+		memcpy((uint8_t *)seg + len, iov[i].iov_base, clen);
+		len += clen;
+	}
+	if (len == 0 || len % sizeof(seg[0]) != 0)
+		return EINVAL;
+
+	okflags = (type == VBH_OP_WRITE_ZEROES) ? VBDW_FLAG_UNMAP : 0;
+	nseg = len / sizeof(seg[0]);
+	io->req.nranges = 0;
+	io->req.resid = 0;
+	r = NULL;
+	for (i = 0; i < nseg; i++) {
+		if (seg[i].flags & ~okflags)
+			return EOPNOTSUPP;
+		if (seg[i].num_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS ||
+		    seg[i].sector > blk->cfg.capacity ||
+		    seg[i].num_sectors > blk->cfg.capacity - seg[i].sector)
+			return EINVAL;
+		if (seg[i].num_sectors == 0)
+			continue;
+		if (r != NULL && r->offset + r->len ==
+		    (off_t)seg[i].sector * DEV_BSIZE) {
+			r->len += (off_t)seg[i].num_sectors * DEV_BSIZE;
+		} else {
+			r = &io->ranges[io->req.nranges++];
+			r->offset = seg[i].sector * DEV_BSIZE;
+			r->len = (off_t)seg[i].num_sectors * DEV_BSIZE;
+		}
+		io->req.resid += (off_t)seg[i].num_sectors * DEV_BSIZE;
+	}
+	io->req.ranges = io->ranges;
+	io->req.offset = io->req.nranges ? io->ranges[0].offset : 0;
+	return 0;
+}
+
+/*
+ * Fail a chain longer than seg_max + 2.  Its status byte is past what
+ * the scratch space holds, so fetch the chain again in full to reach
+ * it; if even that does not work, the device needs a reset.
+ */
+static void
+virtio_blk_reject(struct virtio_blk *blk, struct virtio_vq_info *vq,
+		  uint16_t idx, int n)
+{
+	struct iovec *iov;
+	uint16_t *flags;
+	int m;
+
+	iov = calloc(n, sizeof(struct iovec));
+	flags = calloc(n, sizeof(uint16_t));
+	if (iov == NULL || flags == NULL) {
+		vq_relchain(vq, idx, 0);
+		virtio_dev_error(&blk->base);
+		goto out;
+	}
+
+	vq_retchain(vq);
+	m = vq_getchain(vq, &idx, iov, n, flags);
+	if (m == n && (flags[n - 1] & VRING_DESC_F_WRITE) &&
+	    iov[n - 1].iov_len >= 1) {
+		*(uint8_t *)iov[n - 1].iov_base = VIRTIO_BLK_S_IOERR;
+		vq_relchain(vq, idx, 1);
+	} else {
+		/* the guest changed it under us */
+		if (m >= 1)
+			vq_relchain(vq, idx, 0);
+		virtio_dev_error(&blk->base);
+	}
+out:
+	vq_endchains(vq, 0);
+	free(iov);
+	free(flags);
 }
 
 static void
@@ -195,11 +367,21 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	int i, n;
 	int err;
 	ssize_t iolen;
-	int writeop, type;
-	struct iovec iov[BLOCKIF_IOV_MAX + 2];
-	uint16_t idx, flags[BLOCKIF_IOV_MAX + 2];
-
-	n = vq_getchain(vq, &idx, iov, BLOCKIF_IOV_MAX + 2, flags);
+	int writeop, type, q, maxn;
+	struct iovec *iov;
+	uint16_t idx, *flags;
+
+	q = vq - blk->vqs;
+	maxn = blk->seg_max + 2;
+	iov = &blk->chain_iov[q * maxn];
+	flags = &blk->chain_flags[q * maxn];
+	n = vq_getchain(vq, &idx, iov, maxn, flags);
+	if (n > maxn) {
+		WPRINTF(("virtio_blk: chain of %d exceeds seg_max %d\n",
+			 n - 2, blk->seg_max));
+		virtio_blk_reject(blk, vq, idx, n);
+		return;
+	}
 
 	/*
 	 * The first descriptor will be the read-only fixed header,
@@ -209,13 +391,13 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 * XXX - note - this fails on crash dump, which does a
 	 * VIRTIO_BLK_T_FLUSH with a zero transfer length
 	 */
-	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
+	assert(n >= 2);
 
-	io = &blk->ios[idx];
+	io = &blk->ios[q * blk->ringsz + idx];
 	assert((flags[0] & VRING_DESC_F_WRITE) == 0);
 	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
 	vbh = iov[0].iov_base;
-	memcpy(&io->req.iov, &iov[1], sizeof(struct iovec) * (n - 2));
+	memcpy(io->req.iov, &iov[1], sizeof(struct iovec) * (n - 2));
 	io->req.iovcnt = n - 2;
 	io->req.offset = vbh->sector * DEV_BSIZE;
 	io->status = iov[--n].iov_base;
@@ -228,7 +410,8 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 * we don't advertise the capability.
 	 */
 	type = vbh->type & ~VBH_FLAG_BARRIER;
-	writeop = (type == VBH_OP_WRITE);
+	writeop = (type == VBH_OP_WRITE || type == VBH_OP_DISCARD ||
+		   type == VBH_OP_WRITE_ZEROES);
 
 	iolen = 0;
 	for (i = 1; i < n; i++) {
@@ -258,16 +441,29 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	case VBH_OP_FLUSH_OUT:
 		err = blockif_flush(blk->bc, &io->req);
 		break;
+	case VBH_OP_DISCARD:
+	case VBH_OP_WRITE_ZEROES:
+		err = virtio_blk_ranges(blk, io, &iov[1], n - 1, type);
+		if (err != 0 || io->req.nranges == 0) {
+			/* nothing left to do if all segments were empty */
+			virtio_blk_complete(io, err);
+			return;
+		}
+		if (type == VBH_OP_DISCARD)
+			err = blockif_delete(blk->bc, &io->req);
+		else
+			err = blockif_zero(blk->bc, &io->req);
+		break;
 	case VBH_OP_IDENT:
 		/* Assume a single buffer */
 		/* S/n equal to buffer is not zero-terminated. */
 		memset(iov[1].iov_base, 0, iov[1].iov_len);
 		strncpy(iov[1].iov_base, blk->ident,
 		    MIN(iov[1].iov_len, sizeof(blk->ident)));
-		virtio_blk_done(&io->req, 0);
+		virtio_blk_complete(io, 0);
 		return;
 	default:
-		virtio_blk_done(&io->req, EOPNOTSUPP);
+		virtio_blk_complete(io, EOPNOTSUPP);
 		return;
 	}
 	assert(err == 0);
@@ -282,16 +478,202 @@ virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 		virtio_blk_proc(blk, vq);
 }
 
+/*
+ * Block statistics, reported through the monitor socket.
+ *
+ * A REQ_BLK_STATS request is answered with one MSG_STR message holding
+ * one line of counters per virtio-blk device.
+ */
+struct virtio_blk_stats_req {
+	struct msg_sender *sender;
+	char	buf[VMM_MSG_MAX_LEN];
+	size_t	len;
+};
+
+static pthread_once_t virtio_blk_monitor_once = PTHREAD_ONCE_INIT;
+
+static int virtio_blk_init(struct vmctx *, struct pci_vdev *, char *);
+
+static void
+virtio_blk_stats_flush(struct virtio_blk_stats_req *req)
+{
+	struct vmm_msg *msg = (struct vmm_msg *)req->buf;
+
+	if (req->len == sizeof(struct vmm_msg))
+		return;
+
+	msg->magic = VMM_MSG_MAGIC;
+	msg->msgid = MSG_STR;
+	req->buf[req->len++] = '\0';
+	msg->len = req->len;
+	monitor_reply(req->sender, msg);
+	req->len = sizeof(struct vmm_msg);
+}
+
+static void
+virtio_blk_stats_dev(struct pci_vdev *dev, void *arg)
+{
+	struct virtio_blk_stats_req *req = arg;
+	struct virtio_blk *blk;
+	struct blockif_stats st;
+	uint64_t per_io, bounced;
+	char line[400];
+	int n;
+
+	if (dev->dev_ops->vdev_init != virtio_blk_init || !dev->arg)
+		return;
+
+	blk = dev->arg;
+	blockif_get_stats(blk->bc, &st);
+	/* requests per merged I/O, in hundredths */
+	per_io = st.merge_ios ?
+		(st.merged + st.merge_ios) * 100 / st.merge_ios : 0;
+	/* share of data bytes that went through a bounce buffer, % */
+	bounced = (st.direct_bytes + st.bounce_bytes) ?
+		st.bounce_bytes * 10000 /
+		(st.direct_bytes + st.bounce_bytes) : 0;
+	n = snprintf(line, sizeof(line),
+		"%02x:%02x.%x virtio_blk reqs=%lu merged=%lu merge_ios=%lu "
+		"merge_bytes=%lu avg_merge=%lu.%02lu direct_bytes=%lu "
+		"bounce_bytes=%lu bounced=%lu.%02lu%% rc_hits=%lu "
+		"rc_misses=%lu ra_bytes=%lu\n",
+		dev->bus, dev->slot, dev->func, st.reqs, st.merged,
+		st.merge_ios, st.merge_bytes, per_io / 100, per_io % 100,
+		st.direct_bytes, st.bounce_bytes, bounced / 100,
+		bounced % 100, st.rc_hits, st.rc_misses, st.ra_bytes);
+	if (n >= sizeof(line))
+		n = sizeof(line) - 1;
+	if (req->len + n + 1 > sizeof(req->buf))
+		virtio_blk_stats_flush(req);
+	memcpy(req->buf + req->len, line, n);
+	req->len += n;
+}
+
+static void
+virtio_blk_stats_handler(struct vmm_msg *msg, struct msg_sender *sender,
+			 void *priv)
+{
+	struct virtio_blk_stats_req *req;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return;
+
+	req->sender = sender;
+	req->len = sizeof(struct vmm_msg);
+	pci_walk_vdev(virtio_blk_stats_dev, req);
+	virtio_blk_stats_flush(req);
+	free(req);
+}
+
+static void
+virtio_blk_monitor_init(void)
+{
+	struct vmm_msg msg = { .msgid = REQ_BLK_STATS };
+
+	/* fails harmlessly if the monitor is not running */
+	monitor_register_handler(&msg, virtio_blk_stats_handler, NULL);
+}
+
+/*
+ * Split the virtio-blk options (mq=, ringsz=, seg_max=) and depth= off
+ * the ones that go to blockif.  Returns the blockif option string, or
+ * NULL on a bad option.
+ */
+static char *
+virtio_blk_parseopts(const char *opts, struct virtio_blk_opts *vo)
+{
+	static const struct {
+		const char *name;
+		long min, max;
+	} nopts[] = {
+		{ "mq=",	1, VIRTIO_BLK_MAXQ },
+		{ "ringsz=",	2, VIRTIO_BLK_RINGSZ_MAX },
+		{ "seg_max=",	1, VIRTIO_BLK_SEG_MAX },
+		{ "depth=",	1, VIRTIO_BLK_DEPTH_MAX },
+	};
+	char *dup, *next, *cp, *end, *bopts;
+	size_t len, nlen;
+	long n;
+	int i;
+
+	dup = strdup(opts);
+	bopts = calloc(1, strlen(opts) + 1);
+	if (dup == NULL || bopts == NULL)
+		goto fail;
+
+	len = 0;
+	next = dup;
+	while ((cp = strsep(&next, ",")) != NULL) {
+		for (i = 0; i < sizeof(nopts) / sizeof(nopts[0]); i++) {
+			nlen = strlen(nopts[i].name);
+			if (!strncmp(cp, nopts[i].name, nlen))
+				break;
+		}
+		if (i < sizeof(nopts) / sizeof(nopts[0])) {
+			n = strtol(cp + nlen, &end, 10);
+			if (end == cp + nlen || *end != '\0' ||
+			    n < nopts[i].min || n > nopts[i].max ||
+			    (i == 1 && !powerof2(n))) {
+				fprintf(stderr, "Invalid %s\n", cp);
+				goto fail;
+			}
+			switch (i) {
+			case 0:
+				vo->nq = n;
+				break;
+			case 1:
+				vo->ringsz = n;
+				break;
+			case 2:
+				vo->seg_max = n;
+				break;
+			default:
+				vo->depth = n;
+				break;
+			}
+			continue;
+		}
+		if (len > 0)
+			bopts[len++] = ',';
+		strcpy(bopts + len, cp);
+		len += strlen(cp);
+	}
+
+	free(dup);
+	return bopts;
+
+fail:
+	free(dup);
+	free(bopts);
+	return NULL;
+}
+
+static void
+virtio_blk_free(struct virtio_blk *blk)
+{
+	if (blk == NULL)
+		return;
+	free(blk->ios);
+	free(blk->iovs);
+	free(blk->chain_iov);
+	free(blk->chain_flags);
+	free(blk);
+}
+
 static int
 virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	char bident[16];
+	char *bopts, *dopts;
+	struct virtio_blk_opts vo;
 	struct blockif_ctxt *bctxt;
 	MD5_CTX mdctx;
 	u_char digest[16];
 	struct virtio_blk *blk;
 	off_t size;
-	int i, sectsz, sts, sto;
+	int i, nq, sectsz, sts, sto;
+	size_t nio;
 	pthread_mutexattr_t attr;
 	int rc;
 
@@ -300,13 +682,45 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return -1;
 	}
 
+	vo.nq = 1;
+	vo.ringsz = VIRTIO_BLK_RINGSZ;
+	vo.seg_max = BLOCKIF_IOV_MAX;
+	vo.depth = 0;
+	bopts = virtio_blk_parseopts(opts, &vo);
+	if (bopts == NULL)
+		return -1;
+
+	/* no point in more queues than the guest has vcpus */
+	nq = vo.nq;
+	if (guest_ncpus > 0 && nq > guest_ncpus)
+		nq = guest_ncpus;
+
+	/*
+	 * Every queue can have a full ring in flight; make sure the
+	 * blockif context has room for all of them.
+	 */
+	if (nq * vo.ringsz > VIRTIO_BLK_DEPTH_MAX) {
+		fprintf(stderr, "virtio_blk: %d queues of %d exceed depth %d\n",
+			nq, vo.ringsz, VIRTIO_BLK_DEPTH_MAX);
+		free(bopts);
+		return -1;
+	}
+	if (vo.depth < nq * vo.ringsz)
+		vo.depth = nq * vo.ringsz;
+	if (asprintf(&dopts, "%s,depth=%d", bopts, vo.depth) < 0) {
+		free(bopts);
+		return -1;
+	}
+
 	/*
 	 * The supplied backing file has to exist
 	 */
 	snprintf(bident, sizeof(bident), "%d:%d", dev->slot, dev->func);
-	bctxt = blockif_open(opts, bident);
+	bctxt = blockif_open(dopts, bident);
+	free(dopts);
 	if (bctxt == NULL) {
 		perror("Could not open backing file");
+		free(bopts);
 		return -1;
 	}
 
@@ -314,20 +728,38 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	sectsz = blockif_sectsz(bctxt);
 	blockif_psectsz(bctxt, &sts, &sto);
 
+	nio = (size_t)nq * vo.ringsz;
 	blk = calloc(1, sizeof(struct virtio_blk));
-	if (!blk) {
+	if (blk) {
+		blk->ios = calloc(nio, sizeof(struct virtio_blk_ioreq));
+		blk->iovs = calloc(nio * vo.seg_max, sizeof(struct iovec));
+		blk->chain_iov = calloc(nq * (vo.seg_max + 2),
+					sizeof(struct iovec));
+		blk->chain_flags = calloc(nq * (vo.seg_max + 2),
+					  sizeof(uint16_t));
+	}
+	if (!blk || !blk->ios || !blk->iovs || !blk->chain_iov ||
+	    !blk->chain_flags) {
 		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		virtio_blk_free(blk);
+		blockif_close(bctxt);
+		free(bopts);
 		return -1;
 	}
 
 	blk->bc = bctxt;
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
+	blk->nq = nq;
+	blk->ringsz = vo.ringsz;
+	blk->seg_max = vo.seg_max;
+	for (i = 0; i < nio; i++) {
 		struct virtio_blk_ioreq *io = &blk->ios[i];
 
+		io->req.iov = &blk->iovs[i * vo.seg_max];
 		io->req.callback = virtio_blk_done;
 		io->req.param = io;
 		io->blk = blk;
-		io->idx = i;
+		io->vq = &blk->vqs[i / vo.ringsz];
+		io->idx = i % vo.ringsz;
 	}
 
 	/* init mutex attribute properly to avoid deadlock */
@@ -345,26 +777,40 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 					"error %d!\n", rc));
 
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq);
+	blk->ops = virtio_blk_ops;
+	blk->ops.nvq = nq;
+	if (blockif_get_wce(bctxt))
+		blk->ops.hv_caps |= VIRTIO_BLK_F_FLUSH |
+			VIRTIO_BLK_F_CONFIG_WCE;
+	if (nq > 1)
+		blk->ops.hv_caps |= VIRTIO_BLK_F_MQ;
+	if (!blockif_is_ro(bctxt)) {
+		blk->ops.hv_caps |= VIRTIO_BLK_F_WRITE_ZEROES;
+		if (blockif_candelete(bctxt))
+			blk->ops.hv_caps |= VIRTIO_BLK_F_DISCARD;
+	}
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs);
 	blk->base.mtx = &blk->mtx;
+	blk->base.flags |= VIRTIO_VQ_LOCKING;
 
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
-	/* blk->vq.vq_notify = we have no per-queue notify */
+	for (i = 0; i < nq; i++)
+		blk->vqs[i].qsize = vo.ringsz;
+	/* we have no per-queue notify */
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
 	 * md5 sum of the filename
 	 */
 	MD5_Init(&mdctx);
-	MD5_Update(&mdctx, opts, strlen(opts));
+	MD5_Update(&mdctx, bopts, strlen(bopts));
 	MD5_Final(digest, &mdctx);
 	sprintf(blk->ident, "ACRN--%02X%02X-%02X%02X-%02X%02X",
 	    digest[0], digest[1], digest[2], digest[3], digest[4], digest[5]);
 
 	/* setup virtio block config space */
 	blk->cfg.capacity = size / DEV_BSIZE; /* 512-byte units */
-	blk->cfg.size_max = 0;	/* not negotiated */
-	blk->cfg.seg_max = BLOCKIF_IOV_MAX;
+	blk->cfg.size_max = VIRTIO_BLK_SIZE_MAX;
+	blk->cfg.seg_max = vo.seg_max;
 	blk->cfg.geometry.cylinders = 0;	/* no geometry */
 	blk->cfg.geometry.heads = 0;
 	blk->cfg.geometry.sectors = 0;
@@ -373,9 +819,18 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	    (sts > sectsz) ? (ffsll(sts / sectsz) - 1) : 0;
 	blk->cfg.topology.alignment_offset =
 	    (sto != 0) ? ((sts - sto) / sectsz) : 0;
-	blk->cfg.topology.min_io_size = 0;
-	blk->cfg.topology.opt_io_size = 0;
-	blk->cfg.writeback = 0;
+	/* in logical blocks: the physical block, and a full request */
+	blk->cfg.topology.min_io_size = (sts > sectsz) ? sts / sectsz : 1;
+	blk->cfg.topology.opt_io_size = vo.seg_max * (4096 / sectsz ? : 1);
+	blk->cfg.writeback = blockif_get_wce(bctxt);
+	blk->cfg.num_queues = nq;
+	blk->cfg.max_discard_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+	blk->cfg.max_discard_seg = VIRTIO_BLK_MAX_DISCARD_SEG;
+	blk->cfg.discard_sector_alignment = sectsz / DEV_BSIZE;
+	blk->cfg.max_write_zeroes_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+	blk->cfg.max_write_zeroes_seg = VIRTIO_BLK_MAX_DISCARD_SEG;
+	blk->cfg.write_zeroes_may_unmap = 0;
+	free(bopts);
 
 	/*
 	 * Should we move some of this into virtio.c?  Could
@@ -388,9 +843,11 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BLOCK);
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
+	pthread_once(&virtio_blk_monitor_once, virtio_blk_monitor_init);
+
 	if (virtio_interrupt_init(&blk->base, fbsdrun_virtio_msix())) {
 		blockif_close(blk->bc);
-		free(blk);
+		virtio_blk_free(blk);
 		return -1;
 	}
 	virtio_set_io_bar(&blk->base, 0);
@@ -408,13 +865,25 @@ virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		blk = (struct virtio_blk *) dev->arg;
 		bctxt = blk->bc;
 		blockif_close(bctxt);
-		free(blk);
+		virtio_blk_free(blk);
 	}
 }
 
 static int
 virtio_blk_cfgwrite(void *vdev, int offset, int size, uint32_t value)
 {
+	struct virtio_blk *blk = vdev;
+
+	/* the writeback toggle is the only writable field */
+	if (offset == offsetof(struct virtio_blk_config, writeback) &&
+	    size == 1 &&
+	    (blk->base.negotiated_caps & VIRTIO_BLK_F_CONFIG_WCE)) {
+		blockif_set_wce(blk->bc, value & 1);
+		blk->cfg.writeback = blockif_get_wce(blk->bc);
+		DPRINTF(("virtio_blk: writeback %d\n\r", blk->cfg.writeback));
+		return 0;
+	}
+
 	DPRINTF(("virtio_blk: write to readonly reg %d\n\r", offset));
 	return -1;
 }
@@ -31,7 +31,15 @@
 #include <sys/select.h>
 #include <sys/uio.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <net/ethernet.h>
+#include <arpa/inet.h>
 #ifndef NETMAP_WITH_LIBS
 #define NETMAP_WITH_LIBS
 #endif
@@ -46,20 +54,61 @@
 #include <assert.h>
 #include <openssl/md5.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sysexits.h>
+#include <time.h>
 
 #include "types.h"
 #include "dm.h"
 #include "pci_core.h"
 #include "mevent.h"
 #include "virtio.h"
+#include "monitor.h"
 #include "netmap_user.h"
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <linux/if_packet.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
 
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
 
+/* largest frame the tap hands over with receive TSO enabled */
+#define VIRTIO_NET_MAX_GSO_LEN	(65535 + ETHER_HDR_LEN + 4)
+
+/*
+ * AF_PACKET ring geometry: 32 x 256KB receive blocks retired at
+ * least every ms, and 1024 transmit frames.
+ */
+#define VIRTIO_NET_PKT_BLKSZ	(1 << 18)
+#define VIRTIO_NET_PKT_RXBLKS	32
+#define VIRTIO_NET_PKT_TXBLKS	8
+#define VIRTIO_NET_PKT_FRAMESZ	2048
+#define VIRTIO_NET_PKT_TMO	1
+/* where tx frame data starts, as the kernel expects without tx offset */
+#define VIRTIO_NET_PKT_TXOFF	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+/*
+ * AF_XDP UMEM geometry.  The first half of the frames feed the fill
+ * ring, the second half are used for transmit; every ring is sized to
+ * hold all frames of its half so none of them can overflow.
+ */
+#define VIRTIO_NET_XSK_FRAMESZ	2048
+#define VIRTIO_NET_XSK_NFRAMES	4096
+#define VIRTIO_NET_XSK_RINGSZ	(VIRTIO_NET_XSK_NFRAMES / 2)
+
+/*
+ * Shared memory link geometry: two rings of fixed size slots, one per
+ * direction.  No offloads are negotiated on this backend, so a slot
+ * only has to hold an untagged or VLAN tagged ethernet frame.
+ */
+#define VIRTIO_NET_SHM_SLOTSZ	2048
+#define VIRTIO_NET_SHM_NSLOTS	1024
+/* neither side may resize the rings under the other */
+#define VIRTIO_NET_SHM_SEALS	(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
 /*
  * Host capabilities.  Note that we only offer a few of these.
  */
@@ -80,13 +129,30 @@
 #define	VIRTIO_NET_F_CTRL_VQ	(1 << 17) /* control channel available */
 #define	VIRTIO_NET_F_CTRL_RX	(1 << 18) /* control channel RX mode support */
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
+#define	VIRTIO_NET_F_CTRL_RX_EXTRA \
+				(1 << 20) /* extra RX mode control support */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* host supports multiple VQ pairs */
+#define	VIRTIO_NET_F_CTRL_MAC_ADDR \
+				(1 << 23) /* set MAC address via ctrl vq */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
+	VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_CTRL_RX | \
+	VIRTIO_NET_F_CTRL_RX_EXTRA | VIRTIO_NET_F_CTRL_VLAN | \
+	VIRTIO_NET_F_CTRL_MAC_ADDR | \
 	VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_RING_F_INDIRECT_DESC)
 
+/*
+ * Offloads, only offered when the backend carries the virtio-net
+ * header (a tap opened with IFF_VNET_HDR).
+ */
+#define VIRTIO_NET_S_OFFLOADS      \
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | \
+	VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | \
+	VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6)
+
 /* is address mcast/bcast? */
 #define ETHER_IS_MULTICAST(addr) (*(addr) & 0x01)
 
@@ -96,16 +162,115 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions.  Pair N uses queue 2N for receive and 2N+1 for
+ * transmit; the control queue follows the last pair when MQ is
+ * negotiated and sits at index 2 otherwise (the same with one pair).
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
+#define VIRTIO_NET_CTLQ	2
+
+#define VIRTIO_NET_MAXQP	8
+#define VIRTIO_NET_MAXQ		(VIRTIO_NET_MAXQP * 2 + 1)
+
+/*
+ * Transmit batching: chains sent before the backend is flushed and the
+ * used entries are published (txbatch=), and the longest the tx worker
+ * spins waiting for more chains before sleeping on kicks (txpoll=, in
+ * microseconds up to VIRTIO_NET_TXPOLL_MAX_US, 0 to disable).  The
+ * poll window adapts between VIRTIO_NET_TXPOLL_MIN_NS and that bound.
+ */
+#define VIRTIO_NET_TXBATCH	64
+#define VIRTIO_NET_TXBATCH_MAX	256
+#define VIRTIO_NET_TXPOLL_US	50
+#define VIRTIO_NET_TXPOLL_MAX_US 10000
+#define VIRTIO_NET_TXPOLL_MIN_NS 1000
+
+/*
+ * Rate limiting: one set of token buckets per direction.  A throttled
+ * tx worker sleeps in slices of at most VIRTIO_NET_RL_SLEEP_NS so a
+ * device reset is not held up.
+ */
+#define VIRTIO_NET_RL_RX	0
+#define VIRTIO_NET_RL_TX	1
+#define VIRTIO_NET_RL_SLEEP_NS	10000000UL
+#define VIRTIO_NET_RL_MAXBURST	(1UL << 32)
+
+/*
+ * Packet capture: frames are copied, up to the snap length, into a
+ * ring of fixed size slots and written out by a background thread.
+ */
+#define VIRTIO_NET_CAP_NSLOTS	1024
+#define VIRTIO_NET_CAP_SNAPMAX	2048
+#define VIRTIO_NET_CAP_SNAPLEN	256
+#define VIRTIO_NET_CAP_MAXINSNS	256
+#define VIRTIO_NET_CAP_IN	1	/* pcapng epb_flags: to the guest */
+#define VIRTIO_NET_CAP_OUT	2	/* from the guest */
+
+/*
+ * Control queue commands
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
+
+#define VIRTIO_NET_CTRL_RX			0
+#define  VIRTIO_NET_CTRL_RX_PROMISC		0
+#define  VIRTIO_NET_CTRL_RX_ALLMULTI		1
+#define  VIRTIO_NET_CTRL_RX_ALLUNI		2
+#define  VIRTIO_NET_CTRL_RX_NOMULTI		3
+#define  VIRTIO_NET_CTRL_RX_NOUNI		4
+#define  VIRTIO_NET_CTRL_RX_NOBCAST		5
+
+#define VIRTIO_NET_CTRL_MAC			1
+#define  VIRTIO_NET_CTRL_MAC_TABLE_SET		0
+#define  VIRTIO_NET_CTRL_MAC_ADDR_SET		1
+
+#define VIRTIO_NET_CTRL_VLAN			2
+#define  VIRTIO_NET_CTRL_VLAN_ADD		0
+#define  VIRTIO_NET_CTRL_VLAN_DEL		1
+
+#define VIRTIO_NET_CTRL_MQ			4
+#define  VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
+#define  VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN	1
+#define  VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX	0x8000
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_CTRL_BUFSZ	8192
+
+/*
+ * Receive filter.  MAC addresses set by the guest are kept in a small
+ * chained hash table; a guest asking for more than fits gets all
+ * frames of that kind instead.  VLANs are a bitmap indexed by VID.
+ */
+#define VIRTIO_NET_MAC_MAX	64
+#define VIRTIO_NET_MAC_HASHSZ	128
+#define VIRTIO_NET_VLAN_MAX	4096
+
+struct virtio_net_rxfilter {
+	pthread_rwlock_t lock;
+	int		active;		/* some frames may be filtered */
+	uint8_t		promisc;
+	uint8_t		allmulti;
+	uint8_t		alluni;
+	uint8_t		nomulti;
+	uint8_t		nouni;
+	uint8_t		nobcast;
+	uint8_t		uni_overflow;
+	uint8_t		multi_overflow;
+	int		nmacs;
+	uint8_t		macs[VIRTIO_NET_MAC_MAX][ETHER_ADDR_LEN];
+	int16_t		next[VIRTIO_NET_MAC_MAX];
+	int16_t		head[VIRTIO_NET_MAC_HASHSZ];
+	uint8_t		vlans[VIRTIO_NET_VLAN_MAX / 8];
+};
 
 /*
  * Fixed network header size
@@ -127,51 +292,221 @@ static int virtio_net_debug;
 #define DPRINTF(params) do { if (virtio_net_debug) printf params; } while (0)
 #define WPRINTF(params) (printf params)
 
+/*
+ * Per-queue-pair struct.  Each pair owns one queue of a multi-queue
+ * tap, serviced by the event loop for receive and by the pair worker
+ * for transmit.
+ */
+struct virtio_net_queue {
+	struct virtio_net *net;
+	struct virtio_vq_pair vqp;	/* tx worker */
+
+	int		tapfd;
+	int		attached;	/* tap queue is receiving */
+	struct mevent	*mevp;
+
+	int		rx_ready;
+	int		rx_parked;	/* rx fd off the event loop */
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+
+	uint64_t	tx_poll_ns;	/* current tx poll window */
+
+	int		rx_throttled;	/* rx fd off for the rate limit */
+	int		rl_tfd;		/* timerfd that resumes it */
+	struct mevent	*rl_mevp;
+};
+
+/*
+ * Token bucket.  Frames are let through while tokens are left and
+ * charged afterwards, so the count may go negative; the time to pay
+ * that back is how long the queue pauses.
+ */
+struct virtio_net_tb {
+	uint64_t	rate;		/* units per second, 0 for no limit */
+	uint64_t	burst;		/* bucket depth */
+	int64_t		tokens;
+	uint64_t	last;		/* ns of the last refill */
+};
+
+/*
+ * Rate limit of one direction of the device, shared by all its queue
+ * pairs: bytes (from the bps option) and packets.
+ */
+struct virtio_net_rl {
+	pthread_mutex_t	mtx;
+	volatile int	active;		/* either bucket has a rate */
+	struct virtio_net_tb bytes;
+	struct virtio_net_tb pkts;
+};
+
+/*
+ * AF_PACKET TPACKET_V3 backend state.  Receive is consumed a block at
+ * a time; transmit frames are queued and pushed with one sendto().
+ */
+struct virtio_net_pkt {
+	int		fd;
+	uint8_t		*map;
+	size_t		maplen;
+	struct tpacket_req3 rxreq;
+	struct tpacket_req3 txreq;
+	uint8_t		*rxring;
+	uint8_t		*txring;
+	unsigned int	rxblk;		/* block being consumed */
+	struct tpacket3_hdr *rxpkt;	/* next frame in it, or NULL */
+	unsigned int	rxleft;		/* frames left in it */
+	unsigned int	txframe;	/* next free tx frame */
+	unsigned int	txpending;	/* frames queued since last flush */
+};
+
+/*
+ * One AF_XDP ring as mapped from the socket.
+ */
+struct virtio_net_xsk_ring {
+	uint32_t	*producer;
+	uint32_t	*consumer;
+	uint32_t	*flags;
+	void		*ring;
+	void		*map;
+	size_t		maplen;
+};
+
+/*
+ * AF_XDP backend state.  An XDP program redirects the bound queue of
+ * the interface to the socket through an XSKMAP.
+ */
+struct virtio_net_xsk {
+	int		fd;
+	int		mapfd;
+	int		progfd;
+	int		linkfd;
+	uint8_t		*umem;
+	size_t		umemlen;
+	struct virtio_net_xsk_ring fq, cq, rx, tx;
+	uint64_t	txfree[VIRTIO_NET_XSK_RINGSZ];	/* free tx frames */
+	int		ntxfree;
+	uint32_t	txprod;		/* tx producer, not yet published */
+	unsigned int	txpending;
+};
+
+/*
+ * One direction of a shared memory link, a single producer single
+ * consumer ring living in the memfd both DMs map.  The consumer sets
+ * 'kick' before it goes to sleep on its eventfd; the producer clears
+ * it when it sends the wakeup.
+ */
+struct virtio_net_shm_ring {
+	volatile uint32_t head;		/* written by the producer */
+	uint8_t		pad0[60];
+	volatile uint32_t tail;		/* written by the consumer */
+	volatile uint32_t kick;
+	uint8_t		pad1[56];
+	struct {
+		uint32_t len;
+		uint8_t	data[VIRTIO_NET_SHM_SLOTSZ - sizeof(uint32_t)];
+	} slot[VIRTIO_NET_SHM_NSLOTS];
+};
+
+/*
+ * Shared memory backend state.  The DM that finds nobody listening on
+ * the socket path listens there, and on connection creates the memfd
+ * and the two eventfds and passes them over; it transmits on ring 0.
+ */
+struct virtio_net_shm {
+	int		sockfd;		/* listening or connected socket */
+	struct mevent	*sockmevp;
+	char		path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	void		*map;
+	struct virtio_net_shm_ring *txr, *rxr;
+	int		efd[2];		/* doorbell of ring 0 and ring 1 */
+	int		txefd, rxefd;
+	uint32_t	txhead;		/* tx producer, not yet published */
+	volatile int	up;
+};
+
+/*
+ * One captured frame.  seq tells producers and the writer whose turn
+ * the slot is, so several queues can add frames without a lock.
+ */
+struct virtio_net_cap_slot {
+	volatile uint64_t seq;
+	uint64_t	ts;		/* ns since the epoch */
+	uint32_t	len;		/* length on the wire */
+	uint32_t	caplen;
+	uint32_t	dir;
+	uint8_t		data[VIRTIO_NET_CAP_SNAPMAX];
+};
+
+struct virtio_net_cap {
+	struct virtio_net_cap_slot *ring;
+	uint64_t	head;		/* next slot for producers */
+	uint64_t	tail;		/* next slot for the writer */
+	struct sock_filter prog[VIRTIO_NET_CAP_MAXINSNS];
+	int		proglen;	/* 0 to take every frame */
+	int		users;		/* producers in cap_frame() */
+	uint32_t	snaplen;
+	FILE		*fp;
+	pthread_t	tid;
+	volatile int	running;
+	uint64_t	captured;
+	uint64_t	dropped;	/* ring was full */
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
+	struct virtio_vq_info queues[VIRTIO_NET_MAXQ];
+	struct virtio_ops ops;		/* nvq and caps depend on max_pairs */
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
 
-	int		tapfd;
 	struct nm_desc	*nmd;
-
-	int		rx_ready;
+	unsigned int	nm_txpending;	/* slots queued since last sync */
+	struct virtio_net_pkt pkt;
+	struct virtio_net_xsk xsk;
+	struct virtio_net_shm shm;
 
 	volatile int	resetting;	/* set and checked outside lock */
-	volatile int	closing;	/* stop the tx i/o thread */
 
 	uint64_t	features;	/* negotiated features */
 
 	struct virtio_net_config config;
+	struct virtio_net_rxfilter filter;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
-
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	int		rx_maxlen;	/* largest frame incl. header */
+	int		be_vhdr;	/* backend passes the vnet header */
+	uint64_t	be_caps;	/* offloads the backend supports */
+
+	int		max_pairs;
+	int		curr_pairs;
+	int		ctlq;		/* index of the control queue */
+	int		tx_batch;	/* chains per tx flush */
+	uint64_t	tx_poll_max;	/* tx poll bound, ns */
+	struct virtio_net_rl rl[2];	/* rx and tx rate limits */
+	volatile int	capturing;	/* checked on every frame */
+	struct virtio_net_cap cap;
+	struct virtio_net_queue qs[VIRTIO_NET_MAXQP];
+
+	void (*virtio_net_rx)(struct virtio_net_queue *q);
+	void (*virtio_net_tx)(struct virtio_net_queue *q, struct iovec *iov,
 			     int iovcnt, int len);
+	/* optional, pushes out frames queued by virtio_net_tx */
+	void (*virtio_net_tx_flush)(struct virtio_net_queue *q);
 };
 
 static void virtio_net_reset(void *);
-static void virtio_net_tx_stop(struct virtio_net *);
 /* static void virtio_net_notify(void *, struct virtio_vq_info *); */
 static int virtio_net_cfgread(void *, int, int, uint32_t *);
 static int virtio_net_cfgwrite(void *, int, int, uint32_t);
 static void virtio_net_neg_features(void *, uint64_t);
+static int virtio_net_init(struct vmctx *, struct pci_vdev *, char *);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	3,				/* 1 pair + ctrl, grown by mq= */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -200,40 +535,411 @@ ether_aton(const char *a, struct ether_addr *e)
 	return e;
 }
 
+static inline uint64_t
+virtio_net_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+virtio_net_tb_set(struct virtio_net_tb *tb, uint64_t rate, uint64_t burst)
+{
+	/* default to 100ms worth of traffic */
+	if (burst == 0)
+		burst = rate / 10;
+	tb->rate = rate;
+	tb->burst = MIN(MAX(burst, 1), VIRTIO_NET_RL_MAXBURST);
+	tb->tokens = tb->burst;
+	tb->last = virtio_net_clock_ns();
+}
+
+/*
+ * Refill the bucket and return how long to wait before it has tokens
+ * again, 0 if it has some now.  Time that did not add up to a whole
+ * token is carried over to the next refill.
+ */
+static uint64_t
+virtio_net_tb_delay(struct virtio_net_tb *tb, uint64_t now)
+{
+	uint64_t dt, full, add;
+
+	if (tb->rate == 0)
+		return 0;
+
+	dt = now - tb->last;
+	full = (tb->burst - tb->tokens) * 1000000000UL / tb->rate;
+	if (dt >= full) {
+		tb->tokens = tb->burst;
+		tb->last = now;
+	} else {
+		add = dt * tb->rate / 1000000000UL;
+		tb->tokens += add;
+		tb->last += add * 1000000000UL / tb->rate;
+	}
+
+	if (tb->tokens > 0)
+		return 0;
+	return (1 - tb->tokens) * 1000000000UL / tb->rate + 1;
+}
+
+static uint64_t
+virtio_net_rl_delay(struct virtio_net_rl *rl)
+{
+	uint64_t now, bdelay, pdelay;
+
+	if (!rl->active)
+		return 0;
+
+	pthread_mutex_lock(&rl->mtx);
+	now = virtio_net_clock_ns();
+	bdelay = virtio_net_tb_delay(&rl->bytes, now);
+	pdelay = virtio_net_tb_delay(&rl->pkts, now);
+	pthread_mutex_unlock(&rl->mtx);
+
+	return MAX(bdelay, pdelay);
+}
+
+static inline void
+virtio_net_rl_charge(struct virtio_net_rl *rl, int len)
+{
+	if (!rl->active)
+		return;
+
+	pthread_mutex_lock(&rl->mtx);
+	rl->bytes.tokens -= len;
+	rl->pkts.tokens--;
+	pthread_mutex_unlock(&rl->mtx);
+}
+
 /*
- * If the transmit thread is active then stall until it is done.
+ * Parse one rate limit option, "{rx,tx}_{bps,pps}=rate[:burst]".  bps
+ * rates are in bits per second with the burst in bytes, pps rates and
+ * bursts in packets.  Returns 1 if the option was a rate limit, 0 if
+ * it was not and -1 if it was malformed.
  */
+static int
+virtio_net_rl_parse(struct virtio_net *net, char *opt)
+{
+	static const char *names[] = { "rx_bps=", "rx_pps=",
+				       "tx_bps=", "tx_pps=" };
+	struct virtio_net_rl *rl;
+	unsigned long long rate, burst = 0;
+	char *val, *end;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (!strncmp(opt, names[i], strlen(names[i])))
+			break;
+	if (i == 4)
+		return 0;
+
+	val = opt + strlen(names[i]);
+	rate = strtoull(val, &end, 10);
+	if (end != val && *end == ':') {
+		val = end + 1;
+		burst = strtoull(val, &end, 10);
+	}
+	if (end == val || *end != '\0') {
+		fprintf(stderr, "Invalid %s\n", opt);
+		return -1;
+	}
+
+	rl = &net->rl[i < 2 ? VIRTIO_NET_RL_RX : VIRTIO_NET_RL_TX];
+	pthread_mutex_lock(&rl->mtx);
+	if (i & 1)
+		virtio_net_tb_set(&rl->pkts, rate, burst);
+	else
+		virtio_net_tb_set(&rl->bytes, rate / 8, burst);
+	rl->active = rl->bytes.rate || rl->pkts.rate;
+	pthread_mutex_unlock(&rl->mtx);
+
+	return 1;
+}
+
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_rl_timer(int fd, enum ev_type t, void *param)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
-		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+	struct virtio_net_queue *q = param;
+	uint64_t expired;
+
+	if (read(fd, &expired, sizeof(expired)) < 0)
+		return;
+
+	pthread_mutex_lock(&q->rx_mtx);
+	if (q->rx_throttled) {
+		q->rx_throttled = 0;
+		if (!q->rx_parked)
+			mevent_enable(q->mevp);
+	}
+	pthread_mutex_unlock(&q->rx_mtx);
+}
+
+/*
+ * Check the receive rate limit before taking another frame.  When it
+ * is used up the rx fd is taken off the event loop, leaving frames in
+ * the backend as with an empty guest ring, and a timer puts it back
+ * once the buckets have refilled.  Called with rx_mtx held.
+ */
+static int
+virtio_net_rx_throttle(struct virtio_net_queue *q)
+{
+	struct itimerspec its;
+	uint64_t delay;
+
+	delay = virtio_net_rl_delay(&q->net->rl[VIRTIO_NET_RL_RX]);
+	if (delay == 0)
+		return 0;
+
+	if (q->rl_tfd < 0) {
+		q->rl_tfd = timerfd_create(CLOCK_MONOTONIC,
+					   TFD_NONBLOCK | TFD_CLOEXEC);
+		if (q->rl_tfd < 0)
+			return 0;
+		q->rl_mevp = mevent_add(q->rl_tfd, EVF_READ,
+					virtio_net_rl_timer, q);
+		if (q->rl_mevp == NULL) {
+			close(q->rl_tfd);
+			q->rl_tfd = -1;
+			return 0;
+		}
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = delay / 1000000000UL;
+	its.it_value.tv_nsec = delay % 1000000000UL;
+	if (timerfd_settime(q->rl_tfd, 0, &its, NULL) < 0)
+		return 0;
+
+	q->vqp.rx->stats.throttled++;
+	q->vqp.rx->stats.throttle_ns += delay;
+	q->rx_throttled = 1;
+	mevent_disable(q->mevp);
+	return 1;
 }
 
 /*
  * If the receive thread is active then stall until it is done.
  */
 static void
-virtio_net_rxwait(struct virtio_net *net)
+virtio_net_rxwait(struct virtio_net_queue *q)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&q->rx_mtx);
+	while (q->rx_in_progress) {
+		pthread_mutex_unlock(&q->rx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+		pthread_mutex_lock(&q->rx_mtx);
+	}
+	pthread_mutex_unlock(&q->rx_mtx);
+}
+
+/*
+ * Attach the tap queues of the first n pairs and detach the rest, so
+ * the host only steers traffic to pairs the guest is servicing.
+ */
+static int
+virtio_net_set_pairs(struct virtio_net *net, int n)
+{
+	struct virtio_net_queue *q;
+	struct ifreq ifr;
+	int i, want;
+
+	if (net->max_pairs == 1 || net->qs[0].tapfd < 0) {
+		net->curr_pairs = 1;
+		return 0;
+	}
+
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qs[i];
+		want = (i < n);
+		if (q->tapfd < 0 || q->attached == want)
+			continue;
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = want ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		if (ioctl(q->tapfd, TUNSETQUEUE, (void *)&ifr) < 0) {
+			WPRINTF(("vtnet: %s tap queue %d failed: %s\n",
+				 want ? "attach" : "detach", i,
+				 strerror(errno)));
+			return -1;
+		}
+		q->attached = want;
+	}
+	net->curr_pairs = n;
+
+	return 0;
+}
+
+static void virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq);
+static void virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq);
+
+/*
+ * Point the queue notify callbacks at the right handlers.  Without MQ
+ * the control queue takes index 2, which otherwise is the receive
+ * queue of pair 1.
+ */
+static void
+virtio_net_set_ctlq(struct virtio_net *net, int ctlq)
+{
+	if (net->max_pairs > 1)
+		net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_rxq;
+	net->ctlq = ctlq;
+	net->queues[ctlq].notify = virtio_net_ping_ctlq;
+}
+
+static inline int
+virtio_net_mac_hash(const uint8_t *mac)
+{
+	uint32_t h;
+
+	/* the low bytes are the ones that differ between stations */
+	h = (mac[2] << 24) | (mac[3] << 16) | (mac[4] << 8) | mac[5];
+	return (h * 2654435761U) >> 25;
+}
+
+static int
+virtio_net_mac_lookup(struct virtio_net_rxfilter *f, const uint8_t *mac)
+{
+	int i;
+
+	for (i = f->head[virtio_net_mac_hash(mac)]; i >= 0; i = f->next[i])
+		if (!memcmp(f->macs[i], mac, ETHER_ADDR_LEN))
+			return 1;
+	return 0;
+}
+
+static int
+virtio_net_mac_add(struct virtio_net_rxfilter *f, const uint8_t *mac)
+{
+	int h;
+
+	if (f->nmacs == VIRTIO_NET_MAC_MAX)
+		return -1;
+
+	h = virtio_net_mac_hash(mac);
+	memcpy(f->macs[f->nmacs], mac, ETHER_ADDR_LEN);
+	f->next[f->nmacs] = f->head[h];
+	f->head[h] = f->nmacs++;
+	return 0;
+}
+
+static void
+virtio_net_mac_flush(struct virtio_net_rxfilter *f)
+{
+	f->nmacs = 0;
+	f->uni_overflow = f->multi_overflow = 0;
+	memset(f->head, 0xff, sizeof(f->head));
+}
+
+/*
+ * Recompute whether the rx path needs to look at frames at all.
+ * Called with the filter lock held for writing.
+ */
+static void
+virtio_net_filter_update(struct virtio_net *net)
+{
+	struct virtio_net_rxfilter *f = &net->filter;
+
+	f->active = ((net->features & VIRTIO_NET_F_CTRL_RX) && !f->promisc) ||
+		(net->features & VIRTIO_NET_F_CTRL_VLAN);
+}
+
+/*
+ * Back to the state a driver expects before it programs the filter:
+ * promiscuous, no addresses and no VLANs.
+ */
+static void
+virtio_net_filter_reset(struct virtio_net *net)
+{
+	struct virtio_net_rxfilter *f = &net->filter;
+
+	pthread_rwlock_wrlock(&f->lock);
+	f->promisc = 1;
+	f->allmulti = f->alluni = 0;
+	f->nomulti = f->nouni = f->nobcast = 0;
+	virtio_net_mac_flush(f);
+	memset(f->vlans, 0, sizeof(f->vlans));
+	virtio_net_filter_update(net);
+	pthread_rwlock_unlock(&f->lock);
+}
+
+/*
+ * Decide from its Ethernet header whether a received frame is one the
+ * guest asked for.  Runs before the frame is put on the guest ring.
+ */
+static int
+virtio_net_rx_accept(struct virtio_net *net, const uint8_t *eh, int len)
+{
+	static const uint8_t bcast[ETHER_ADDR_LEN] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	struct virtio_net_rxfilter *f = &net->filter;
+	uint16_t vid;
+	int ok = 1;
+
+	if (!f->active || len < ETHER_HDR_LEN)
+		return 1;
+
+	pthread_rwlock_rdlock(&f->lock);
+
+	/* untagged frames always pass the VLAN filter */
+	if ((net->features & VIRTIO_NET_F_CTRL_VLAN) &&
+	    len >= ETHER_HDR_LEN + 2 &&
+	    ((eh[12] << 8) | eh[13]) == ETHERTYPE_VLAN) {
+		vid = ((eh[14] << 8) | eh[15]) & (VIRTIO_NET_VLAN_MAX - 1);
+		ok = !!(f->vlans[vid / 8] & (1 << (vid % 8)));
+	}
+
+	if (ok && (net->features & VIRTIO_NET_F_CTRL_RX) && !f->promisc) {
+		if (!memcmp(eh, bcast, ETHER_ADDR_LEN))
+			ok = !f->nobcast;
+		else if (ETHER_IS_MULTICAST(eh))
+			ok = !f->nomulti && (f->allmulti || f->multi_overflow ||
+					     virtio_net_mac_lookup(f, eh));
+		else
+			ok = !f->nouni && (f->alluni || f->uni_overflow ||
+				!memcmp(eh, net->config.mac, ETHER_ADDR_LEN) ||
+				virtio_net_mac_lookup(f, eh));
+	}
+
+	pthread_rwlock_unlock(&f->lock);
+	return ok;
+}
+
+/*
+ * Tell the tap which offloads the guest accepts on receive and the
+ * header size in use.  Both are per-device, so any queue fd will do.
+ */
+static void
+virtio_net_tap_offload(struct virtio_net *net)
+{
+	unsigned int offload = 0;
+	int fd = net->qs[0].tapfd;
+
+	if (!net->be_vhdr || fd < 0)
+		return;
+
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM) {
+		offload |= TUN_F_CSUM;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO4)
+			offload |= TUN_F_TSO4;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO6)
+			offload |= TUN_F_TSO6;
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
+
+	if (ioctl(fd, TUNSETVNETHDRSZ, &net->rx_vhdrlen) < 0)
+		WPRINTF(("vtnet: TUNSETVNETHDRSZ %d failed: %s\n",
+			 net->rx_vhdrlen, strerror(errno)));
+	if (ioctl(fd, TUNSETOFFLOAD, offload) < 0)
+		WPRINTF(("vtnet: TUNSETOFFLOAD 0x%x failed: %s\n",
+			 offload, strerror(errno)));
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
@@ -243,46 +949,38 @@ virtio_net_reset(void *vdev)
 	 * Wait for the transmit and receive threads to finish their
 	 * processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->max_pairs; i++) {
+		virtio_vq_pair_wait_idle(&net->qs[i].vqp);
+		virtio_net_rxwait(&net->qs[i]);
+		net->qs[i].rx_ready = 0;
+	}
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	net->rx_maxlen = net->rx_vhdrlen + ETHER_MAX_LEN;
+	virtio_net_set_pairs(net, 1);
+	virtio_net_set_ctlq(net, net->max_pairs * 2);
 
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
+	net->features = 0;
+	virtio_net_tap_offload(net);
+	virtio_net_filter_reset(net);
 
 	net->resetting = 0;
-	net->closing = 0;
-}
-
-/*
- * Send signal to tx I/O thread and wait till it exits
- */
-static void
-virtio_net_tx_stop(struct virtio_net *net)
-{
-	void *jval;
-
-	net->closing = 1;
-
-	pthread_cond_broadcast(&net->tx_cond);
-
-	pthread_join(net->tx_tid, &jval);
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
+virtio_net_tap_tx(struct virtio_net_queue *q, struct iovec *iov, int iovcnt,
 		  int len)
 {
 	static char pad[60]; /* all zero bytes */
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	if (q->tapfd == -1)
 		return;
 
 	/*
@@ -295,19 +993,10 @@ virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
+	ret = writev(q->tapfd, iov, iovcnt);
 	(void)ret; /*avoid compiler warning*/
 }
 
-/*
- *  Called when there is read activity on the tap file descriptor.
- * Each buffer posted by the guest is assumed to be able to contain
- * an entire ethernet frame + rx header.
- *  MP note: the dummybuf is only used for discarding frames, so there
- * is no need for it to be per-vtnet or locked.
- */
-static uint8_t dummybuf[2048];
-
 static inline struct iovec *
 rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 {
@@ -329,558 +1018,2926 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
-static void
-virtio_net_tap_rx(struct virtio_net *net)
+/*
+ * Copy a frame from a contiguous buffer into guest iovecs.  Returns
+ * the number of bytes that fit.
+ */
+static int
+virtio_net_buf_to_iov(const uint8_t *buf, int len, struct iovec *iov,
+		      int iovcnt)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
-	struct virtio_vq_info *vq;
-	void *vrx;
-	int len, n;
-	uint16_t idx;
-	ssize_t ret;
+	int i, seg, off = 0;
+
+	for (i = 0; i < iovcnt && off < len; i++) {
+		seg = len - off;
+		if (iov[i].iov_len < seg)
+			seg = iov[i].iov_len;
+		memcpy(iov[i].iov_base, buf + off, seg);
+		off += seg;
+	}
 
-	/*
-	 * Should never be called without a valid tap fd
-	 */
-	assert(net->tapfd != -1);
+	return off;
+}
 
-	/*
+/*
+ * Gather the first bytes of a frame sitting in guest iovecs, skipping
+ * the virtio-net header, so the receive filter can look at them.
+ */
+static int
+virtio_net_iov_peek(struct iovec *iov, int niov, int skip, uint8_t *buf,
+		    int len)
+{
+	int i, seg, off = 0;
+
+	for (i = 0; i < niov && off < len; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		seg = iov[i].iov_len - skip;
+		if (seg > len - off)
+			seg = len - off;
+		memcpy(buf + off, (uint8_t *)iov[i].iov_base + skip, seg);
+		off += seg;
+		skip = 0;
+	}
+
+	return off;
+}
+
+/*
+ * Run a classic BPF program over a frame, as the kernel does for a
+ * socket filter.  Only the first buflen bytes are at hand; loads past
+ * them reject the frame.  Returns the number of bytes to keep.
+ */
+static uint32_t
+virtio_net_bpf_run(const struct sock_filter *pc, const uint8_t *p,
+		   uint32_t buflen, uint32_t wirelen)
+{
+	uint32_t A = 0, X = 0, k, mem[BPF_MEMWORDS];
+
+	memset(mem, 0, sizeof(mem));
+	for (;; pc++) {
+		k = pc->k;
+		switch (pc->code) {
+		case BPF_RET | BPF_K:
+			return k;
+		case BPF_RET | BPF_A:
+			return A;
+		case BPF_LD | BPF_W | BPF_IND:
+			k += X;
+			/* FALLTHROUGH */
+		case BPF_LD | BPF_W | BPF_ABS:
+			if (k >= buflen || buflen - k < 4)
+				return 0;
+			A = (uint32_t)p[k] << 24 | (uint32_t)p[k + 1] << 16 |
+			    (uint32_t)p[k + 2] << 8 | p[k + 3];
+			break;
+		case BPF_LD | BPF_H | BPF_IND:
+			k += X;
+			/* FALLTHROUGH */
+		case BPF_LD | BPF_H | BPF_ABS:
+			if (k >= buflen || buflen - k < 2)
+				return 0;
+			A = (uint32_t)p[k] << 8 | p[k + 1];
+			break;
+		case BPF_LD | BPF_B | BPF_IND:
+			k += X;
+			/* FALLTHROUGH */
+		case BPF_LD | BPF_B | BPF_ABS:
+			if (k >= buflen)
+				return 0;
+			A = p[k];
+			break;
+		case BPF_LD | BPF_W | BPF_LEN:
+			A = wirelen;
+			break;
+		case BPF_LDX | BPF_W | BPF_LEN:
+			X = wirelen;
+			break;
+		case BPF_LD | BPF_IMM:
+			A = k;
+			break;
+		case BPF_LDX | BPF_IMM:
+			X = k;
+			break;
+		case BPF_LD | BPF_MEM:
+			A = mem[k];
+			break;
+		case BPF_LDX | BPF_MEM:
+			X = mem[k];
+			break;
+		case BPF_LDX | BPF_B | BPF_MSH:
+			if (k >= buflen)
+				return 0;
+			X = (p[k] & 0xf) << 2;
+			break;
+		case BPF_ST:
+			mem[k] = A;
+			break;
+		case BPF_STX:
+			mem[k] = X;
+			break;
+		case BPF_JMP | BPF_JA:
+			pc += k;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_K:
+			pc += (A > k) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_K:
+			pc += (A >= k) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_K:
+			pc += (A == k) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_K:
+			pc += (A & k) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_X:
+			pc += (A > X) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_X:
+			pc += (A >= X) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_X:
+			pc += (A == X) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_X:
+			pc += (A & X) ? pc->jt : pc->jf;
+			break;
+		case BPF_ALU | BPF_ADD | BPF_X:
+			A += X;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_X:
+			A -= X;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_X:
+			A *= X;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_X:
+			if (X == 0)
+				return 0;
+			A /= X;
+			break;
+		case BPF_ALU | BPF_MOD | BPF_X:
+			if (X == 0)
+				return 0;
+			A %= X;
+			break;
+		case BPF_ALU | BPF_AND | BPF_X:
+			A &= X;
+			break;
+		case BPF_ALU | BPF_OR | BPF_X:
+			A |= X;
+			break;
+		case BPF_ALU | BPF_XOR | BPF_X:
+			A ^= X;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_X:
+			A = X < 32 ? A << X : 0;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_X:
+			A = X < 32 ? A >> X : 0;
+			break;
+		case BPF_ALU | BPF_ADD | BPF_K:
+			A += k;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_K:
+			A -= k;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_K:
+			A *= k;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_K:
+			A /= k;
+			break;
+		case BPF_ALU | BPF_MOD | BPF_K:
+			A %= k;
+			break;
+		case BPF_ALU | BPF_AND | BPF_K:
+			A &= k;
+			break;
+		case BPF_ALU | BPF_OR | BPF_K:
+			A |= k;
+			break;
+		case BPF_ALU | BPF_XOR | BPF_K:
+			A ^= k;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_K:
+			A <<= k;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_K:
+			A >>= k;
+			break;
+		case BPF_ALU | BPF_NEG:
+			A = -A;
+			break;
+		case BPF_MISC | BPF_TAX:
+			X = A;
+			break;
+		case BPF_MISC | BPF_TXA:
+			A = X;
+			break;
+		default:
+			/* not something a socket filter may use */
+			return 0;
+		}
+	}
+}
+
+/*
+ * Load a filter in "tcpdump -ddd" form: the instruction count, then
+ * "code jt jf k" for each instruction, separated by white space or
+ * commas.  The program is checked the way the kernel checks socket
+ * filters, so virtio_net_bpf_run() never leaves it or reads outside
+ * its scratch memory.
+ */
+static int
+virtio_net_bpf_load(struct sock_filter *prog, const char *text)
+{
+	const char *p = text;
+	unsigned long v[4];
+	char *end;
+	int n, i, j;
+
+	n = strtoul(p, &end, 10);
+	if (end == p || n < 1 || n > VIRTIO_NET_CAP_MAXINSNS)
+		return -1;
+	p = end;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < 4; j++) {
+			p += strspn(p, " \t\r\n,");
+			v[j] = strtoul(p, &end, 10);
+			if (end == p)
+				return -1;
+			p = end;
+		}
+		if (v[0] > 0xffff || v[1] > 0xff || v[2] > 0xff ||
+		    v[3] > 0xffffffffUL)
+			return -1;
+		prog[i].code = v[0];
+		prog[i].jt = v[1];
+		prog[i].jf = v[2];
+		prog[i].k = v[3];
+	}
+	p += strspn(p, " \t\r\n,");
+	if (*p != '\0')
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		struct sock_filter *f = &prog[i];
+
+		switch (BPF_CLASS(f->code)) {
+		case BPF_JMP:
+			if (f->code == (BPF_JMP | BPF_JA)) {
+				if (f->k >= n - i - 1)
+					return -1;
+			} else if (f->jt >= n - i - 1 || f->jf >= n - i - 1)
+				return -1;
+			break;
+		case BPF_LD:
+		case BPF_LDX:
+			if (BPF_MODE(f->code) == BPF_MEM &&
+			    f->k >= BPF_MEMWORDS)
+				return -1;
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			if (f->k >= BPF_MEMWORDS)
+				return -1;
+			break;
+		case BPF_ALU:
+			if ((BPF_OP(f->code) == BPF_DIV ||
+			     BPF_OP(f->code) == BPF_MOD) &&
+			    BPF_SRC(f->code) == BPF_K && f->k == 0)
+				return -1;
+			if ((BPF_OP(f->code) == BPF_LSH ||
+			     BPF_OP(f->code) == BPF_RSH) &&
+			    BPF_SRC(f->code) == BPF_K && f->k >= 32)
+				return -1;
+			break;
+		}
+	}
+	if (BPF_CLASS(prog[n - 1].code) != BPF_RET)
+		return -1;
+
+	return n;
+}
+
+/*
+ * Copy a frame into the capture ring if the filter wants it.  Called
+ * from any queue only while capturing; a full ring loses the frame.
+ * Producers are counted in users, so that virtio_net_cap_stop() can
+ * wait for the last one to leave before the program is replaced.
+ */
+static void
+virtio_net_cap_frame(struct virtio_net *net, int dir, struct iovec *iov,
+		     int niov, int skip, int len)
+{
+	struct virtio_net_cap *cap = &net->cap;
+	struct virtio_net_cap_slot *slot;
+	uint8_t buf[VIRTIO_NET_CAP_SNAPMAX];
+	struct timespec ts;
+	uint64_t pos, seq;
+	uint32_t keep;
+	int have;
+
+	__atomic_fetch_add(&cap->users, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&net->capturing, __ATOMIC_SEQ_CST))
+		goto out;
+
+	have = virtio_net_iov_peek(iov, niov, skip, buf,
+				   MIN(len, VIRTIO_NET_CAP_SNAPMAX));
+	keep = cap->proglen ?
+		virtio_net_bpf_run(cap->prog, buf, have, len) : len;
+	if (keep == 0)
+		goto out;
+	keep = MIN(MIN(keep, (uint32_t)have), cap->snaplen);
+
+	/* claim the slot at the head, unless the writer lags behind */
+	pos = __atomic_load_n(&cap->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &cap->ring[pos & (VIRTIO_NET_CAP_NSLOTS - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&cap->head, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(seq - pos) < 0) {
+			__atomic_fetch_add(&cap->dropped, 1, __ATOMIC_RELAXED);
+			goto out;
+		} else
+			pos = __atomic_load_n(&cap->head, __ATOMIC_RELAXED);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	slot->ts = (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	slot->len = len;
+	slot->caplen = keep;
+	slot->dir = dir;
+	memcpy(slot->data, buf, keep);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+out:
+	__atomic_fetch_sub(&cap->users, 1, __ATOMIC_RELEASE);
+}
+
+static int
+virtio_net_cap_write(FILE *fp, const void *data, size_t len)
+{
+	return fwrite(data, len, 1, fp) == 1 ? 0 : -1;
+}
+
+/*
+ * pcapng section header and the one interface description, with
+ * nanosecond timestamps.
+ */
+static int
+virtio_net_cap_header(struct virtio_net_cap *cap)
+{
+	uint32_t shb[7] = { 0x0a0d0d0a, 28, 0x1a2b3c4d, 1,
+			    0xffffffff, 0xffffffff, 28 };
+	uint32_t idb[8] = { 1, 32, 1, cap->snaplen,
+			    9 | 1 << 16, 9, 0, 32 };
+
+	return virtio_net_cap_write(cap->fp, shb, sizeof(shb)) ||
+	       virtio_net_cap_write(cap->fp, idb, sizeof(idb));
+}
+
+/*
+ * Write one frame as an enhanced packet block, with its direction in
+ * the epb_flags option.
+ */
+static int
+virtio_net_cap_epb(struct virtio_net_cap *cap,
+		   struct virtio_net_cap_slot *slot)
+{
+	uint32_t pad = (4 - slot->caplen % 4) % 4, zero = 0;
+	uint32_t total = 28 + slot->caplen + pad + 12 + 4;
+	uint32_t hdr[7] = { 6, total, 0, slot->ts >> 32, (uint32_t)slot->ts,
+			    slot->caplen, slot->len };
+	uint32_t opt[4] = { 2 | 4 << 16, slot->dir, 0, total };
+
+	return virtio_net_cap_write(cap->fp, hdr, sizeof(hdr)) ||
+	       virtio_net_cap_write(cap->fp, slot->data, slot->caplen) ||
+	       (pad && virtio_net_cap_write(cap->fp, &zero, pad)) ||
+	       virtio_net_cap_write(cap->fp, opt, sizeof(opt));
+}
+
+/*
+ * Move what the queues captured to the file; returns how many frames
+ * that was.  With fp NULL they are just discarded.
+ */
+static int
+virtio_net_cap_drain(struct virtio_net_cap *cap)
+{
+	struct virtio_net_cap_slot *slot;
+	int n = 0;
+
+	for (;;) {
+		slot = &cap->ring[cap->tail & (VIRTIO_NET_CAP_NSLOTS - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+		    cap->tail + 1)
+			break;
+		if (cap->fp && virtio_net_cap_epb(cap, slot) == 0)
+			cap->captured++;
+		__atomic_store_n(&slot->seq,
+				 cap->tail + VIRTIO_NET_CAP_NSLOTS,
+				 __ATOMIC_RELEASE);
+		cap->tail++;
+		n++;
+	}
+
+	return n;
+}
+
+static void *
+virtio_net_cap_thread(void *param)
+{
+	struct virtio_net_cap *cap = param;
+
+	while (virtio_net_cap_drain(cap) || cap->running) {
+		if (!cap->running)
+			continue;
+		fflush(cap->fp);
+		usleep(1000);
+	}
+	fflush(cap->fp);
+
+	return NULL;
+}
+
+static void
+virtio_net_cap_stop(struct virtio_net *net)
+{
+	struct virtio_net_cap *cap = &net->cap;
+	void *jval;
+
+	if (!cap->running)
+		return;
+
+	/* no producer may still be running the filter past this point */
+	__atomic_store_n(&net->capturing, 0, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&cap->users, __ATOMIC_ACQUIRE) != 0)
+		sched_yield();
+	cap->running = 0;
+	pthread_join(cap->tid, &jval);
+	fclose(cap->fp);
+	cap->fp = NULL;
+}
+
+static int
+virtio_net_cap_start(struct virtio_net *net, const char *path,
+		     unsigned int snaplen, const char *filter)
+{
+	struct virtio_net_cap *cap = &net->cap;
+	int i;
+
+	if (cap->running)
+		return -1;
+
+	if (cap->ring == NULL) {
+		cap->ring = calloc(VIRTIO_NET_CAP_NSLOTS, sizeof(*cap->ring));
+		if (cap->ring == NULL)
+			return -1;
+		for (i = 0; i < VIRTIO_NET_CAP_NSLOTS; i++)
+			cap->ring[i].seq = i;
+	} else {
+		/* frames that raced with the last stop are stale now */
+		virtio_net_cap_drain(cap);
+	}
+
+	cap->proglen = 0;
+	if (*filter) {
+		cap->proglen = virtio_net_bpf_load(cap->prog, filter);
+		if (cap->proglen < 0) {
+			cap->proglen = 0;
+			return -1;
+		}
+	}
+	cap->snaplen = snaplen ? MIN(snaplen, VIRTIO_NET_CAP_SNAPMAX) :
+		VIRTIO_NET_CAP_SNAPLEN;
+	cap->captured = cap->dropped = 0;
+
+	cap->fp = fopen(path, "w");
+	if (cap->fp == NULL)
+		return -1;
+	if (virtio_net_cap_header(cap))
+		goto fail;
+
+	cap->running = 1;
+	if (pthread_create(&cap->tid, NULL, virtio_net_cap_thread, cap)) {
+		cap->running = 0;
+		goto fail;
+	}
+	pthread_setname_np(cap->tid, "vtnet-capture");
+
+	/* the queues start copying frames from here on */
+	mb();
+	net->capturing = 1;
+	return 0;
+
+fail:
+	fclose(cap->fp);
+	cap->fp = NULL;
+	return -1;
+}
+
+/*
+ * Stop servicing the receive fd until the guest posts buffers, leaving
+ * frames queued in the backend (tap queue, packet ring, ...) instead of
+ * dropping them.  The guest is asked to kick on its next addition and
+ * the ring is re-checked, so buffers posted in between are not missed:
+ * then 0 is returned and the caller carries on.  'have' is the number
+ * of chains already seen to be too few.  Called with rx_mtx held;
+ * virtio_net_ping_rxq() resumes the fd.
+ */
+static int
+virtio_net_rx_park(struct virtio_net_queue *q, int have)
+{
+	struct virtio_vq_info *vq = q->vqp.rx;
+
+	if (q->rx_ready && !q->net->resetting) {
+		vq_kick_enable(vq);
+		if ((uint16_t)(vq->avail->idx - vq->last_avail) > have) {
+			vq_kick_disable(vq);
+			return 0;
+		}
+	}
+
+	q->rx_parked = 1;
+	mevent_disable(q->mevp);
+	return 1;
+}
+
+/*
+ * Deliver one received frame from a backend buffer to the guest.
+ * Returns -1 if the guest has no buffer posted for it.
+ */
+static int
+virtio_net_rx_copy(struct virtio_net *net, struct virtio_vq_info *vq,
+		   const uint8_t *buf, int len)
+{
+	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_net_rxhdr *vrxh;
+	uint16_t idx;
+	int n;
+
+	/* frames the guest did not ask for never reach the ring */
+	if (!virtio_net_rx_accept(net, buf, len)) {
+		vq->stats.drops++;
+		return 0;
+	}
+
+	if (!vq_has_descs(vq))
+		return -1;
+
+	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
+	if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
+		/* the guest's fault: drop the frame, not the DM */
+		if (n > VIRTIO_NET_MAXSEGS) {
+			WPRINTF(("vtnet: rx chain too long: %d\n", n));
+			vq_relchain(vq, idx, 0);
+		} else
+			WPRINTF(("vtnet: bad rx chain\n"));
+		vq->stats.drops++;
+		return 0;
+	}
+
+	vrxh = iov[0].iov_base;
+	riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
+	len = virtio_net_buf_to_iov(buf, len, riov, n);
+
+	memset(vrxh, 0, net->rx_vhdrlen);
+	if (net->rx_merge)
+		vrxh->vrh_bufs = 1;
+
+	if (net->capturing) {
+		struct iovec fiov = { (void *)buf, len };
+
+		virtio_net_cap_frame(net, VIRTIO_NET_CAP_IN, &fiov, 1, 0, len);
+	}
+
+	vq_relchain(vq, idx, len + net->rx_vhdrlen);
+	virtio_net_rl_charge(&net->rl[VIRTIO_NET_RL_RX], len);
+	return 0;
+}
+
+/*
+ * Called when there is read activity on the tap file descriptor.
+ * Each buffer posted by the guest is assumed to be able to contain
+ * an entire ethernet frame + rx header, or, with merged rx buffers,
+ * enough chains are gathered to hold the largest one.
+ */
+static void
+virtio_net_tap_rx(struct virtio_net_queue *q)
+{
+	struct virtio_net *net = q->net;
+	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	uint16_t idx[VIRTIO_NET_MAXSEGS];
+	uint32_t tlen[VIRTIO_NET_MAXSEGS];
+	struct virtio_vq_info *vq;
+	void *vrx;
+	int len, n, i, niov, nchains, room, full;
+
+	/*
+	 * Should never be called without a valid tap fd
+	 */
+	assert(q->tapfd != -1);
+
+	/*
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
+	 * Leave the frames in the tap queue until it kicks.
 	 */
-	if (!net->rx_ready || net->resetting) {
-		/*
-		 * Drop the packet and try later.
-		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
-		(void)ret; /*avoid compiler warning*/
-
+	if (!q->rx_ready || net->resetting) {
+		virtio_net_rx_park(q, 0);
 		return;
 	}
 
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = q->vqp.rx;
 	if (!vq_has_descs(vq)) {
 		/*
-		 * Drop the packet and try later.  Interrupt on
-		 * empty, if that's negotiated.
+		 * Interrupt on empty, if that's negotiated, and wait
+		 * for the guest to post more.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
-		(void)ret; /*avoid compiler warning*/
-
+		vq->stats.ring_empty++;
 		vq_endchains(vq, 1);
-		return;
+		if (virtio_net_rx_park(q, 0))
+			return;
 	}
 
 	do {
+		if (virtio_net_rx_throttle(q))
+			break;
+
 		/*
-		 * Get descriptor chain.
+		 * Get descriptor chains.  With merged rx bufs keep going
+		 * until there is room for the largest frame the tap may
+		 * hand us; otherwise a single chain has to do.
 		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+		niov = nchains = room = full = 0;
+		do {
+			n = vq_getchain(vq, &idx[nchains], &iov[niov],
+					VIRTIO_NET_MAXSEGS - niov, NULL);
+			if (n > VIRTIO_NET_MAXSEGS - niov) {
+				/*
+				 * The chain does not fit in what is left of
+				 * iov[]: give it back for the next frame and
+				 * go with the buffers already gathered.
+				 */
+				if (nchains == 0)
+					break;
+				vq_retchain(vq);
+				full = 1;
+				break;
+			}
+			if (n < 1)
+				break;
+			for (tlen[nchains] = 0, i = niov; i < niov + n; i++)
+				tlen[nchains] += iov[i].iov_len;
+			room += tlen[nchains];
+			niov += n;
+			nchains++;
+		} while (net->rx_merge && room < net->rx_maxlen &&
+			 niov < VIRTIO_NET_MAXSEGS && vq_has_descs(vq));
+
+		if (nchains == 0) {
+			if (n > VIRTIO_NET_MAXSEGS) {
+				/* could never be used, hand it back empty */
+				WPRINTF(("vtnet: rx chain too long: %d\n", n));
+				vq_relchain(vq, idx[0], 0);
+				continue;
+			}
+			WPRINTF(("vtnet: bad rx chain\n"));
+			vq_endchains(vq, 0);
+			return;
+		}
+
+		if (room < net->rx_maxlen && niov < VIRTIO_NET_MAXSEGS &&
+		    !full && net->rx_merge) {
+			/*
+			 * Not enough buffers posted for a full frame.
+			 * Rather than truncate it, let the guest see
+			 * what it has received so far and wait for it
+			 * to refill.
+			 */
+			vq_retchains(vq, nchains);
+			vq->stats.ring_empty++;
+			vq_endchains(vq, 1);
+			if (virtio_net_rx_park(q, nchains))
+				return;
+			continue;
+		}
 
 		/*
-		 * Get a pointer to the rx header, and use the
+		 * Get a pointer to the rx header.  The tap fills it in
+		 * when it carries the vnet header, otherwise use the
 		 * data immediately following it for the packet buffer.
 		 */
 		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
-
-		len = readv(net->tapfd, riov, n);
-
-		if (len < 0 && errno == EWOULDBLOCK) {
+		n = niov;
+		if (net->be_vhdr)
+			riov = iov;
+		else
+			riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
+
+		len = readv(q->tapfd, riov, n);
+
+		if (len < 0) {
+			if (errno != EWOULDBLOCK)
+				WPRINTF(("vtnet: tap read failed: %s\n",
+					 strerror(errno)));
 			/*
 			 * No more packets, but still some avail ring
 			 * entries.  Interrupt if needed/appropriate.
 			 */
-			vq_retchain(vq);
+			vq_retchains(vq, nchains);
 			vq_endchains(vq, 0);
 			return;
 		}
 
 		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
+		 * The frame already landed in guest memory, but a frame
+		 * the guest did not ask for is not published: its chains
+		 * go back to be reused by the next one.
+		 */
+		if (net->filter.active) {
+			uint8_t eh[ETHER_HDR_LEN + 2];
+			int skip = net->be_vhdr ? net->rx_vhdrlen : 0;
+
+			if (!virtio_net_rx_accept(net, eh,
+					virtio_net_iov_peek(riov, n, skip, eh,
+						MIN(len - skip,
+						    (int)sizeof(eh))))) {
+				vq_retchains(vq, nchains);
+				vq->stats.drops++;
+				continue;
+			}
+		}
+
+		if (net->capturing) {
+			int skip = net->be_vhdr ? net->rx_vhdrlen : 0;
+
+			virtio_net_cap_frame(net, VIRTIO_NET_CAP_IN, riov, n,
+					     skip, len - skip);
+		}
+
+		/*
+		 * Without the vnet header from the tap the only valid
+		 * field in the rx packet header is the number of buffers
+		 * if merged rx bufs were negotiated.  The tap leaves that
+		 * field alone, so it is always ours to fill in.
+		 */
+		if (!net->be_vhdr) {
+			memset(vrx, 0, net->rx_vhdrlen);
+			len += net->rx_vhdrlen;
+		}
+		virtio_net_rl_charge(&net->rl[VIRTIO_NET_RL_RX],
+				     len - net->rx_vhdrlen);
+
+		/*
+		 * Spread the frame over the chains it filled and give
+		 * back the ones it did not need.
 		 */
-		memset(vrx, 0, net->rx_vhdrlen);
+		for (i = 0; i < nchains && len > 0; i++) {
+			if (tlen[i] > len)
+				tlen[i] = len;
+			len -= tlen[i];
+		}
 
 		if (net->rx_merge) {
 			struct virtio_net_rxhdr *vrxh;
 
 			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
+			vrxh->vrh_bufs = i;
 		}
 
+		vq_retchains(vq, nchains - i);
+
 		/*
-		 * Release this chain and handle more chains.
+		 * Publish all chains of the frame together and handle
+		 * more chains.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
+		vq_relchains(vq, idx, tlen, i);
 	} while (vq_has_descs(vq));
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
 	vq_endchains(vq, 1);
 }
 
-static inline int
-virtio_net_netmap_writev(struct nm_desc *nmd, struct iovec *iov, int iovcnt)
+/*
+ * Find a tx ring of the vale port with a free slot, starting from the
+ * one used last.
+ */
+static struct netmap_ring *
+virtio_net_netmap_txring(struct nm_desc *nmd)
 {
-	int r, i;
-	int len = 0;
-
-	for (r = nmd->cur_tx_ring; ; ) {
-		struct netmap_ring *ring = NETMAP_TXRING(nmd->nifp, r);
-		uint32_t cur, idx;
-		char *buf;
+	struct netmap_ring *ring;
+	int r = nmd->cur_tx_ring;
 
-		if (nm_ring_empty(ring)) {
-			r++;
-			if (r > nmd->last_tx_ring)
-				r = nmd->first_tx_ring;
-			if (r == nmd->cur_tx_ring)
-				break;
-			continue;
-		}
-		cur = ring->cur;
-		idx = ring->slot[cur].buf_idx;
-		buf = NETMAP_BUF(ring, idx);
-
-		for (i = 0; i < iovcnt; i++) {
-			if (len + iov[i].iov_len > 2048)
-				break;
-			memcpy(&buf[len], iov[i].iov_base, iov[i].iov_len);
-			len += iov[i].iov_len;
+	do {
+		ring = NETMAP_TXRING(nmd->nifp, r);
+		if (!nm_ring_empty(ring)) {
+			nmd->cur_tx_ring = r;
+			return ring;
 		}
-		ring->slot[cur].len = len;
-		ring->head = ring->cur = nm_ring_next(ring, cur);
-		nmd->cur_tx_ring = r;
-		ioctl(nmd->fd, NIOCTXSYNC, NULL);
-		break;
-	}
+		if (++r > nmd->last_tx_ring)
+			r = nmd->first_tx_ring;
+	} while (r != nmd->cur_tx_ring);
 
-	return len;
+	return NULL;
 }
 
-static inline int
-virtio_net_netmap_readv(struct nm_desc *nmd, struct iovec *iov, int iovcnt)
-{
-	int len = 0;
-	int i = 0;
-	int r;
-
-	for (r = nmd->cur_rx_ring; ; ) {
-		struct netmap_ring *ring = NETMAP_RXRING(nmd->nifp, r);
-		uint32_t cur, idx;
-		char *buf;
-		size_t left;
-
-		if (nm_ring_empty(ring)) {
-			r++;
-			if (r > nmd->last_rx_ring)
-				r = nmd->first_rx_ring;
-			if (r == nmd->cur_rx_ring)
-				break;
-			continue;
-		}
-		cur = ring->cur;
-		idx = ring->slot[cur].buf_idx;
-		buf = NETMAP_BUF(ring, idx);
-		left = ring->slot[cur].len;
-
-		for (i = 0; i < iovcnt && left > 0; i++) {
-			if (iov[i].iov_len > left)
-				iov[i].iov_len = left;
-			memcpy(iov[i].iov_base, &buf[len], iov[i].iov_len);
-			len += iov[i].iov_len;
-			left -= iov[i].iov_len;
-		}
-		ring->head = ring->cur = nm_ring_next(ring, cur);
-		nmd->cur_rx_ring = r;
-		ioctl(nmd->fd, NIOCRXSYNC, NULL);
-		break;
-	}
-	for (; i < iovcnt; i++)
-		iov[i].iov_len = 0;
+static void
+virtio_net_netmap_tx_flush(struct virtio_net_queue *q)
+{
+	struct virtio_net *net = q->net;
+
+	if (net->nmd == NULL || net->nm_txpending == 0)
+		return;
 
-	return len;
+	/* one sync pushes every slot queued since the last one */
+	if (ioctl(net->nmd->fd, NIOCTXSYNC, NULL) < 0)
+		WPRINTF(("vtnet: NIOCTXSYNC failed: %s\n", strerror(errno)));
+	net->nm_txpending = 0;
 }
 
 /*
- * Called to send a buffer chain out to the vale port
+ * Called to send a buffer chain out to the vale port.  The slot is
+ * only filled in; virtio_net_netmap_tx_flush() syncs the ring.
  */
 static void
-virtio_net_netmap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
-		    int len)
+virtio_net_netmap_tx(struct virtio_net_queue *q, struct iovec *iov,
+		     int iovcnt, int len)
 {
-	static char pad[60]; /* all zero bytes */
+	struct virtio_net *net = q->net;
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+	char *buf;
+	int i, off;
 
 	if (net->nmd == NULL)
 		return;
 
-	/*
-	 * If the length is < 60, pad out to that and add the
-	 * extra zero'd segment to the iov. It is guaranteed that
-	 * there is always an extra iov available by the caller.
-	 */
+	ring = virtio_net_netmap_txring(net->nmd);
+	if (ring == NULL) {
+		/* rings full, reclaim the slots already sent and retry */
+		net->nm_txpending = 1;
+		virtio_net_netmap_tx_flush(q);
+		ring = virtio_net_netmap_txring(net->nmd);
+	}
+	if (ring == NULL || len > ring->nr_buf_size) {
+		q->vqp.tx->stats.drops++;
+		return;
+	}
+
+	slot = &ring->slot[ring->cur];
+	buf = NETMAP_BUF(ring, slot->buf_idx);
+	for (i = 0, off = 0; i < iovcnt; i++) {
+		memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+
+	/* pad short frames out to the minimum, as the tap path does */
 	if (len < 60) {
-		iov[iovcnt].iov_base = pad;
-		iov[iovcnt].iov_len = 60 - len;
-		iovcnt++;
+		memset(buf + len, 0, 60 - len);
+		len = 60;
 	}
-	(void) virtio_net_netmap_writev(net->nmd, iov, iovcnt);
+
+	slot->len = len;
+	slot->flags = 0;
+	ring->head = ring->cur = nm_ring_next(ring, ring->cur);
+	net->nm_txpending++;
 }
 
 static void
-virtio_net_netmap_rx(struct virtio_net *net)
+virtio_net_netmap_rx(struct virtio_net_queue *q)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_net *net = q->net;
+	struct nm_desc *nmd = net->nmd;
 	struct virtio_vq_info *vq;
-	void *vrx;
-	int len, n;
-	uint16_t idx;
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+	int r, stalled = 0;
 
 	/*
 	 * Should never be called without a valid netmap descriptor
 	 */
-	assert(net->nmd != NULL);
+	assert(nmd != NULL);
 
 	/*
-	 * But, will be called when the rx ring hasn't yet
-	 * been set up or the guest is resetting the device.
+	 * Frames arriving before the rx ring is set up, or while the
+	 * guest resets the device, stay in the netmap rings.
 	 */
-	if (!net->rx_ready || net->resetting) {
-		/*
-		 * Drop the packet and try later.
-		 */
-		(void) nm_nextpkt(net->nmd, (void *)dummybuf);
+	if (!q->rx_ready || net->resetting) {
+		virtio_net_rx_park(q, 0);
 		return;
 	}
+	vq = q->vqp.rx;
 
 	/*
-	 * Check for available rx buffers
+	 * Drain every slot of every rx ring, copying each frame straight
+	 * into a guest chain, then release them all with a single sync.
+	 * A frame the guest has no buffer for keeps its slot, and the
+	 * fd is parked until the guest posts more.
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
-	if (!vq_has_descs(vq)) {
-		/*
-		 * Drop the packet and try later.  Interrupt on
-		 * empty, if that's negotiated.
-		 */
-		(void) nm_nextpkt(net->nmd, (void *)dummybuf);
-		vq_endchains(vq, 1);
-		return;
+	for (r = nmd->first_rx_ring; r <= nmd->last_rx_ring && !stalled;
+	     r++) {
+		ring = NETMAP_RXRING(nmd->nifp, r);
+		while (!nm_ring_empty(ring)) {
+			if (virtio_net_rx_throttle(q)) {
+				stalled = 1;
+				break;
+			}
+			slot = &ring->slot[ring->cur];
+			if (virtio_net_rx_copy(net, vq,
+					(uint8_t *)NETMAP_BUF(ring,
+							      slot->buf_idx),
+					slot->len) < 0) {
+				vq->stats.ring_empty++;
+				vq_endchains(vq, 1);
+				if (virtio_net_rx_park(q, 0)) {
+					stalled = 1;
+					break;
+				}
+				continue;
+			}
+			ring->head = ring->cur = nm_ring_next(ring, ring->cur);
+		}
 	}
 
-	do {
-		/*
-		 * Get descriptor chain.
-		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+	if (ioctl(nmd->fd, NIOCRXSYNC, NULL) < 0)
+		WPRINTF(("vtnet: NIOCRXSYNC failed: %s\n", strerror(errno)));
+
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	vq_endchains(vq, 1);
+}
+
+static void
+virtio_net_packet_tx_flush(struct virtio_net_queue *q)
+{
+	struct virtio_net_pkt *pkt = &q->net->pkt;
+
+	if (pkt->fd < 0 || pkt->txpending == 0)
+		return;
+
+	/* one syscall sends every frame marked TP_STATUS_SEND_REQUEST */
+	if (sendto(pkt->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+	    errno != EAGAIN && errno != ENOBUFS)
+		WPRINTF(("vtnet: packet tx flush failed: %s\n",
+			 strerror(errno)));
+	pkt->txpending = 0;
+}
+
+/*
+ * Called to send a buffer chain out through the AF_PACKET tx ring.
+ * The frame is only queued; virtio_net_packet_tx_flush() sends it.
+ */
+static void
+virtio_net_packet_tx(struct virtio_net_queue *q, struct iovec *iov,
+		     int iovcnt, int len)
+{
+	struct virtio_net_pkt *pkt = &q->net->pkt;
+	struct tpacket3_hdr *ppd;
+	uint8_t *buf;
+	int i, off;
+
+	if (pkt->fd < 0)
+		return;
+
+	if (len > VIRTIO_NET_PKT_FRAMESZ - VIRTIO_NET_PKT_TXOFF) {
+		DPRINTF(("vtnet: %d byte frame too large, dropped\n\r", len));
+		q->vqp.tx->stats.drops++;
+		return;
+	}
+
+	ppd = (struct tpacket3_hdr *)(pkt->txring +
+			pkt->txframe * pkt->txreq.tp_frame_size);
+	if (ppd->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+		/* ring full, push out what is queued and retry once */
+		virtio_net_packet_tx_flush(q);
+		if (ppd->tp_status &
+		    (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+			DPRINTF(("vtnet: packet tx ring full, dropped\n\r"));
+			q->vqp.tx->stats.drops++;
+			return;
+		}
+	}
+
+	buf = (uint8_t *)ppd + VIRTIO_NET_PKT_TXOFF;
+	for (i = 0, off = 0; i < iovcnt; i++) {
+		memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+
+	/* pad short frames out to the minimum, as the tap path does */
+	if (len < 60) {
+		memset(buf + len, 0, 60 - len);
+		len = 60;
+	}
+
+	ppd->tp_len = len;
+	ppd->tp_next_offset = 0;
+	/* frame contents must be visible before the kernel owns it */
+	mb();
+	ppd->tp_status = TP_STATUS_SEND_REQUEST;
+
+	pkt->txframe = (pkt->txframe + 1) % pkt->txreq.tp_frame_nr;
+	pkt->txpending++;
+}
+
+static void
+virtio_net_packet_rx(struct virtio_net_queue *q)
+{
+	struct virtio_net *net = q->net;
+	struct virtio_net_pkt *pkt = &net->pkt;
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *ppd;
+	struct sockaddr_ll *sll;
+	struct virtio_vq_info *vq;
+	int stalled = 0;
+
+	assert(pkt->fd >= 0);
+
+	/*
+	 * Frames arriving before the rx ring is set up, or while the
+	 * guest resets the device, stay in the packet ring.
+	 */
+	if (!q->rx_ready || net->resetting) {
+		virtio_net_rx_park(q, 0);
+		return;
+	}
+	vq = q->vqp.rx;
+
+	while (!stalled) {
+		bd = (struct tpacket_block_desc *)(pkt->rxring +
+				pkt->rxblk * pkt->rxreq.tp_block_size);
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+			break;
+
+		if (pkt->rxpkt == NULL) {
+			pkt->rxpkt = (struct tpacket3_hdr *)((uint8_t *)bd +
+					bd->hdr.bh1.offset_to_first_pkt);
+			pkt->rxleft = bd->hdr.bh1.num_pkts;
+		}
+
+		while (pkt->rxleft > 0) {
+			if (virtio_net_rx_throttle(q)) {
+				stalled = 1;
+				break;
+			}
+			ppd = pkt->rxpkt;
+			sll = (struct sockaddr_ll *)((uint8_t *)ppd +
+				TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			/*
+			 * The host's own sends on the NIC show up here
+			 * too; they are not for the guest.
+			 */
+			if (sll->sll_pkttype != PACKET_OUTGOING &&
+			    virtio_net_rx_copy(net, vq,
+					(uint8_t *)ppd + ppd->tp_mac,
+					ppd->tp_snaplen) < 0) {
+				/*
+				 * Keep the frame, and the block, until
+				 * the guest posts more buffers.
+				 */
+				vq->stats.ring_empty++;
+				vq_endchains(vq, 1);
+				if (virtio_net_rx_park(q, 0)) {
+					stalled = 1;
+					break;
+				}
+				continue;
+			}
+			pkt->rxpkt = (struct tpacket3_hdr *)((uint8_t *)ppd +
+					ppd->tp_next_offset);
+			pkt->rxleft--;
+		}
+		if (pkt->rxleft > 0)
+			break;
+
+		/* hand the whole block back to the kernel */
+		mb();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		pkt->rxpkt = NULL;
+		pkt->rxblk = (pkt->rxblk + 1) % pkt->rxreq.tp_block_nr;
+	}
+
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	vq_endchains(vq, 1);
+}
+
+/*
+ * Move frames the kernel finished sending back onto the free list.
+ */
+static void
+virtio_net_xsk_reclaim(struct virtio_net_xsk *xsk)
+{
+	uint64_t *cq = xsk->cq.ring;
+	uint32_t prod, cons;
+
+	prod = __atomic_load_n(xsk->cq.producer, __ATOMIC_ACQUIRE);
+	for (cons = *xsk->cq.consumer; cons != prod; cons++)
+		xsk->txfree[xsk->ntxfree++] =
+			cq[cons & (VIRTIO_NET_XSK_RINGSZ - 1)];
+	__atomic_store_n(xsk->cq.consumer, cons, __ATOMIC_RELEASE);
+}
+
+static void
+virtio_net_xsk_tx_flush(struct virtio_net_queue *q)
+{
+	struct virtio_net_xsk *xsk = &q->net->xsk;
+
+	if (xsk->fd < 0 || xsk->txpending == 0)
+		return;
+
+	__atomic_store_n(xsk->tx.producer, xsk->txprod, __ATOMIC_RELEASE);
+	xsk->txpending = 0;
+
+	/* the driver only needs a kick when it went to sleep */
+	if ((*xsk->tx.flags & XDP_RING_NEED_WAKEUP) &&
+	    sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+	    errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+		WPRINTF(("vtnet: xsk tx kick failed: %s\n", strerror(errno)));
+
+	virtio_net_xsk_reclaim(xsk);
+}
+
+/*
+ * Called to send a buffer chain out through the AF_XDP tx ring.  The
+ * descriptor is only published by virtio_net_xsk_tx_flush().
+ */
+static void
+virtio_net_xsk_tx(struct virtio_net_queue *q, struct iovec *iov,
+		  int iovcnt, int len)
+{
+	struct virtio_net_xsk *xsk = &q->net->xsk;
+	struct xdp_desc *d;
+	uint64_t addr;
+	uint8_t *buf;
+	int i, off;
+
+	if (xsk->fd < 0)
+		return;
+
+	if (len > VIRTIO_NET_XSK_FRAMESZ) {
+		DPRINTF(("vtnet: %d byte frame too large, dropped\n\r", len));
+		q->vqp.tx->stats.drops++;
+		return;
+	}
+
+	if (xsk->ntxfree == 0) {
+		/* all frames in flight, push them and collect completions */
+		virtio_net_xsk_tx_flush(q);
+		if (xsk->ntxfree == 0) {
+			DPRINTF(("vtnet: xsk tx ring full, dropped\n\r"));
+			q->vqp.tx->stats.drops++;
+			return;
+		}
+	}
+
+	addr = xsk->txfree[--xsk->ntxfree];
+	buf = xsk->umem + addr;
+	for (i = 0, off = 0; i < iovcnt; i++) {
+		memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+
+	/* pad short frames out to the minimum, as the tap path does */
+	if (len < 60) {
+		memset(buf + len, 0, 60 - len);
+		len = 60;
+	}
+
+	d = (struct xdp_desc *)xsk->tx.ring +
+		(xsk->txprod & (VIRTIO_NET_XSK_RINGSZ - 1));
+	d->addr = addr;
+	d->len = len;
+	d->options = 0;
+	xsk->txprod++;
+	xsk->txpending++;
+}
+
+static void
+virtio_net_xsk_rx(struct virtio_net_queue *q)
+{
+	struct virtio_net *net = q->net;
+	struct virtio_net_xsk *xsk = &net->xsk;
+	struct virtio_vq_info *vq;
+	struct xdp_desc *d;
+	uint64_t *fq = xsk->fq.ring;
+	uint32_t prod, cons, fprod;
+
+	assert(xsk->fd >= 0);
+
+	/*
+	 * Frames arriving before the rx ring is set up, or while the
+	 * guest resets the device, stay in the rx ring.
+	 */
+	if (!q->rx_ready || net->resetting) {
+		virtio_net_rx_park(q, 0);
+		return;
+	}
+	vq = q->vqp.rx;
+
+	prod = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+	fprod = *xsk->fq.producer;
+	for (cons = *xsk->rx.consumer; cons != prod; cons++) {
+		if (virtio_net_rx_throttle(q))
+			break;
+		d = (struct xdp_desc *)xsk->rx.ring +
+			(cons & (VIRTIO_NET_XSK_RINGSZ - 1));
+		if (virtio_net_rx_copy(net, vq,
+				xsk->umem + d->addr, d->len) < 0) {
+			/*
+			 * Leave the frame on the rx ring until the
+			 * guest posts more buffers.
+			 */
+			vq->stats.ring_empty++;
+			vq_endchains(vq, 1);
+			if (virtio_net_rx_park(q, 0))
+				break;
+			cons--;
+			continue;
+		}
+
+		/* the frame goes straight back to the fill ring */
+		fq[fprod++ & (VIRTIO_NET_XSK_RINGSZ - 1)] =
+			d->addr & ~((uint64_t)VIRTIO_NET_XSK_FRAMESZ - 1);
+	}
+	__atomic_store_n(xsk->fq.producer, fprod, __ATOMIC_RELEASE);
+	__atomic_store_n(xsk->rx.consumer, cons, __ATOMIC_RELEASE);
+
+	if (*xsk->fq.flags & XDP_RING_NEED_WAKEUP)
+		(void) recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	vq_endchains(vq, 1);
+}
+
+/*
+ * Publish the frames queued on the shared memory ring and ring the
+ * peer's doorbell if it is waiting for them.
+ */
+static void
+virtio_net_shm_tx_flush(struct virtio_net_queue *q)
+{
+	struct virtio_net_shm *shm = &q->net->shm;
+	struct virtio_net_shm_ring *r = shm->txr;
+	uint64_t one = 1;
+
+	if (!shm->up || r->head == shm->txhead)
+		return;
+
+	__atomic_store_n(&r->head, shm->txhead, __ATOMIC_RELEASE);
+	/* the head must be visible before the kick flag is sampled */
+	mb();
+	if (r->kick) {
+		r->kick = 0;
+		if (write(shm->txefd, &one, sizeof(one)) < 0)
+			WPRINTF(("vtnet: shm kick failed: %s\n",
+				 strerror(errno)));
+	}
+}
+
+static void
+virtio_net_shm_tx(struct virtio_net_queue *q, struct iovec *iov,
+		  int iovcnt, int len)
+{
+	struct virtio_net_shm *shm = &q->net->shm;
+	struct virtio_net_shm_ring *r = shm->txr;
+	uint8_t *buf;
+	int i, off;
+
+	/* nothing to send to until the peer shows up, or a full ring */
+	if (!shm->up || len > sizeof(r->slot[0].data) ||
+	    shm->txhead - r->tail >= VIRTIO_NET_SHM_NSLOTS) {
+		q->vqp.tx->stats.drops++;
+		return;
+	}
+
+	buf = r->slot[shm->txhead & (VIRTIO_NET_SHM_NSLOTS - 1)].data;
+	for (i = 0, off = 0; i < iovcnt; i++) {
+		memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+
+	/* pad short frames out to the minimum, as the tap path does */
+	if (len < 60) {
+		memset(buf + len, 0, 60 - len);
+		len = 60;
+	}
+
+	r->slot[shm->txhead & (VIRTIO_NET_SHM_NSLOTS - 1)].len = len;
+	shm->txhead++;
+}
+
+static void
+virtio_net_shm_rx(struct virtio_net_queue *q)
+{
+	struct virtio_net *net = q->net;
+	struct virtio_net_shm *shm = &net->shm;
+	struct virtio_net_shm_ring *r = shm->rxr;
+	struct virtio_vq_info *vq;
+	uint32_t head, tail, len;
+	uint8_t *data;
+	uint64_t cnt;
+	int stalled = 0;
+
+	if (!shm->up)
+		return;
+
+	/*
+	 * Frames arriving before the rx ring is set up, or while the
+	 * guest resets the device, stay in the shared ring.
+	 */
+	if (!q->rx_ready || net->resetting) {
+		virtio_net_rx_park(q, 0);
+		return;
+	}
+	vq = q->vqp.rx;
+
+	/* take the doorbell first, so a kick for a later frame stays */
+	if (read(shm->rxefd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		WPRINTF(("vtnet: shm doorbell read failed: %s\n",
+			 strerror(errno)));
+
+	tail = r->tail;
+	while (!stalled) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			/* ask for a kick, then look once more */
+			r->kick = 1;
+			mb();
+			if (r->head == tail)
+				break;
+			r->kick = 0;
+			continue;
+		}
 
 		/*
-		 * Get a pointer to the rx header, and use the
-		 * data immediately following it for the packet buffer.
+		 * The ring is written by the peer DM: trust neither its
+		 * head nor the lengths in its slots.
 		 */
-		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
+		if (head - tail > VIRTIO_NET_SHM_NSLOTS) {
+			WPRINTF(("vtnet: shm ring head %u out of range\n",
+				 head));
+			vq->stats.drops += head - tail;
+			tail = head;
+		}
+
+		while (tail != head) {
+			if (virtio_net_rx_throttle(q)) {
+				stalled = 1;
+				break;
+			}
+			data = r->slot[tail & (VIRTIO_NET_SHM_NSLOTS - 1)].data;
+			len = __atomic_load_n(
+				&r->slot[tail & (VIRTIO_NET_SHM_NSLOTS - 1)].len,
+				__ATOMIC_RELAXED);
+			if (len > sizeof(r->slot[0].data)) {
+				vq->stats.drops++;
+				tail++;
+				continue;
+			}
+			if (virtio_net_rx_copy(net, vq, data, len) < 0) {
+				vq->stats.ring_empty++;
+				vq_endchains(vq, 1);
+				if (virtio_net_rx_park(q, 0)) {
+					stalled = 1;
+					break;
+				}
+				continue;
+			}
+			tail++;
+		}
+		/* hand the slots back to the producer */
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	/*
+	 * Frames were left behind: re-arm our own doorbell so the event
+	 * fires again when the fd is put back on the event loop.
+	 */
+	cnt = 1;
+	if (stalled && write(shm->rxefd, &cnt, sizeof(cnt)) < 0)
+		WPRINTF(("vtnet: shm doorbell write failed: %s\n",
+			 strerror(errno)));
+
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	vq_endchains(vq, 1);
+}
+
+/*
+ * Account one service pass of a queue in its stats, if it moved any
+ * chains, so packet rates and per-packet cost can be derived.
+ */
+static inline void
+virtio_net_account(struct virtio_vq_info *vq, uint64_t chains, uint64_t t0)
+{
+	if (vq->stats.chains != chains) {
+		vq->stats.batches++;
+		vq->stats.svc_ns += virtio_net_clock_ns() - t0;
+	}
+}
+
+static void
+virtio_net_rx_callback(int fd, enum ev_type type, void *param)
+{
+	struct virtio_net_queue *q = param;
+	struct virtio_vq_info *vq;
+	uint64_t chains, t0;
+
+	pthread_mutex_lock(&q->rx_mtx);
+	q->rx_in_progress = 1;
+	vq = q->vqp.rx;
+	chains = vq->stats.chains;
+	t0 = virtio_net_clock_ns();
+	q->net->virtio_net_rx(q);
+	virtio_net_account(vq, chains, t0);
+	q->rx_in_progress = 0;
+	pthread_mutex_unlock(&q->rx_mtx);
+
+}
+
+static void
+virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_net *net = vdev;
+	struct virtio_net_queue *q = &net->qs[vq->num / 2];
+
+	/*
+	 * A qnotify means that the rx process can now begin, or that
+	 * the guest posted the buffers a parked rx fd is waiting for.
+	 * Further kicks are only wanted once the ring runs dry again.
+	 */
+	pthread_mutex_lock(&q->rx_mtx);
+	q->rx_ready = 1;
+	vq_kick_disable(vq);
+	if (q->rx_parked) {
+		q->rx_parked = 0;
+		if (!q->rx_throttled)
+			mevent_enable(q->mevp);
+	}
+	pthread_mutex_unlock(&q->rx_mtx);
+}
+
+/*
+ * Send one chain.  Its index and length are handed back rather than
+ * released, so the caller can publish a whole batch at once.  Returns
+ * the length of the frame.
+ */
+static int
+virtio_net_proctx(struct virtio_net_queue *q, struct virtio_vq_info *vq,
+		  uint16_t *idx, uint32_t *tlen)
+{
+	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
+	int i, n;
+	int plen;
+
+	/*
+	 * Obtain chain of descriptors.  The first one is
+	 * really the header descriptor, so we need to sum
+	 * up two lengths: packet length and transfer length.
+	 */
+	n = vq_getchain(vq, idx, iov, VIRTIO_NET_MAXSEGS, NULL);
+	assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+	plen = 0;
+	*tlen = iov[0].iov_len;
+	for (i = 1; i < n; i++) {
+		plen += iov[i].iov_len;
+		*tlen += iov[i].iov_len;
+	}
+
+	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
+
+	if (q->net->capturing)
+		virtio_net_cap_frame(q->net, VIRTIO_NET_CAP_OUT, &iov[1], n - 1,
+				     0, plen);
+
+	/* hand the header over too if the backend can use it */
+	if (q->net->be_vhdr)
+		q->net->virtio_net_tx(q, iov, n, plen);
+	else
+		q->net->virtio_net_tx(q, &iov[1], n - 1, plen);
+
+	return plen;
+}
+
+static void
+virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_net *net = vdev;
+
+	/*
+	 * Any ring entries to process?
+	 */
+	if (!vq_has_descs(vq))
+		return;
+
+	/* Signal the tx worker of the pair for processing */
+	vq_kick_disable(vq);
+	virtio_vq_pair_kick(&net->qs[vq->num / 2].vqp);
+}
+
+/*
+ * With kicks still disabled, spin for up to the queue's poll window
+ * waiting for the guest to queue more chains, which is much cheaper
+ * than sleeping and taking a kick for them.  The window doubles when
+ * polling pays off and halves when it runs out, within txpoll=.
+ */
+static int
+virtio_net_tx_poll(struct virtio_net_queue *q, struct virtio_vq_info *vq)
+{
+	struct virtio_net *net = q->net;
+	uint64_t start, now;
+	int found;
+
+	if (net->tx_poll_max == 0)
+		return 0;
+
+	vq->stats.polls++;
+	start = now = virtio_net_clock_ns();
+	while (!(found = vq_has_descs(vq)) && !net->resetting &&
+	       now - start < q->tx_poll_ns) {
+		asm volatile("pause" ::: "memory");
+		now = virtio_net_clock_ns();
+	}
+	vq->stats.poll_ns += now - start;
+
+	if (found) {
+		vq->stats.poll_hits++;
+		q->tx_poll_ns = MIN(q->tx_poll_ns * 2, net->tx_poll_max);
+	} else
+		q->tx_poll_ns = MAX(q->tx_poll_ns / 2,
+				    VIRTIO_NET_TXPOLL_MIN_NS);
+
+	return found;
+}
+
+/*
+ * Sit out a transmit rate limit pause, with kicks still disabled so
+ * the guest ring fills up and pushes back on the guest's own queues.
+ */
+static void
+virtio_net_tx_throttle(struct virtio_net_queue *q, struct virtio_vq_info *vq,
+		       uint64_t delay)
+{
+	struct timespec ts;
+
+	delay = MIN(delay, VIRTIO_NET_RL_SLEEP_NS);
+	ts.tv_sec = 0;
+	ts.tv_nsec = delay;
+	nanosleep(&ts, NULL);
 
-		len = virtio_net_netmap_readv(net->nmd, riov, n);
+	vq->stats.throttled++;
+	vq->stats.throttle_ns += delay;
+}
 
-		if (len == 0) {
+/*
+ * Runs on the tx worker of the queue pair to process TX desc
+ */
+static void
+virtio_net_tx_handler(void *vdev, struct virtio_vq_pair *vqp)
+{
+	struct virtio_net *net = vdev;
+	struct virtio_net_queue *q = vqp->priv;
+	struct virtio_vq_info *vq = vqp->tx;
+	uint16_t idx[VIRTIO_NET_TXBATCH_MAX];
+	uint32_t tlen[VIRTIO_NET_TXBATCH_MAX];
+	struct virtio_net_rl *rl = &net->rl[VIRTIO_NET_RL_TX];
+	uint64_t chains, idle, t0, delay;
+	int n, plen;
+
+	while (!net->resetting && vq_has_descs(vq)) {
+		chains = vq->stats.chains;
+		idle = vq->stats.poll_ns + vq->stats.throttle_ns;
+		t0 = virtio_net_clock_ns();
+		vq_kick_disable(vq);
+		do {
 			/*
-			 * No more packets, but still some avail ring
-			 * entries.  Interrupt if needed/appropriate.
+			 * Run through entries, placing them into
+			 * iovecs and sending when an end-of-packet
+			 * is found
 			 */
-			vq_retchain(vq);
-			vq_endchains(vq, 0);
+			n = 0;
+			do {
+				delay = virtio_net_rl_delay(rl);
+				if (delay)
+					break;
+				plen = virtio_net_proctx(q, vq, &idx[n],
+							 &tlen[n]);
+				virtio_net_rl_charge(rl, plen);
+			} while (++n < net->tx_batch && vq_has_descs(vq));
+
+			/*
+			 * Push out whatever the backend batched up, then
+			 * hand the whole batch back to the guest.
+			 */
+			if (net->virtio_net_tx_flush)
+				net->virtio_net_tx_flush(q);
+			if (n)
+				vq_relchains(vq, idx, tlen, n);
+			if (delay)
+				virtio_net_tx_throttle(q, vq, delay);
+		} while (!net->resetting &&
+			 (vq_has_descs(vq) || virtio_net_tx_poll(q, vq)));
+
+		/*
+		 * Generate an interrupt if needed.
+		 */
+		vq_endchains(vq, 1);
+		/* time spent spinning or throttled is not service time */
+		virtio_net_account(vq, chains, t0 + vq->stats.poll_ns +
+				   vq->stats.throttle_ns - idle);
+
+		/*
+		 * Re-enable kicks, then pick up any chain the guest
+		 * queued before it could see the flag change.
+		 */
+		vq_kick_enable(vq);
+	}
+}
+
+static uint8_t
+virtio_net_ctrl_mq(struct virtio_net *net, uint8_t cmd, uint8_t *data,
+		   int len)
+{
+	uint16_t pairs;
+
+	if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+	    !(net->features & VIRTIO_NET_F_MQ) || len < sizeof(pairs))
+		return VIRTIO_NET_ERR;
+
+	memcpy(&pairs, data, sizeof(pairs));
+	if (pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || pairs > net->max_pairs)
+		return VIRTIO_NET_ERR;
+
+	DPRINTF(("vtnet: %d queue pairs active\n\r", pairs));
+	if (virtio_net_set_pairs(net, pairs))
+		return VIRTIO_NET_ERR;
+
+	return VIRTIO_NET_OK;
+}
+
+static uint8_t
+virtio_net_ctrl_rx(struct virtio_net *net, uint8_t cmd, uint8_t *data,
+		   int len)
+{
+	struct virtio_net_rxfilter *f = &net->filter;
+	uint8_t *mode;
+
+	if (len < 1)
+		return VIRTIO_NET_ERR;
+
+	switch (cmd) {
+	case VIRTIO_NET_CTRL_RX_PROMISC:
+		mode = &f->promisc;
+		break;
+	case VIRTIO_NET_CTRL_RX_ALLMULTI:
+		mode = &f->allmulti;
+		break;
+	case VIRTIO_NET_CTRL_RX_ALLUNI:
+		mode = &f->alluni;
+		break;
+	case VIRTIO_NET_CTRL_RX_NOMULTI:
+		mode = &f->nomulti;
+		break;
+	case VIRTIO_NET_CTRL_RX_NOUNI:
+		mode = &f->nouni;
+		break;
+	case VIRTIO_NET_CTRL_RX_NOBCAST:
+		mode = &f->nobcast;
+		break;
+	default:
+		return VIRTIO_NET_ERR;
+	}
+
+	pthread_rwlock_wrlock(&f->lock);
+	*mode = !!data[0];
+	virtio_net_filter_update(net);
+	pthread_rwlock_unlock(&f->lock);
+
+	return VIRTIO_NET_OK;
+}
+
+/*
+ * The MAC table comes as two lists, unicast then multicast, each a
+ * 32-bit count followed by the addresses.
+ */
+static uint8_t
+virtio_net_ctrl_mac(struct virtio_net *net, uint8_t cmd, uint8_t *data,
+		    int len)
+{
+	struct virtio_net_rxfilter *f = &net->filter;
+	uint32_t n[2];
+	uint8_t *macs[2];
+	int i, t, off = 0;
+
+	if (cmd == VIRTIO_NET_CTRL_MAC_ADDR_SET) {
+		if (len < ETHER_ADDR_LEN)
+			return VIRTIO_NET_ERR;
+		/* rx filtering compares against it under the lock */
+		pthread_rwlock_wrlock(&f->lock);
+		memcpy(net->config.mac, data, ETHER_ADDR_LEN);
+		virtio_net_filter_update(net);
+		pthread_rwlock_unlock(&f->lock);
+		return VIRTIO_NET_OK;
+	}
+
+	if (cmd != VIRTIO_NET_CTRL_MAC_TABLE_SET)
+		return VIRTIO_NET_ERR;
+
+	for (t = 0; t < 2; t++) {
+		if (len - off < sizeof(n[t]))
+			return VIRTIO_NET_ERR;
+		memcpy(&n[t], data + off, sizeof(n[t]));
+		off += sizeof(n[t]);
+		macs[t] = data + off;
+		if (n[t] > (len - off) / ETHER_ADDR_LEN)
+			return VIRTIO_NET_ERR;
+		off += n[t] * ETHER_ADDR_LEN;
+	}
+
+	pthread_rwlock_wrlock(&f->lock);
+	virtio_net_mac_flush(f);
+	for (t = 0; t < 2; t++)
+		for (i = 0; i < n[t]; i++)
+			if (virtio_net_mac_add(f,
+				macs[t] + i * ETHER_ADDR_LEN) < 0) {
+				if (t == 0)
+					f->uni_overflow = 1;
+				else
+					f->multi_overflow = 1;
+				break;
+			}
+	pthread_rwlock_unlock(&f->lock);
+
+	return VIRTIO_NET_OK;
+}
+
+static uint8_t
+virtio_net_ctrl_vlan(struct virtio_net *net, uint8_t cmd, uint8_t *data,
+		     int len)
+{
+	struct virtio_net_rxfilter *f = &net->filter;
+	uint16_t vid;
+
+	if (len < sizeof(vid))
+		return VIRTIO_NET_ERR;
+
+	memcpy(&vid, data, sizeof(vid));
+	if (vid >= VIRTIO_NET_VLAN_MAX)
+		return VIRTIO_NET_ERR;
+
+	pthread_rwlock_wrlock(&f->lock);
+	if (cmd == VIRTIO_NET_CTRL_VLAN_ADD)
+		f->vlans[vid / 8] |= 1 << (vid % 8);
+	else if (cmd == VIRTIO_NET_CTRL_VLAN_DEL)
+		f->vlans[vid / 8] &= ~(1 << (vid % 8));
+	else
+		vid = VIRTIO_NET_VLAN_MAX;
+	pthread_rwlock_unlock(&f->lock);
+
+	return vid < VIRTIO_NET_VLAN_MAX ? VIRTIO_NET_OK : VIRTIO_NET_ERR;
+}
+
+static uint8_t
+virtio_net_ctrl_cmd(struct virtio_net *net, uint8_t class, uint8_t cmd,
+		    uint8_t *data, int len)
+{
+	switch (class) {
+	case VIRTIO_NET_CTRL_RX:
+		return virtio_net_ctrl_rx(net, cmd, data, len);
+	case VIRTIO_NET_CTRL_MAC:
+		return virtio_net_ctrl_mac(net, cmd, data, len);
+	case VIRTIO_NET_CTRL_VLAN:
+		return virtio_net_ctrl_vlan(net, cmd, data, len);
+	case VIRTIO_NET_CTRL_MQ:
+		return virtio_net_ctrl_mq(net, cmd, data, len);
+	default:
+		DPRINTF(("vtnet: unsupported ctrl class %d cmd %d\n\r",
+			 class, cmd));
+		return VIRTIO_NET_ERR;
+	}
+}
+
+/*
+ * Control requests are a header and command data in driver-readable
+ * descriptors, followed by a single writable byte for the ack.
+ */
+static void
+virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_net *net = vdev;
+	struct iovec iov[VIRTIO_NET_MAXSEGS];
+	uint16_t flags[VIRTIO_NET_MAXSEGS];
+	struct virtio_net_ctrl_hdr *hdr;
+	uint8_t buf[VIRTIO_NET_CTRL_BUFSZ];
+	uint8_t *ack;
+	int i, n, len, seg;
+	uint16_t idx;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, flags);
+		if (n < 1) {
+			WPRINTF(("vtnet: bad control chain\n"));
 			return;
 		}
+		if (n > VIRTIO_NET_MAXSEGS) {
+			WPRINTF(("vtnet: control chain too long: %d\n", n));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		/* the guest's ack byte is the last descriptor, and only it */
+		len = 0;
+		ack = NULL;
+		if ((flags[n - 1] & VRING_DESC_F_WRITE) &&
+		    iov[n - 1].iov_len >= 1)
+			ack = iov[n - 1].iov_base;
+		for (i = 0; i < n - 1; i++) {
+			if (flags[i] & VRING_DESC_F_WRITE) {
+				ack = NULL;
+				break;
+			}
+			seg = iov[i].iov_len;
+			if (len + seg > sizeof(buf))
+				seg = sizeof(buf) - len;
+			memcpy(&buf[len], iov[i].iov_base, seg);
+			len += seg;
+		}
+
+		if (ack == NULL || len < sizeof(*hdr)) {
+			WPRINTF(("vtnet: malformed control request\n"));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		hdr = (struct virtio_net_ctrl_hdr *)buf;
+		*ack = virtio_net_ctrl_cmd(net, hdr->class, hdr->cmd,
+					   buf + sizeof(*hdr),
+					   len - sizeof(*hdr));
+		vq_relchain(vq, idx, 1);
+	}
+
+	vq_endchains(vq, 1);
+}
+
+static int
+virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
+{
+	struct ether_addr ether_addr;
+	struct ether_addr *ea;
+	char *tmpstr;
+	char zero_addr[ETHER_ADDR_LEN] = { 0, 0, 0, 0, 0, 0 };
+
+	tmpstr = strsep(&mac_str, "=");
+	ea = &ether_addr;
+	if ((mac_str != NULL) && (!strcmp(tmpstr, "mac"))) {
+		ea = ether_aton(mac_str, ea);
+
+		if (ea == NULL || ETHER_IS_MULTICAST(ea->ether_addr_octet) ||
+		    memcmp(ea->ether_addr_octet, zero_addr, ETHER_ADDR_LEN)
+				== 0) {
+			fprintf(stderr, "Invalid MAC %s\n", mac_str);
+			return -1;
+		}
+		memcpy(mac_addr, ea->ether_addr_octet, ETHER_ADDR_LEN);
+	}
+
+	return 0;
+}
+
+static int
+virtio_net_parseopts(struct virtio_net *net, char *opts, int *mac_provided,
+		     int *cpu)
+{
+	static const struct {
+		const char *name;
+		long min, max;
+	} nopts[] = {
+		{ "mq=",	1, VIRTIO_NET_MAXQP },
+		{ "cpu=",	0, CPU_SETSIZE - 1 },
+		{ "txbatch=",	1, VIRTIO_NET_TXBATCH_MAX },
+		{ "txpoll=",	0, VIRTIO_NET_TXPOLL_MAX_US },
+	};
+	char *opt, *val, *end;
+	long n;
+	int i, err;
+
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		for (i = 0; i < sizeof(nopts) / sizeof(nopts[0]); i++) {
+			if (!strncmp(opt, nopts[i].name,
+				     strlen(nopts[i].name)))
+				break;
+		}
+		if (i < sizeof(nopts) / sizeof(nopts[0])) {
+			val = opt + strlen(nopts[i].name);
+			n = strtol(val, &end, 10);
+			if (end == val || *end != '\0' ||
+			    n < nopts[i].min || n > nopts[i].max) {
+				fprintf(stderr, "Invalid %s\n", opt);
+				return -1;
+			}
+			switch (i) {
+			case 0:
+				net->max_pairs = n;
+				break;
+			case 1:
+				*cpu = n;
+				break;
+			case 2:
+				net->tx_batch = n;
+				break;
+			default:
+				net->tx_poll_max = n * 1000UL;
+				break;
+			}
+		} else if (!strncmp(opt, "mac=", 4)) {
+			err = virtio_net_parsemac(opt, net->config.mac);
+			if (err != 0)
+				return err;
+			*mac_provided = 1;
+		} else if ((err = virtio_net_rl_parse(net, opt)) != 0) {
+			if (err < 0)
+				return err;
+		} else {
+			fprintf(stderr, "Unknown virtio-net option %s\n", opt);
+			return -1;
+		}
+	}
+
+	/* no point in more pairs than the guest has vcpus */
+	if (guest_ncpus > 0 && net->max_pairs > guest_ncpus)
+		net->max_pairs = guest_ncpus;
+
+	return 0;
+}
+
+static int
+virtio_net_tap_open(char *devname, int mq)
+{
+	int tunfd, rc;
+	struct ifreq ifr;
+
+#define PATH_NET_TUN "/dev/net/tun"
+	tunfd = open(PATH_NET_TUN, O_RDWR);
+	if (tunfd < 0) {
+		WPRINTF(("open of tup device /dev/net/tun failed\n"));
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+	if (mq)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+
+	if (*devname)
+		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
+
+	rc = ioctl(tunfd, TUNSETIFF, (void *)&ifr);
+	if (rc < 0) {
+		WPRINTF(("open of tap device %s failed\n", devname));
+		close(tunfd);
+		return -1;
+	}
+
+	strcpy(devname, ifr.ifr_name);
+	return tunfd;
+}
+
+static void
+virtio_net_tap_setup(struct virtio_net *net, char *devname)
+{
+	char tbuf[80 + 5];	/* room for "acrn_" prefix */
+	char *tbuf_ptr;
+	struct virtio_net_queue *q;
+	int i, opt;
+
+	tbuf_ptr = tbuf;
+
+	strcpy(tbuf, "acrn_");
+
+	tbuf_ptr += 5;
+
+	strncat(tbuf_ptr, devname, sizeof(tbuf) - 6);
+
+	net->virtio_net_rx = virtio_net_tap_rx;
+	net->virtio_net_tx = virtio_net_tap_tx;
+
+	/*
+	 * Open one queue of the tap per pair.  The first open creates the
+	 * interface and fixes its name for the others.
+	 */
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qs[i];
+		q->tapfd = virtio_net_tap_open(tbuf, net->max_pairs > 1);
+		if (q->tapfd == -1) {
+			WPRINTF(("open of tap device %s failed\n", tbuf));
+			break;
+		}
+		q->attached = 1;
+		DPRINTF(("open of tap device %s queue %d success!\n",
+			 tbuf, i));
+
+		/*
+		 * Set non-blocking and register for read
+		 * notifications with the event loop
+		 */
+		opt = 1;
+		if (ioctl(q->tapfd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			close(q->tapfd);
+			q->tapfd = -1;
+			break;
+		}
+
+		q->mevp = mevent_add(q->tapfd, EVF_READ,
+				     virtio_net_rx_callback, q);
+		if (q->mevp == NULL) {
+			WPRINTF(("Could not register event\n"));
+			close(q->tapfd);
+			q->tapfd = -1;
+			break;
+		}
+	}
+
+	/* run with the queues we got, if any */
+	if (i < net->max_pairs) {
+		if (i > 0)
+			WPRINTF(("vtnet: only %d of %d tap queues opened\n",
+				 i, net->max_pairs));
+		net->max_pairs = i > 0 ? i : 1;
+	}
+	if (net->qs[0].tapfd < 0)
+		return;
+
+	/*
+	 * Frames now carry the vnet header both ways.  Offer the
+	 * offloads if the tap takes them, and start with none enabled
+	 * until the guest negotiates.
+	 */
+	net->be_vhdr = 1;
+	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	if (ioctl(net->qs[0].tapfd, TUNSETOFFLOAD,
+		  TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) == 0)
+		net->be_caps = VIRTIO_NET_S_OFFLOADS;
+	else
+		WPRINTF(("vtnet: tap %s has no offloads\n", tbuf));
+	virtio_net_tap_offload(net);
+}
+
+static void
+virtio_net_netmap_setup(struct virtio_net *net, char *ifname)
+{
+	net->virtio_net_rx = virtio_net_netmap_rx;
+	net->virtio_net_tx = virtio_net_netmap_tx;
+	net->virtio_net_tx_flush = virtio_net_netmap_tx_flush;
+
+	/* a vale port is serviced by pair 0 only */
+	if (net->max_pairs > 1) {
+		WPRINTF(("vtnet: mq not supported on %s\n", ifname));
+		net->max_pairs = 1;
+	}
+
+	net->nmd = nm_open(ifname, NULL, 0, 0);
+	if (net->nmd == NULL) {
+		WPRINTF(("open of netmap device %s failed\n", ifname));
+		return;
+	}
+
+	net->qs[0].mevp = mevent_add(net->nmd->fd, EVF_READ,
+				     virtio_net_rx_callback, &net->qs[0]);
+	if (net->qs[0].mevp == NULL) {
+		WPRINTF(("Could not register event\n"));
+		nm_close(net->nmd);
+		net->nmd = NULL;
+	}
+}
+
+static void
+virtio_net_packet_close(struct virtio_net_pkt *pkt)
+{
+	if (pkt->map != NULL)
+		munmap(pkt->map, pkt->maplen);
+	pkt->map = NULL;
+	if (pkt->fd >= 0)
+		close(pkt->fd);
+	pkt->fd = -1;
+}
+
+static void
+virtio_net_packet_setup(struct virtio_net *net, char *ifname)
+{
+	struct virtio_net_pkt *pkt = &net->pkt;
+	struct sockaddr_ll sll;
+	struct packet_mreq mreq;
+#ifdef PACKET_IGNORE_OUTGOING
+	int one = 1;
+#endif
+	int ver = TPACKET_V3;
+	unsigned int ifindex;
+	size_t rxlen;
+
+	net->virtio_net_rx = virtio_net_packet_rx;
+	net->virtio_net_tx = virtio_net_packet_tx;
+	net->virtio_net_tx_flush = virtio_net_packet_tx_flush;
+
+	/* one socket, serviced by pair 0 only */
+	if (net->max_pairs > 1) {
+		WPRINTF(("vtnet: mq not supported on %s\n", ifname));
+		net->max_pairs = 1;
+	}
+
+	ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		WPRINTF(("vtnet: no interface %s\n", ifname));
+		return;
+	}
+
+	pkt->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (pkt->fd < 0) {
+		WPRINTF(("vtnet: packet socket failed: %s\n",
+			 strerror(errno)));
+		return;
+	}
+
+	if (setsockopt(pkt->fd, SOL_PACKET, PACKET_VERSION, &ver,
+		       sizeof(ver)) < 0)
+		goto fail;
+#ifdef PACKET_IGNORE_OUTGOING
+	/* not queued at all; older kernels leave it to packet_rx() */
+	setsockopt(pkt->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+		   sizeof(one));
+#endif
+
+	pkt->rxreq.tp_block_size = VIRTIO_NET_PKT_BLKSZ;
+	pkt->rxreq.tp_block_nr = VIRTIO_NET_PKT_RXBLKS;
+	pkt->rxreq.tp_frame_size = VIRTIO_NET_PKT_FRAMESZ;
+	pkt->rxreq.tp_frame_nr = VIRTIO_NET_PKT_RXBLKS *
+		(VIRTIO_NET_PKT_BLKSZ / VIRTIO_NET_PKT_FRAMESZ);
+	pkt->rxreq.tp_retire_blk_tov = VIRTIO_NET_PKT_TMO;
+	if (setsockopt(pkt->fd, SOL_PACKET, PACKET_RX_RING, &pkt->rxreq,
+		       sizeof(pkt->rxreq)) < 0)
+		goto fail;
+
+	pkt->txreq.tp_block_size = VIRTIO_NET_PKT_BLKSZ;
+	pkt->txreq.tp_block_nr = VIRTIO_NET_PKT_TXBLKS;
+	pkt->txreq.tp_frame_size = VIRTIO_NET_PKT_FRAMESZ;
+	pkt->txreq.tp_frame_nr = VIRTIO_NET_PKT_TXBLKS *
+		(VIRTIO_NET_PKT_BLKSZ / VIRTIO_NET_PKT_FRAMESZ);
+	if (setsockopt(pkt->fd, SOL_PACKET, PACKET_TX_RING, &pkt->txreq,
+		       sizeof(pkt->txreq)) < 0)
+		goto fail;
+
+	/* the tx ring is mapped right after the rx ring */
+	rxlen = (size_t)pkt->rxreq.tp_block_size * pkt->rxreq.tp_block_nr;
+	pkt->maplen = rxlen +
+		(size_t)pkt->txreq.tp_block_size * pkt->txreq.tp_block_nr;
+	pkt->map = mmap(NULL, pkt->maplen, PROT_READ | PROT_WRITE,
+			MAP_SHARED, pkt->fd, 0);
+	if (pkt->map == MAP_FAILED) {
+		pkt->map = NULL;
+		goto fail;
+	}
+	pkt->rxring = pkt->map;
+	pkt->txring = pkt->map + rxlen;
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(pkt->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+		goto fail;
+
+	/* the guest has its own MAC, so take everything on the wire */
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.mr_ifindex = ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(pkt->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+		       sizeof(mreq)) < 0)
+		goto fail;
+
+	net->qs[0].mevp = mevent_add(pkt->fd, EVF_READ,
+				     virtio_net_rx_callback, &net->qs[0]);
+	if (net->qs[0].mevp == NULL) {
+		WPRINTF(("Could not register event\n"));
+		virtio_net_packet_close(pkt);
+	}
+	return;
 
-		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
-		 */
-		memset(vrx, 0, net->rx_vhdrlen);
+fail:
+	WPRINTF(("vtnet: packet ring on %s failed: %s\n", ifname,
+		 strerror(errno)));
+	virtio_net_packet_close(pkt);
+}
 
-		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
+static int
+virtio_net_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
 
-			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
-		}
+/*
+ * Load and attach the XDP program that redirects rx queue N of the
+ * interface to the socket stored at key N of an XSKMAP.  Traffic on
+ * other queues passes on to the host stack.  The attachment is a bpf
+ * link, so it goes away with the process.
+ */
+static int
+virtio_net_xsk_attach(struct virtio_net_xsk *xsk, unsigned int ifindex,
+		      uint32_t queue)
+{
+	union bpf_attr attr;
+	static char license[] = "Dual BSD/GPL";
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = queue + 1;
+	xsk->mapfd = virtio_net_bpf(BPF_MAP_CREATE, &attr);
+	if (xsk->mapfd < 0)
+		return -1;
 
-		/*
-		 * Release this chain and handle more chains.
-		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
-	} while (vq_has_descs(vq));
+	struct bpf_insn prog[] = {
+		/* r2 = ctx->rx_queue_index */
+		{ BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+		  offsetof(struct xdp_md, rx_queue_index), 0 },
+		/* r1 = xskmap */
+		{ BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD,
+		  0, xsk->mapfd },
+		{ 0, 0, 0, 0, 0 },
+		/* r3 = action when the queue has no socket */
+		{ BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS },
+		/* return bpf_redirect_map(xskmap, queue, XDP_PASS) */
+		{ BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+		{ BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+	};
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(uintptr_t)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (uint64_t)(uintptr_t)license;
+	xsk->progfd = virtio_net_bpf(BPF_PROG_LOAD, &attr);
+	if (xsk->progfd < 0)
+		return -1;
 
-	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
-	vq_endchains(vq, 1);
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = xsk->mapfd;
+	attr.key = (uint64_t)(uintptr_t)&queue;
+	attr.value = (uint64_t)(uintptr_t)&xsk->fd;
+	if (virtio_net_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = xsk->progfd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	xsk->linkfd = virtio_net_bpf(BPF_LINK_CREATE, &attr);
+	if (xsk->linkfd < 0)
+		return -1;
+
+	return 0;
 }
 
-static void
-virtio_net_rx_callback(int fd, enum ev_type type, void *param)
+static int
+virtio_net_xsk_mmap(struct virtio_net_xsk *xsk, struct virtio_net_xsk_ring *r,
+		    struct xdp_ring_offset *off, uint64_t pgoff, size_t descsz)
 {
-	struct virtio_net *net = param;
-
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+	r->maplen = off->desc + VIRTIO_NET_XSK_RINGSZ * descsz;
+	r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return -1;
+	}
 
+	r->producer = (uint32_t *)((uint8_t *)r->map + off->producer);
+	r->consumer = (uint32_t *)((uint8_t *)r->map + off->consumer);
+	r->flags = (uint32_t *)((uint8_t *)r->map + off->flags);
+	r->ring = (uint8_t *)r->map + off->desc;
+	return 0;
 }
 
 static void
-virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
+virtio_net_xsk_close(struct virtio_net_xsk *xsk)
 {
-	struct virtio_net *net = vdev;
+	struct virtio_net_xsk_ring *rings[] = {
+		&xsk->fq, &xsk->cq, &xsk->rx, &xsk->tx };
+	int i;
 
-	/*
-	 * A qnotify means that the rx process can now begin
-	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	/* closing the link detaches the program */
+	if (xsk->linkfd >= 0)
+		close(xsk->linkfd);
+	if (xsk->progfd >= 0)
+		close(xsk->progfd);
+	if (xsk->mapfd >= 0)
+		close(xsk->mapfd);
+	xsk->linkfd = xsk->progfd = xsk->mapfd = -1;
+
+	for (i = 0; i < 4; i++) {
+		if (rings[i]->map != NULL)
+			munmap(rings[i]->map, rings[i]->maplen);
+		rings[i]->map = NULL;
 	}
+
+	if (xsk->fd >= 0)
+		close(xsk->fd);
+	xsk->fd = -1;
+
+	if (xsk->umem != NULL)
+		munmap(xsk->umem, xsk->umemlen);
+	xsk->umem = NULL;
 }
 
 static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+virtio_net_xsk_setup(struct virtio_net *net, char *spec)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
-	int i, n;
-	int plen, tlen;
-	uint16_t idx;
+	struct virtio_net_xsk *xsk = &net->xsk;
+	struct xdp_umem_reg reg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen;
+	unsigned int ifindex;
+	uint32_t queue = 0;
+	uint64_t *fq;
+	char *p, *end;
+	int i, size;
+
+	net->virtio_net_rx = virtio_net_xsk_rx;
+	net->virtio_net_tx = virtio_net_xsk_tx;
+	net->virtio_net_tx_flush = virtio_net_xsk_tx_flush;
+
+	/* one socket, serviced by pair 0 only */
+	if (net->max_pairs > 1) {
+		WPRINTF(("vtnet: mq not supported on %s\n", spec));
+		net->max_pairs = 1;
+	}
 
-	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
-	 */
-	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-	assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
+	p = strchr(spec, ':');
+	if (p != NULL) {
+		*p++ = '\0';
+		queue = strtoul(p, &end, 10);
+		if (end == p || *end != '\0') {
+			WPRINTF(("vtnet: invalid xsk queue %s\n", p));
+			return;
+		}
 	}
 
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+	ifindex = if_nametoindex(spec);
+	if (ifindex == 0) {
+		WPRINTF(("vtnet: no interface %s\n", spec));
+		return;
+	}
+
+	xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (xsk->fd < 0)
+		goto fail;
+
+	xsk->umemlen = VIRTIO_NET_XSK_NFRAMES * VIRTIO_NET_XSK_FRAMESZ;
+	xsk->umem = mmap(NULL, xsk->umemlen, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xsk->umem == MAP_FAILED) {
+		xsk->umem = NULL;
+		goto fail;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (uint64_t)(uintptr_t)xsk->umem;
+	reg.len = xsk->umemlen;
+	reg.chunk_size = VIRTIO_NET_XSK_FRAMESZ;
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+		goto fail;
+
+	size = VIRTIO_NET_XSK_RINGSZ;
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size,
+		       sizeof(size)) < 0 ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+		       sizeof(size)) < 0 ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &size,
+		       sizeof(size)) < 0 ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size,
+		       sizeof(size)) < 0)
+		goto fail;
+
+	optlen = sizeof(off);
+	if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+		goto fail;
+
+	if (virtio_net_xsk_mmap(xsk, &xsk->fq, &off.fr,
+				XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t)) ||
+	    virtio_net_xsk_mmap(xsk, &xsk->cq, &off.cr,
+				XDP_UMEM_PGOFF_COMPLETION_RING,
+				sizeof(uint64_t)) ||
+	    virtio_net_xsk_mmap(xsk, &xsk->rx, &off.rx, XDP_PGOFF_RX_RING,
+				sizeof(struct xdp_desc)) ||
+	    virtio_net_xsk_mmap(xsk, &xsk->tx, &off.tx, XDP_PGOFF_TX_RING,
+				sizeof(struct xdp_desc)))
+		goto fail;
+
+	/* hand the rx half of the UMEM to the kernel */
+	fq = xsk->fq.ring;
+	for (i = 0; i < VIRTIO_NET_XSK_RINGSZ; i++)
+		fq[i] = (uint64_t)i * VIRTIO_NET_XSK_FRAMESZ;
+	__atomic_store_n(xsk->fq.producer, VIRTIO_NET_XSK_RINGSZ,
+			 __ATOMIC_RELEASE);
+
+	for (i = 0; i < VIRTIO_NET_XSK_RINGSZ; i++)
+		xsk->txfree[i] = (uint64_t)(VIRTIO_NET_XSK_RINGSZ + i) *
+			VIRTIO_NET_XSK_FRAMESZ;
+	xsk->ntxfree = VIRTIO_NET_XSK_RINGSZ;
+	xsk->txprod = *xsk->tx.producer;
+
+	/* zero-copy if the driver supports it, copy mode otherwise */
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+	if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+		sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+		if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+			goto fail;
+		DPRINTF(("vtnet: xsk %s:%u in copy mode\n\r", spec, queue));
+	}
+
+	if (virtio_net_xsk_attach(xsk, ifindex, queue))
+		goto fail;
+
+	net->qs[0].mevp = mevent_add(xsk->fd, EVF_READ,
+				     virtio_net_rx_callback, &net->qs[0]);
+	if (net->qs[0].mevp == NULL) {
+		WPRINTF(("Could not register event\n"));
+		virtio_net_xsk_close(xsk);
+	}
+	return;
 
-	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, tlen);
+fail:
+	WPRINTF(("vtnet: xsk on %s queue %u failed: %s\n", spec, queue,
+		 strerror(errno)));
+	virtio_net_xsk_close(xsk);
 }
 
 static void
-virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
+virtio_net_shm_close(struct virtio_net_shm *shm)
 {
-	struct virtio_net *net = vdev;
-
-	/*
-	 * Any ring entries to process?
-	 */
-	if (!vq_has_descs(vq))
-		return;
+	int i;
 
-	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	shm->up = 0;
+	if (shm->sockmevp != NULL)
+		mevent_delete(shm->sockmevp);
+	shm->sockmevp = NULL;
+	if (shm->sockfd >= 0)
+		close(shm->sockfd);
+	shm->sockfd = -1;
+	if (shm->map != NULL)
+		munmap(shm->map, 2 * sizeof(struct virtio_net_shm_ring));
+	shm->map = NULL;
+	for (i = 0; i < 2; i++) {
+		if (shm->efd[i] >= 0)
+			close(shm->efd[i]);
+		shm->efd[i] = -1;
+	}
 }
 
 /*
- * Thread which will handle processing of TX desc
+ * Both sides: map the rings, pick a direction and start receiving.
+ * 'side' is 0 on the DM that created the memfd.
  */
-static void *
-virtio_net_tx_thread(void *param)
+static int
+virtio_net_shm_start(struct virtio_net *net, int memfd, int side)
 {
-	struct virtio_net *net = param;
-	struct virtio_vq_info *vq;
-	int error;
-
-	vq = &net->queues[VIRTIO_NET_TXQ];
-
-	/*
-	 * Let us wait till the tx queue pointers get initialised &
-	 * first tx signaled
-	 */
-	pthread_mutex_lock(&net->tx_mtx);
-	error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
-	assert(error == 0);
-
-	for (;;) {
-		/* note - tx mutex is locked here */
-		while (net->resetting || !vq_has_descs(vq)) {
-			vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
-			/* memory barrier */
-			mb();
-			if (!net->resetting && vq_has_descs(vq))
-				break;
+	struct virtio_net_shm *shm = &net->shm;
+	struct virtio_net_shm_ring *rings;
 
-			net->tx_in_progress = 0;
-			error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
-			assert(error == 0);
-			if (net->closing) {
-				WPRINTF(("vtnet tx thread closing...\n"));
-				return NULL;
-			}
-		}
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+	rings = mmap(NULL, 2 * sizeof(*rings), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, memfd, 0);
+	if (rings == MAP_FAILED)
+		return -1;
+	shm->map = rings;
 
-		do {
-			/*
-			 * Run through entries, placing them into
-			 * iovecs and sending when an end-of-packet
-			 * is found
-			 */
-			virtio_net_proctx(net, vq);
-		} while (vq_has_descs(vq));
+	shm->txr = &rings[side];
+	shm->rxr = &rings[!side];
+	shm->txefd = shm->efd[side];
+	shm->rxefd = shm->efd[!side];
+	shm->txhead = shm->txr->head;
 
-		/*
-		 * Generate an interrupt if needed.
-		 */
-		vq_endchains(vq, 1);
+	net->qs[0].mevp = mevent_add(shm->rxefd, EVF_READ,
+				     virtio_net_rx_callback, &net->qs[0]);
+	if (net->qs[0].mevp == NULL)
+		return -1;
 
-		pthread_mutex_lock(&net->tx_mtx);
-	}
+	/* the tx worker may look at the rings from now on */
+	mb();
+	shm->up = 1;
+	net->config.status = 1;
+	virtio_config_changed(&net->base);
+	DPRINTF(("vtnet: shm link on %s up\n\r", shm->path));
+	return 0;
 }
 
-#ifdef notyet
+/*
+ * The connecting side: receive the memfd and doorbells.
+ */
 static void
-virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
+virtio_net_shm_recv(int fd, enum ev_type t, void *param)
 {
-	DPRINTF(("vtnet: control qnotify!\n\r"));
+	struct virtio_net *net = param;
+	struct virtio_net_shm *shm = &net->shm;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct stat st;
+	int fds[3], memfd = -1;
+	char c;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) <= 0)
+		goto fail;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+		goto fail;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	memfd = fds[0];
+	shm->efd[0] = fds[1];
+	shm->efd[1] = fds[2];
+	if (fstat(memfd, &st) < 0 ||
+	    st.st_size != 2 * sizeof(struct virtio_net_shm_ring) ||
+	    (fcntl(memfd, F_GET_SEALS) & VIRTIO_NET_SHM_SEALS) !=
+	    VIRTIO_NET_SHM_SEALS)
+		goto fail;
+
+	mevent_delete(shm->sockmevp);
+	shm->sockmevp = NULL;
+	close(shm->sockfd);
+	shm->sockfd = -1;
+
+	if (virtio_net_shm_start(net, memfd, 1))
+		goto fail;
+	close(memfd);
+	return;
+
+fail:
+	WPRINTF(("vtnet: shm handshake on %s failed\n", shm->path));
+	if (memfd >= 0)
+		close(memfd);
+	virtio_net_shm_close(shm);
 }
-#endif
 
-static int
-virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
+/*
+ * The listening side: a peer connected, create the link and pass it
+ * over.
+ */
+static void
+virtio_net_shm_accept(int fd, enum ev_type t, void *param)
 {
-	struct ether_addr ether_addr;
-	struct ether_addr *ea;
-	char *tmpstr;
-	char zero_addr[ETHER_ADDR_LEN] = { 0, 0, 0, 0, 0, 0 };
-
-	tmpstr = strsep(&mac_str, "=");
-	ea = &ether_addr;
-	if ((mac_str != NULL) && (!strcmp(tmpstr, "mac"))) {
-		ea = ether_aton(mac_str, ea);
+	struct virtio_net *net = param;
+	struct virtio_net_shm *shm = &net->shm;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int fds[3], cfd, memfd = -1, i;
+	char c = 0;
+
+	cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	if (cfd < 0)
+		return;
 
-		if (ea == NULL || ETHER_IS_MULTICAST(ea->ether_addr_octet) ||
-		    memcmp(ea->ether_addr_octet, zero_addr, ETHER_ADDR_LEN)
-				== 0) {
-			fprintf(stderr, "Invalid MAC %s\n", mac_str);
-			return -1;
-		}
-		memcpy(mac_addr, ea->ether_addr_octet, ETHER_ADDR_LEN);
+	memfd = memfd_create("acrn-vtnet-shm",
+			     MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0 ||
+	    ftruncate(memfd, 2 * sizeof(struct virtio_net_shm_ring)) < 0 ||
+	    fcntl(memfd, F_ADD_SEALS, VIRTIO_NET_SHM_SEALS) < 0)
+		goto fail;
+	shm->efd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	shm->efd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shm->efd[0] < 0 || shm->efd[1] < 0)
+		goto fail;
+
+	fds[0] = memfd;
+	fds[1] = shm->efd[0];
+	fds[2] = shm->efd[1];
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(cfd, &msg, 0) != 1)
+		goto fail;
+	close(cfd);
+
+	/* the link is point to point: stop listening */
+	mevent_delete(shm->sockmevp);
+	shm->sockmevp = NULL;
+	close(shm->sockfd);
+	shm->sockfd = -1;
+	unlink(shm->path);
+
+	if (virtio_net_shm_start(net, memfd, 0))
+		goto fail_link;
+	close(memfd);
+	return;
+
+fail:
+	WPRINTF(("vtnet: shm link setup on %s failed: %s\n", shm->path,
+		 strerror(errno)));
+	close(cfd);
+	if (memfd >= 0)
+		close(memfd);
+	for (i = 0; i < 2; i++) {
+		if (shm->efd[i] >= 0)
+			close(shm->efd[i]);
+		shm->efd[i] = -1;
 	}
+	/* keep listening for another try */
+	return;
 
-	return 0;
+fail_link:
+	WPRINTF(("vtnet: shm link on %s failed\n", shm->path));
+	close(memfd);
+	virtio_net_shm_close(shm);
 }
 
-static int
-virtio_net_tap_open(char *devname)
+/*
+ * Shared memory link to another DM on this host, named by a unix
+ * socket path: "shm=/run/acrn/link0".  Whichever of the two DMs comes
+ * up first listens on the path, the second one connects.  Until then
+ * frames sent by the guest are dropped.
+ */
+static void
+virtio_net_shm_setup(struct virtio_net *net, char *path)
 {
-	int tunfd, rc;
-	struct ifreq ifr;
+	struct virtio_net_shm *shm = &net->shm;
+	struct sockaddr_un sun;
+	void (*func)(int, enum ev_type, void *);
+
+	net->virtio_net_rx = virtio_net_shm_rx;
+	net->virtio_net_tx = virtio_net_shm_tx;
+	net->virtio_net_tx_flush = virtio_net_shm_tx_flush;
+
+	/* one link, serviced by pair 0 only */
+	if (net->max_pairs > 1) {
+		WPRINTF(("vtnet: mq not supported on shm links\n"));
+		net->max_pairs = 1;
+	}
 
-#define PATH_NET_TUN "/dev/net/tun"
-	tunfd = open(PATH_NET_TUN, O_RDWR);
-	if (tunfd < 0) {
-		WPRINTF(("open of tup device /dev/net/tun failed\n"));
-		return -1;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		WPRINTF(("vtnet: shm path %s too long\n", path));
+		return;
 	}
+	strncpy(shm->path, path, sizeof(shm->path));
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+	shm->sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (shm->sockfd < 0)
+		goto fail;
+
+	if (connect(shm->sockfd, (struct sockaddr *)&sun, sizeof(sun)) == 0)
+		func = virtio_net_shm_recv;
+	else if (errno == ECONNREFUSED || errno == ENOENT) {
+		/* nobody there, possibly a stale socket: be the listener */
+		unlink(path);
+		if (bind(shm->sockfd, (struct sockaddr *)&sun,
+			 sizeof(sun)) < 0 || listen(shm->sockfd, 1) < 0)
+			goto fail;
+		func = virtio_net_shm_accept;
+	} else
+		goto fail;
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	shm->sockmevp = mevent_add(shm->sockfd, EVF_READ, func, net);
+	if (shm->sockmevp == NULL)
+		goto fail;
+	return;
 
-	if (*devname)
-		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
+fail:
+	WPRINTF(("vtnet: shm link on %s failed: %s\n", path,
+		 strerror(errno)));
+	virtio_net_shm_close(shm);
+}
 
-	rc = ioctl(tunfd, TUNSETIFF, (void *)&ifr);
-	if (rc < 0) {
-		WPRINTF(("open of tap device %s failed\n", devname));
-		close(tunfd);
-		return -1;
-	}
+/*
+ * Runtime control through the monitor.  Requests name the device by
+ * its PCI address and are answered with a MSG_STR.
+ */
+struct virtio_net_lookup {
+	unsigned int bus, slot, func;
+	struct virtio_net *net;
+};
 
-	strcpy(devname, ifr.ifr_name);
-	return tunfd;
-}
+struct virtio_net_reply {
+	struct vmm_msg vmsg;
+	char	str[160];
+};
+
+static pthread_once_t virtio_net_monitor_once = PTHREAD_ONCE_INIT;
 
 static void
-virtio_net_tap_setup(struct virtio_net *net, char *devname)
+virtio_net_lookup_dev(struct pci_vdev *dev, void *arg)
 {
-	char tbuf[80 + 5];	/* room for "acrn_" prefix */
-	char *tbuf_ptr;
+	struct virtio_net_lookup *lk = arg;
 
-	tbuf_ptr = tbuf;
+	if (dev->dev_ops->vdev_init == virtio_net_init && dev->arg &&
+	    dev->bus == lk->bus && dev->slot == lk->slot &&
+	    dev->func == lk->func)
+		lk->net = dev->arg;
+}
 
-	strcpy(tbuf, "acrn_");
+static struct virtio_net *
+virtio_net_lookup(unsigned int bus, unsigned int slot, unsigned int func,
+		  struct virtio_net_reply *reply)
+{
+	struct virtio_net_lookup lk = { bus, slot, func, NULL };
 
-	tbuf_ptr += 5;
+	pci_walk_vdev(virtio_net_lookup_dev, &lk);
+	if (lk.net == NULL)
+		snprintf(reply->str, sizeof(reply->str),
+			 "Error: no virtio-net at %x:%x.%x", bus, slot, func);
+	return lk.net;
+}
 
-	strncat(tbuf_ptr, devname, sizeof(tbuf) - 6);
+static void
+virtio_net_reply(struct msg_sender *sender, struct virtio_net_reply *reply)
+{
+	reply->vmsg.magic = VMM_MSG_MAGIC;
+	reply->vmsg.msgid = MSG_STR;
+	reply->vmsg.len = sizeof(*reply);
+	monitor_reply(sender, &reply->vmsg);
+}
 
-	net->virtio_net_rx = virtio_net_tap_rx;
-	net->virtio_net_tx = virtio_net_tap_tx;
+/*
+ * REQ_NET_RATELIMIT: apply the options in the request and report the
+ * limits in effect.
+ */
+static void
+virtio_net_rl_handler(struct vmm_msg *msg, struct msg_sender *sender,
+		      void *priv)
+{
+	struct vmm_msg_net_ratelimit *req = (void *)msg;
+	struct virtio_net_reply reply;
+	struct virtio_net *net;
+	struct virtio_net_rl *rx, *tx;
+	char spec[sizeof(req->spec)], *opts, *opt;
+
+	memset(&reply, 0, sizeof(reply));
+	if (msg->len < sizeof(*req) ||
+	    strnlen(req->spec, sizeof(req->spec)) == sizeof(req->spec)) {
+		snprintf(reply.str, sizeof(reply.str), "Error: bad request");
+		goto out;
+	}
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
-		return;
+	net = virtio_net_lookup(req->bus, req->slot, req->func, &reply);
+	if (net == NULL)
+		goto out;
+
+	strncpy(spec, req->spec, sizeof(spec));
+	opts = spec;
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		if (*opt && virtio_net_rl_parse(net, opt) != 1) {
+			snprintf(reply.str, sizeof(reply.str),
+				 "Error: bad rate limit %s", opt);
+			goto out;
+		}
 	}
-	DPRINTF(("open of tap device %s success!\n", tbuf));
 
-	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
-	 */
-	int opt = 1;
+	rx = &net->rl[VIRTIO_NET_RL_RX];
+	tx = &net->rl[VIRTIO_NET_RL_TX];
+	snprintf(reply.str, sizeof(reply.str),
+		 "rx_bps=%lu:%lu rx_pps=%lu:%lu tx_bps=%lu:%lu tx_pps=%lu:%lu",
+		 rx->bytes.rate * 8, rx->bytes.burst,
+		 rx->pkts.rate, rx->pkts.burst,
+		 tx->bytes.rate * 8, tx->bytes.burst,
+		 tx->pkts.rate, tx->pkts.burst);
+out:
+	virtio_net_reply(sender, &reply);
+}
 
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
-	}
+/*
+ * REQ_NET_CAPTURE: start a capture into a new file, or stop the one
+ * running and report how it went.
+ */
+static void
+virtio_net_cap_handler(struct vmm_msg *msg, struct msg_sender *sender,
+		       void *priv)
+{
+	struct vmm_msg_net_capture *req = (void *)msg;
+	struct virtio_net_reply reply;
+	struct virtio_net *net;
 
-	net->mevp = mevent_add(net->tapfd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
-		WPRINTF(("Could not register event\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+	memset(&reply, 0, sizeof(reply));
+	if (msg->len < sizeof(*req) ||
+	    strnlen(req->path, sizeof(req->path)) == sizeof(req->path) ||
+	    strnlen(req->filter, sizeof(req->filter)) ==
+	    sizeof(req->filter)) {
+		snprintf(reply.str, sizeof(reply.str), "Error: bad request");
+		goto out;
 	}
+
+	net = virtio_net_lookup(req->bus, req->slot, req->func, &reply);
+	if (net == NULL)
+		goto out;
+
+	if (!req->enable) {
+		if (!net->cap.running) {
+			snprintf(reply.str, sizeof(reply.str),
+				 "Error: not capturing");
+			goto out;
+		}
+		virtio_net_cap_stop(net);
+		snprintf(reply.str, sizeof(reply.str),
+			 "captured=%lu dropped=%lu", net->cap.captured,
+			 net->cap.dropped);
+	} else if (net->cap.running)
+		snprintf(reply.str, sizeof(reply.str),
+			 "Error: already capturing");
+	else if (virtio_net_cap_start(net, req->path, req->snaplen,
+				      req->filter))
+		snprintf(reply.str, sizeof(reply.str),
+			 "Error: cannot capture to %s", req->path);
+	else
+		snprintf(reply.str, sizeof(reply.str),
+			 "capturing to %s snaplen=%u filter=%d insns",
+			 req->path, net->cap.snaplen, net->cap.proglen);
+out:
+	virtio_net_reply(sender, &reply);
 }
 
 static void
-virtio_net_netmap_setup(struct virtio_net *net, char *ifname)
+virtio_net_monitor_init(void)
 {
-	net->virtio_net_rx = virtio_net_netmap_rx;
-	net->virtio_net_tx = virtio_net_netmap_tx;
+	struct vmm_msg msg;
 
-	net->nmd = nm_open(ifname, NULL, 0, 0);
-	if (net->nmd == NULL) {
-		WPRINTF(("open of netmap device %s failed\n", ifname));
-		return;
+	/* fails harmlessly if the monitor is not running */
+	msg.msgid = REQ_NET_RATELIMIT;
+	monitor_register_handler(&msg, virtio_net_rl_handler, NULL);
+	msg.msgid = REQ_NET_CAPTURE;
+	monitor_register_handler(&msg, virtio_net_cap_handler, NULL);
+}
+
+/*
+ * Stop the workers and release the backend: nothing may be left
+ * pointing at net once it is freed.
+ */
+static void
+virtio_net_teardown(struct virtio_net *net)
+{
+	struct virtio_net_queue *q;
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qs[i];
+		virtio_vq_pair_stop(&q->vqp);
+
+		if (q->mevp != NULL)
+			mevent_delete(q->mevp);
+		q->mevp = NULL;
+		if (q->rl_mevp != NULL)
+			mevent_delete_close(q->rl_mevp);
+		q->rl_mevp = NULL;
+
+		if (q->tapfd >= 0)
+			close(q->tapfd);
+		q->tapfd = -1;
 	}
 
-	net->mevp = mevent_add(net->nmd->fd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
-		WPRINTF(("Could not register event\n"));
+	virtio_net_cap_stop(net);
+	free(net->cap.ring);
+	if (net->nmd != NULL)
 		nm_close(net->nmd);
-		net->nmd = NULL;
-	}
+	virtio_net_packet_close(&net->pkt);
+	virtio_net_xsk_close(&net->xsk);
+	virtio_net_shm_close(&net->shm);
+
+	free(net);
 }
 
 static int
@@ -889,13 +3946,14 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	MD5_CTX mdctx;
 	unsigned char digest[16];
 	char nstr[80];
-	char tname[MAXCOMLEN + 1];
+	char tname[32];
 	struct virtio_net *net;
 	char *devname;
 	char *vtopts;
 	int mac_provided;
 	pthread_mutexattr_t attr;
-	int rc;
+	struct virtio_net_queue *q;
+	int i, rc, cpu;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -917,25 +3975,31 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_net: pthread_mutex_init failed with "
 			"error %d!\n", rc));
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues);
-	net->base.mtx = &net->mtx;
-
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
+	for (i = 0; i < VIRTIO_NET_MAXQP; i++) {
+		q = &net->qs[i];
+		q->net = net;
+		q->tapfd = -1;
+		q->tx_poll_ns = VIRTIO_NET_TXPOLL_MIN_NS;
+		q->rl_tfd = -1;
+		pthread_mutex_init(&q->rx_mtx, NULL);
+	}
+	pthread_mutex_init(&net->rl[VIRTIO_NET_RL_RX].mtx, NULL);
+	pthread_mutex_init(&net->rl[VIRTIO_NET_RL_TX].mtx, NULL);
+	pthread_once(&virtio_net_monitor_once, virtio_net_monitor_init);
 
 	/*
 	 * Attempt to open the tap device and read the MAC address
-	 * if specified
+	 * and queue pair count if specified
 	 */
 	mac_provided = 0;
-	net->tapfd = -1;
+	cpu = -1;
+	net->max_pairs = 1;
+	net->tx_batch = VIRTIO_NET_TXBATCH;
+	net->tx_poll_max = VIRTIO_NET_TXPOLL_US * 1000UL;
 	net->nmd = NULL;
+	net->pkt.fd = -1;
+	net->xsk.fd = net->xsk.mapfd = net->xsk.progfd = net->xsk.linkfd = -1;
+	net->shm.sockfd = net->shm.efd[0] = net->shm.efd[1] = -1;
 	if (opts != NULL) {
 		int err;
 
@@ -947,13 +4011,11 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 		(void) strsep(&vtopts, ",");
 
-		if (vtopts != NULL) {
-			err = virtio_net_parsemac(vtopts, net->config.mac);
-			if (err != 0) {
-				free(devname);
-				return err;
-			}
-			mac_provided = 1;
+		err = virtio_net_parseopts(net, vtopts, &mac_provided, &cpu);
+		if (err != 0) {
+			free(devname);
+			free(net);
+			return err;
 		}
 
 		if (strncmp(devname, "vale", 4) == 0)
@@ -961,10 +4023,42 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		if (strncmp(devname, "tap", 3) == 0 ||
 		    strncmp(devname, "vmnet", 5) == 0)
 			virtio_net_tap_setup(net, devname);
+		if (strncmp(devname, "packet=", 7) == 0)
+			virtio_net_packet_setup(net, devname + 7);
+		if (strncmp(devname, "xsk=", 4) == 0)
+			virtio_net_xsk_setup(net, devname + 4);
+		if (strncmp(devname, "shm=", 4) == 0)
+			virtio_net_shm_setup(net, devname + 4);
 
 		free(devname);
 	}
 
+	/*
+	 * The queues are laid out as rx/tx pairs followed by the
+	 * control queue.
+	 */
+	net->ops = virtio_net_ops;
+	net->ops.hv_caps |= net->be_caps;
+	net->ops.nvq = net->max_pairs * 2 + 1;
+	if (net->max_pairs > 1)
+		net->ops.hv_caps |= VIRTIO_NET_F_MQ;
+	net->config.max_virtqueue_pairs = net->max_pairs;
+
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues);
+	net->base.mtx = &net->mtx;
+	net->base.flags |= VIRTIO_VQ_LOCKING;
+
+	for (i = 0; i < net->ops.nvq; i++) {
+		net->queues[i].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[i].notify = (i & 1) ? virtio_net_ping_txq :
+					virtio_net_ping_rxq;
+	}
+	virtio_net_set_ctlq(net, net->max_pairs * 2);
+	virtio_net_set_pairs(net, 1);
+
+	pthread_rwlock_init(&net->filter.lock, NULL);
+	virtio_net_filter_reset(net);
+
 	/*
 	 * The default MAC address is the standard NetApp OUI of 00-a0-98,
 	 * followed by an MD5 of the PCI slot/func number and dev name
@@ -992,14 +4086,17 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_NET);
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
-	/* Link is up if we managed to open tap device or vale port. */
-	net->config.status = (opts == NULL || net->tapfd >= 0 ||
-			      net->nmd != NULL);
+	/*
+	 * Link is up if we managed to open tap device or vale port.  A shm
+	 * link comes up when its peer connects, see virtio_net_shm_start().
+	 */
+	net->config.status = (opts == NULL || net->qs[0].tapfd >= 0 ||
+			      net->nmd != NULL || net->pkt.fd >= 0 ||
+			      net->xsk.fd >= 0 || net->shm.up);
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, fbsdrun_virtio_msix())) {
-		if (net)
-			free(net);
+		virtio_net_teardown(net);
 		return -1;
 	}
 
@@ -1007,26 +4104,27 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	virtio_set_io_bar(&net->base, 0);
 
 	net->resetting = 0;
-	net->closing = 0;
 
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
+	net->rx_maxlen = net->rx_vhdrlen + ETHER_MAX_LEN;
 
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Spawn the TX worker of each queue pair, pinned to consecutive
+	 * host cpus if cpu= was given.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < net->max_pairs; i++) {
+		q = &net->qs[i];
+		virtio_vq_pair_init(&net->base, &q->vqp, i,
+				    virtio_net_tx_handler, q);
+		snprintf(tname, sizeof(tname), "vtnet-%d:%d tx%d", dev->slot,
+			 dev->func, i);
+		if (virtio_vq_pair_start(&q->vqp, tname,
+					 cpu < 0 ? -1 : cpu + i)) {
+			virtio_net_teardown(net);
+			return -1;
+		}
+	}
 
 	return 0;
 }
@@ -1075,28 +4173,37 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 		/* non-merge rx header is 2 bytes shorter */
 		net->rx_vhdrlen -= 2;
 	}
+
+	/* merged rx bufs are gathered until a whole frame fits */
+	net->rx_maxlen = net->rx_vhdrlen +
+		((net->features & (VIRTIO_NET_F_GUEST_TSO4 |
+				   VIRTIO_NET_F_GUEST_TSO6)) ?
+		 VIRTIO_NET_MAX_GSO_LEN : ETHER_MAX_LEN);
+
+	if (!(net->features & VIRTIO_NET_F_MQ))
+		virtio_net_set_ctlq(net, VIRTIO_NET_CTLQ);
+
+	virtio_net_tap_offload(net);
+
+	pthread_rwlock_wrlock(&net->filter.lock);
+	virtio_net_filter_update(net);
+	pthread_rwlock_unlock(&net->filter.lock);
 }
 
 static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_net *net;
+	int i;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
-		virtio_net_tx_stop(net);
-
-		if (net->tapfd >= 0) {
-			close(net->tapfd);
-			net->tapfd = -1;
-		} else
-			fprintf(stderr, "net->tapfd is -1!\n");
-
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
-
-		free(net);
+		for (i = 0; i < net->max_pairs; i++) {
+			if (net->qs[i].tapfd < 0)
+				fprintf(stderr, "tapfd of queue %d is -1!\n", i);
+		}
+		virtio_net_teardown(net);
 
 		DPRINTF(("%s: done\n", __func__));
 	} else
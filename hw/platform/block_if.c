@@ -30,8 +30,17 @@
 #include <sys/param.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/sysmacros.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
+#include <linux/aio_abi.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
 #include <errno.h>
 #include <assert.h>
 #include <err.h>
@@ -40,6 +49,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <sysexits.h>
 #include <unistd.h>
@@ -47,6 +57,7 @@
 #include "dm.h"
 #include "mevent.h"
 #include "block_if.h"
+#include "qcow2.h"
 #include "ahci.h"
 
 /*
@@ -64,7 +75,14 @@
 #define BLOCKIF_SIG	0xb109b109
 
 #define BLOCKIF_NUMTHR	8
-#define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
+
+/* requests a disk can hold by default, see depth= */
+#define BLOCKIF_DEPTH		64
+#define BLOCKIF_DEPTH_MAX	4096
+
+/* limits of one merged I/O, see merge= */
+#define BLOCKIF_MERGE_MAX	(1024 * 1024)
+#define BLOCKIF_MERGE_IOV	256
 
 /*
  * Debug printf
@@ -77,7 +95,32 @@ enum blockop {
 	BOP_READ,
 	BOP_WRITE,
 	BOP_FLUSH,
-	BOP_DELETE
+	BOP_DELETE,
+	BOP_ZERO
+};
+
+/*
+ * I/O engines.  The thread pool does blocking system calls on
+ * BLOCKIF_NUMTHR threads; io_uring submits from the caller and reaps
+ * completions on one thread; native AIO submits from the caller and
+ * reaps from the mevent loop when the completion eventfd fires.  Both
+ * leave what they cannot do asynchronously to a deferred worker.
+ */
+enum blockaio {
+	AIO_THREADS,
+	AIO_URING,
+	AIO_NATIVE
+};
+
+/*
+ * Host cache modes.  The guest sees a volatile write cache, and has to
+ * flush, for every mode but writethrough; unsafe drops those flushes.
+ */
+enum blockcache {
+	CACHE_WRITETHROUGH,	/* O_DIRECT | O_SYNC */
+	CACHE_WRITEBACK,	/* page cache, flush is fdatasync */
+	CACHE_NONE,		/* O_DIRECT, flush is fdatasync */
+	CACHE_UNSAFE		/* page cache, flush is ignored */
 };
 
 enum blockstat {
@@ -90,20 +133,179 @@ enum blockstat {
 
 struct blockif_elem {
 	TAILQ_ENTRY(blockif_elem) link;
+	LIST_ENTRY(blockif_elem) elink;	/* in endh[] by block */
+	LIST_ENTRY(blockif_elem) slink;	/* in starth[] by req->offset */
 	struct blockif_req  *req;
 	enum blockop	     op;
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	struct blockif_elem *mnext;	/* requests merged behind this one */
+	struct iovec	    *miov;	/* their combined vector */
+	int		     miovcnt;
+};
+
+LIST_HEAD(blockif_bucket, blockif_elem);
+
+/*
+ * io_uring state, set up without liburing.  Submission is done under
+ * the context mutex; the completion ring is only read by the reaper.
+ */
+struct blockif_uring {
+	int			fd;
+	int			sqpoll;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_flags;
+	unsigned		*sq_array;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_map;
+	size_t			sq_maplen;
+	void			*cq_map;
+	size_t			cq_maplen;
+	size_t			sqes_len;
+	unsigned		entries;
+	unsigned		tosubmit;	/* queued, not yet entered */
+};
+
+/*
+ * Linux native AIO state.  iocb[i] belongs to reqs[i].  All arrays
+ * have maxreq entries.
+ */
+struct blockif_aio {
+	aio_context_t		ctx;
+	int			efd;
+	struct mevent		*mevp;
+	struct iocb		*iocb;
+	struct iocb		**batch;
+	struct io_event		*events;
+};
+
+/*
+ * Requests io_uring and native AIO cannot carry out themselves, or that
+ * failed to submit, are parked on defer[] and finished by the deferred
+ * worker, which swaps it with run[].  So callbacks never run under the
+ * context mutex, and blocking I/O holds up neither the event loop nor
+ * the reaping of other completions.  All arrays have maxreq entries.
+ */
+struct blockif_defer {
+	struct blockif_elem	**defer;
+	int			*defer_err;
+	int			ndefer;
+	struct blockif_elem	**run;
+	int			*run_err;
+};
+
+/*
+ * Aligned bounce buffers, MAXPHYS each, for O_DIRECT reads and writes
+ * with an iovec the device cannot take as is.  There is one buffer per
+ * thread that runs blockif_proc(), so taking one normally never waits.
+ */
+struct blockif_bpool {
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	uint8_t			*base;
+	size_t			len;
+	int			nfree;
+	uint8_t			*free[BLOCKIF_NUMTHR];
+};
+
+/*
+ * Read cache for read-only disks, see rcache=.  It lives in a POSIX
+ * shared memory segment named after the image's identity, or after
+ * rcache_id= where the image has none we can trust, so every acrn-dm
+ * booting from the same image shares it.  Every user holds a shared
+ * flock on the segment and the last one to close unlinks it; one left
+ * behind by a crash is /dev/shm/acrn-blk-*, and may be removed while
+ * no acrn-dm uses it.
+ *
+ * Slots are direct mapped, one BLOCKIF_RC_BLKSZ block each, and
+ * guarded by a sequence count, the low half of seq, that is odd while
+ * the slot is being filled; the high half then holds the filler's
+ * owner token, a byte of the segment it keeps an OFD lock on while it
+ * has the segment open.  That lock goes away with the process, in
+ * whatever pid namespace it ran, so a slot whose filler died can be
+ * taken back.  Byte 0 is locked by the creator until the header is
+ * set.  A reader that sees seq change takes a miss.
+ */
+#define BLOCKIF_RC_MAGIC	0x62726332	/* "brc2" */
+#define BLOCKIF_RC_BLKSZ	(64 * 1024)
+#define BLOCKIF_RC_TRIES	100	/* yields waiting on a busy slot */
+#define BLOCKIF_RC_IDLEN	64	/* longest rcache_id= */
+#define BLOCKIF_RC_NAMELEN	(BLOCKIF_RC_IDLEN + 64)
+#define BLOCKIF_RC_USERS	4096	/* owner tokens */
+#define BLOCKIF_RC_WAIT		1000	/* ms before suspecting the creator */
+
+/* at the start of the segment, then the slots, then the data */
+struct blockif_rc_hdr {
+	uint32_t		magic;		/* set once the rest is */
+	uint32_t		blksz;
+	uint64_t		nslots;
+	uint64_t		size;
+	char			name[BLOCKIF_RC_NAMELEN];
+};
+
+struct blockif_rc_slot {
+	uint64_t		seq;		/* filler token << 32 | count */
+	uint64_t		tag;		/* block + 1, 0 if empty */
+};
+
+struct blockif_rcache {
+	struct blockif_rc_hdr	*hdr;
+	size_t			maplen;
+	uint64_t		nslots;
+	struct blockif_rc_slot	*slots;
+	uint8_t			*data;
+	int			fd;		/* holds the flock and token */
+	uint64_t		token;		/* ours, for seq */
+	char			name[BLOCKIF_RC_NAMELEN];
+};
+
+/*
+ * Sequential read detection for read-only disks, see ra=.  Once a
+ * stream has read three times in a row, a window is kept ahead of it:
+ * filled into the read cache by the read-ahead thread, or hinted to
+ * the page cache without one.
+ */
+#define BLOCKIF_RA_DEFAULT	1024	/* KiB */
+#define BLOCKIF_RA_STREAMS	4
+#define BLOCKIF_RA_QUEUE	16
+
+struct blockif_ra {
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	pthread_t		tid;
+	int			running;
+	int			closing;
+	off_t			window;		/* 0 if off */
+	struct {
+		off_t		next;
+		off_t		ahead;
+		int		hits;
+	} streams[BLOCKIF_RA_STREAMS];
+	int			victim;
+	struct {
+		off_t		off;
+		off_t		len;
+	} queue[BLOCKIF_RA_QUEUE];
+	unsigned		qhead;
+	unsigned		qtail;
 };
 
 struct blockif_ctxt {
 	int			magic;
 	int			fd;
 	int			isblk;
-	int			isgeom;
 	int			candelete;
 	int			rdonly;
+	enum blockcache		cache;
+	struct qcow2		*qcow;		/* qcow2 image, else raw */
+	int			wce;		/* guest write cache enabled */
 	off_t			size;
 	int			sub_file_assign;
 	off_t			sub_file_start_lba;
@@ -112,15 +314,45 @@ struct blockif_ctxt {
 	int			psectsz;
 	int			psectoff;
 	int			closing;
+	enum blockaio		aio;
+	int			nthr;
 	pthread_t		btid[BLOCKIF_NUMTHR];
 	pthread_mutex_t		mtx;
 	pthread_cond_t		cond;
+	struct blockif_uring	ring;
+	struct blockif_aio	aio_ctx;
+	struct blockif_defer	dfr;
+
+	/* O_DIRECT alignment of iov_base and iov_len, 0 if not bouncing */
+	size_t			dio_memalign;
+	size_t			dio_lenalign;
+	struct blockif_bpool	bpool;
+
+	struct blockif_rcache	*rc;
+	struct blockif_ra	ra;
 
-	/* Request elements and free/pending/busy queues */
+	/*
+	 * Request elements and free/pending/blocked/busy queues.
+	 * Requests are also indexed by offset, so that finding the ones
+	 * a request waits for, or releases, needs no walk over the
+	 * queues: endh[] holds every queued or in-flight request by the
+	 * offset it ends at, starth[] the ones not yet dispatched by the
+	 * offset they start at.
+	 */
 	TAILQ_HEAD(, blockif_elem) freeq;
 	TAILQ_HEAD(, blockif_elem) pendq;
+	TAILQ_HEAD(, blockif_elem) blockq;
 	TAILQ_HEAD(, blockif_elem) busyq;
-	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+	int			maxreq;
+	struct blockif_elem	*reqs;
+	int			hbits;
+	struct blockif_bucket	*endh;
+	struct blockif_bucket	*starth;
+
+	/* Merging of contiguous requests */
+	int			merge;
+	size_t			merge_max;
+	struct blockif_stats	stats;
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
@@ -134,6 +366,12 @@ struct blockif_sig_elem {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+static inline unsigned
+blockif_hash(struct blockif_ctxt *bc, off_t off)
+{
+	return ((uint64_t)off * 0x9e3779b97f4a7c15ULL) >> (64 - bc->hbits);
+}
+
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
@@ -142,6 +380,10 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	off_t off;
 	int i;
 
+	/*
+	 * A request that starts where one still queued or in flight ends
+	 * waits for it, so that a sequential stream stays in order.
+	 */
 	be = TAILQ_FIRST(&bc->freeq);
 	assert(be != NULL);
 	assert(be->status == BST_FREE);
@@ -151,50 +393,121 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	switch (op) {
 	case BOP_READ:
 	case BOP_WRITE:
-	case BOP_DELETE:
 		off = breq->offset;
 		for (i = 0; i < breq->iovcnt; i++)
 			off += breq->iov[i].iov_len;
 		break;
+	case BOP_DELETE:
+	case BOP_ZERO:
+		if (breq->nranges == 0) {
+			off = breq->offset + breq->resid;
+			break;
+		}
+		/* FALLTHROUGH */
 	default:
 		/* off = OFF_MAX; */
 		off = 1 << (sizeof(off_t) - 1);
 	}
 	be->block = off;
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
+	LIST_FOREACH(tbe, &bc->endh[blockif_hash(bc, breq->offset)], elink) {
 		if (tbe->block == breq->offset)
 			break;
 	}
+	bc->stats.reqs++;
+	LIST_INSERT_HEAD(&bc->endh[blockif_hash(bc, be->block)], be, elink);
+	LIST_INSERT_HEAD(&bc->starth[blockif_hash(bc, breq->offset)], be,
+			 slink);
 	if (tbe == NULL) {
-		TAILQ_FOREACH(tbe, &bc->busyq, link) {
-			if (tbe->block == breq->offset)
-				break;
-		}
-	}
-	if (tbe == NULL)
 		be->status = BST_PEND;
-	else
+		TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	} else {
 		be->status = BST_BLOCK;
-	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+		TAILQ_INSERT_TAIL(&bc->blockq, be, link);
+	}
 	return (be->status == BST_PEND);
 }
 
+/*
+ * Move a request that has not been dispatched yet to the busy queue.
+ */
+static void
+blockif_start(struct blockif_ctxt *bc, struct blockif_elem *be, pthread_t t)
+{
+	if (be->status == BST_PEND)
+		TAILQ_REMOVE(&bc->pendq, be, link);
+	else
+		TAILQ_REMOVE(&bc->blockq, be, link);
+	LIST_REMOVE(be, slink);
+	be->status = BST_BUSY;
+	be->tid = t;
+	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+}
+
+/*
+ * Elevator: fold the pending requests that continue where a request
+ * being dispatched ends, with the same op, into one vectored I/O, as
+ * far as merge_max bytes and BLOCKIF_MERGE_IOV segments allow.  Each
+ * of them still completes on its own, see blockif_io_end().
+ */
+static void
+blockif_merge(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_elem *tbe, *last;
+	size_t len, tlen;
+	int cnt;
+
+	if (!bc->merge || (be->op != BOP_READ && be->op != BOP_WRITE) ||
+	    (be->op == BOP_WRITE && bc->rdonly))
+		return;
+
+	last = be;
+	len = be->block - be->req->offset;
+	cnt = be->req->iovcnt;
+	for (;;) {
+		LIST_FOREACH(tbe, &bc->starth[blockif_hash(bc, last->block)],
+			     slink) {
+			if (tbe->op == be->op &&
+			    tbe->req->offset == last->block)
+				break;
+		}
+		if (tbe == NULL)
+			break;
+		tlen = tbe->block - tbe->req->offset;
+		if (len + tlen > bc->merge_max ||
+		    cnt + tbe->req->iovcnt > BLOCKIF_MERGE_IOV)
+			break;
+
+		blockif_start(bc, tbe, be->tid);
+		last->mnext = tbe;
+		last = tbe;
+		len += tlen;
+		cnt += tbe->req->iovcnt;
+		bc->stats.merged++;
+	}
+	if (last == be)
+		return;
+
+	be->miovcnt = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->mnext) {
+		memcpy(&be->miov[be->miovcnt], tbe->req->iov,
+		       tbe->req->iovcnt * sizeof(struct iovec));
+		be->miovcnt += tbe->req->iovcnt;
+	}
+	bc->stats.merge_ios++;
+	bc->stats.merge_bytes += len;
+}
+
 static int
 blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
 
-	TAILQ_FOREACH(be, &bc->pendq, link) {
-		if (be->status == BST_PEND)
-			break;
-		assert(be->status == BST_BLOCK);
-	}
+	be = TAILQ_FIRST(&bc->pendq);
 	if (be == NULL)
 		return 0;
-	TAILQ_REMOVE(&bc->pendq, be, link);
-	be->status = BST_BUSY;
-	be->tid = t;
-	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+	assert(be->status == BST_PEND);
+	blockif_start(bc, be, t);
+	blockif_merge(bc, be);
 	*bep = be;
 	return 1;
 }
@@ -206,11 +519,23 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 
 	if (be->status == BST_DONE || be->status == BST_BUSY)
 		TAILQ_REMOVE(&bc->busyq, be, link);
-	else
-		TAILQ_REMOVE(&bc->pendq, be, link);
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
-		if (tbe->req->offset == be->block)
+	else {
+		if (be->status == BST_PEND)
+			TAILQ_REMOVE(&bc->pendq, be, link);
+		else
+			TAILQ_REMOVE(&bc->blockq, be, link);
+		LIST_REMOVE(be, slink);
+	}
+	LIST_REMOVE(be, elink);
+
+	/* release whatever was waiting for this one to finish */
+	LIST_FOREACH(tbe, &bc->starth[blockif_hash(bc, be->block)], slink) {
+		if (tbe->req->offset == be->block &&
+		    tbe->status == BST_BLOCK) {
+			TAILQ_REMOVE(&bc->blockq, tbe, link);
 			tbe->status = BST_PEND;
+			TAILQ_INSERT_TAIL(&bc->pendq, tbe, link);
+		}
 	}
 	be->tid = 0;
 	be->status = BST_FREE;
@@ -218,164 +543,1217 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 	TAILQ_INSERT_TAIL(&bc->freeq, be, link);
 }
 
+/*
+ * Hand the result of an I/O, a byte count or a negative errno, back
+ * to the request it was for, or split it over the requests merged into
+ * it in order.
+ */
+static void
+blockif_io_end(struct blockif_ctxt *bc, struct blockif_elem *be,
+	       ssize_t res)
+{
+	struct blockif_elem *tbe, *next;
+	ssize_t n;
+	int err;
+
+	err = (res < 0) ? -res : 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->mnext) {
+		if (res > 0) {
+			n = MIN(res, tbe->block - tbe->req->offset);
+			tbe->req->resid -= n;
+			res -= n;
+		}
+		tbe->status = BST_DONE;
+	}
+
+	/*
+	 * Requests merged behind the first are retired right after their
+	 * callback, so that as with unmerged I/O, at most one element per
+	 * completing thread is done but not yet free.  The caller retires
+	 * the first.
+	 */
+	for (tbe = be->mnext, be->mnext = NULL; tbe != NULL; tbe = next) {
+		next = tbe->mnext;
+		tbe->mnext = NULL;
+		(*tbe->req->callback)(tbe->req, err);
+		pthread_mutex_lock(&bc->mtx);
+		blockif_complete(bc, tbe);
+		pthread_mutex_unlock(&bc->mtx);
+	}
+	(*be->req->callback)(be->req, err);
+}
+
+/*
+ * A disk opened with a host write cache that the guest has switched to
+ * write-through: every write has to be made durable on its own.  qcow2
+ * metadata is cached in any mode, so there that is all write-through.
+ */
+static inline int
+blockif_wt_emul(struct blockif_ctxt *bc)
+{
+	if (bc->qcow != NULL)
+		return !bc->wce;
+	return bc->cache != CACHE_WRITETHROUGH && !bc->wce;
+}
+
+/* make completed writes durable; returns an errno */
+static int
+blockif_sync(struct blockif_ctxt *bc)
+{
+	if (bc->qcow != NULL)
+		return -qcow2_flush(bc->qcow);
+	return fdatasync(bc->fd) ? errno : 0;
+}
+
+static ssize_t blockif_rw(struct blockif_ctxt *bc, enum blockop op,
+			  const struct iovec *iov, int iovcnt, off_t off);
+
+/* source for writing zeroes where the backing store can't do it */
+static const uint8_t blockif_zeroes[65536] __attribute__((aligned(4096)));
+
+/*
+ * Discard or zero one range.  Block devices use the discard/zeroout
+ * ioctls, files punch holes or zero the range in place.  Zeroing falls
+ * back to plain writes if neither works.
+ */
+static int
+blockif_range(struct blockif_ctxt *bc, enum blockop op, off_t off,
+	      off_t len)
+{
+	struct iovec iov;
+	uint64_t arg[2];
+	ssize_t n;
+	int mode;
+
+	if (bc->qcow != NULL) {
+		/* qcow2 clusters are only ever allocated, and written */
+		if (op == BOP_DELETE)
+			return EOPNOTSUPP;
+	} else if (bc->isblk) {
+		arg[0] = off + bc->sub_file_start_lba;
+		arg[1] = len;
+		if (ioctl(bc->fd, op == BOP_DELETE ? BLKDISCARD : BLKZEROOUT,
+			  arg) == 0)
+			return 0;
+	} else {
+		mode = FALLOC_FL_KEEP_SIZE | ((op == BOP_DELETE) ?
+			FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE);
+		if (fallocate(bc->fd, mode, off + bc->sub_file_start_lba,
+			      len) == 0)
+			return 0;
+	}
+	if (bc->qcow == NULL &&
+	    (op == BOP_DELETE || (errno != EOPNOTSUPP && errno != EINVAL)))
+		return errno;
+
+	while (len > 0) {
+		iov.iov_base = (void *)blockif_zeroes;
+		iov.iov_len = MIN(len, (off_t)sizeof(blockif_zeroes));
+		n = blockif_rw(bc, BOP_WRITE, &iov, 1, off);
+		if (n < 0)
+			return -n;
+		if (n == 0)
+			return EIO;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* the data iovecs of a request, or of the I/O it heads when merged */
+static int
+blockif_elem_iov(struct blockif_elem *be, const struct iovec **iov)
+{
+	if (be->mnext != NULL) {
+		*iov = be->miov;
+		return be->miovcnt;
+	}
+	*iov = be->req->iov;
+	return be->req->iovcnt;
+}
+
+static size_t
+blockif_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len;
+	int i;
+
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/* whether every iovec can go to the file as is */
+static int
+blockif_dio_ok(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	if (bc->dio_memalign == 0)
+		return 1;
+	for (i = 0; i < iovcnt; i++) {
+		if (((uintptr_t)iov[i].iov_base & (bc->dio_memalign - 1)) ||
+		    (iov[i].iov_len & (bc->dio_lenalign - 1)))
+			return 0;
+	}
+	return 1;
+}
+
+static inline void
+blockif_account(struct blockif_ctxt *bc, size_t bytes, int bounced)
+{
+	__atomic_fetch_add(bounced ? &bc->stats.bounce_bytes :
+			   &bc->stats.direct_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static uint8_t *
+blockif_bounce_get(struct blockif_bpool *bp)
+{
+	uint8_t *buf;
+
+	pthread_mutex_lock(&bp->mtx);
+	while (bp->nfree == 0)
+		pthread_cond_wait(&bp->cond, &bp->mtx);
+	buf = bp->free[--bp->nfree];
+	pthread_mutex_unlock(&bp->mtx);
+	return buf;
+}
+
+static void
+blockif_bounce_put(struct blockif_bpool *bp, uint8_t *buf)
+{
+	pthread_mutex_lock(&bp->mtx);
+	bp->free[bp->nfree++] = buf;
+	pthread_cond_signal(&bp->cond);
+	pthread_mutex_unlock(&bp->mtx);
+}
+
+/*
+ * Copy len bytes between buf and iov, starting *voff bytes into
+ * iov[*i], and advance that position.
+ */
+static void
+blockif_bounce_copy(const struct iovec *iov, int *i, size_t *voff,
+		    uint8_t *buf, size_t len, int toiov)
+{
+	size_t clen, boff;
+
+	for (boff = 0; boff < len; boff += clen) {
+		clen = MIN(len - boff, iov[*i].iov_len - *voff);
+		if (toiov)
+			memcpy((uint8_t *)iov[*i].iov_base + *voff,
+			       buf + boff, clen);
+		else
+			memcpy(buf + boff,
+			       (uint8_t *)iov[*i].iov_base + *voff, clen);
+		*voff += clen;
+		if (*voff == iov[*i].iov_len) {
+			(*i)++;
+			*voff = 0;
+		}
+	}
+}
+
+/* one read or write, through the qcow2 layer for images */
+static ssize_t
+blockif_io(struct blockif_ctxt *bc, enum blockop op,
+	   const struct iovec *iov, int iovcnt, off_t off)
+{
+	ssize_t n;
+
+	if (bc->qcow != NULL)
+		return (op == BOP_READ) ?
+			qcow2_preadv(bc->qcow, iov, iovcnt, off) :
+			qcow2_pwritev(bc->qcow, iov, iovcnt, off);
+	if (op == BOP_READ)
+		n = preadv(bc->fd, iov, iovcnt, off);
+	else
+		n = pwritev(bc->fd, iov, iovcnt, off);
+	return (n < 0) ? -errno : n;
+}
+
+/*
+ * Read or write iov at off.  Under O_DIRECT, iovecs the device cannot
+ * take as is go through a bounce buffer, MAXPHYS at a time.  Returns
+ * the bytes moved, or -errno.
+ */
+static ssize_t
+blockif_rw_file(struct blockif_ctxt *bc, enum blockop op,
+		const struct iovec *iov, int iovcnt, off_t off)
+{
+	ssize_t len, n, done, total;
+	struct iovec bv;
+	size_t voff;
+	uint8_t *buf;
+	int i;
+
+	off += bc->sub_file_start_lba;
+	if (blockif_dio_ok(bc, iov, iovcnt)) {
+		n = blockif_io(bc, op, iov, iovcnt, off);
+		if (n > 0)
+			blockif_account(bc, n, 0);
+		return n;
+	}
+
+	buf = blockif_bounce_get(&bc->bpool);
+	total = blockif_iov_len(iov, iovcnt);
+	i = 0;
+	voff = 0;
+	for (done = 0; done < total; done += n) {
+		len = MIN(total - done, MAXPHYS);
+		bv.iov_base = buf;
+		bv.iov_len = len;
+		if (op == BOP_READ) {
+			n = blockif_io(bc, op, &bv, 1, off + done);
+			if (n > 0)
+				blockif_bounce_copy(iov, &i, &voff, buf, n, 1);
+		} else {
+			blockif_bounce_copy(iov, &i, &voff, buf, len, 0);
+			n = blockif_io(bc, op, &bv, 1, off + done);
+		}
+		if (n < 0) {
+			blockif_bounce_put(&bc->bpool, buf);
+			return n;
+		}
+		if (n < len) {
+			done += n;
+			break;
+		}
+	}
+	blockif_bounce_put(&bc->bpool, buf);
+	blockif_account(bc, done, 1);
+	return done;
+}
+
+static inline struct blockif_rc_slot *
+blockif_rc_slot(struct blockif_rcache *rc, uint64_t b)
+{
+	return &rc->slots[(b * 0x9e3779b97f4a7c15ULL >> 16) % rc->nslots];
+}
+
+static inline uint8_t *
+blockif_rc_data(struct blockif_rcache *rc, struct blockif_rc_slot *s)
+{
+	return rc->data + (s - rc->slots) * (size_t)BLOCKIF_RC_BLKSZ;
+}
+
+/* take (F_WRLCK) or drop (F_UNLCK) the lock on byte off of the segment */
+static int
+blockif_rc_lock(int fd, off_t off, short type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = off;
+	fl.l_len = 1;
+	return fcntl(fd, F_OFD_SETLK, &fl);
+}
+
+/* whether someone else, through another open, locks byte off */
+static int
+blockif_rc_held(int fd, off_t off)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = off;
+	fl.l_len = 1;
+	if (fcntl(fd, F_OFD_GETLK, &fl))
+		return 1;
+	return fl.l_type != F_UNLCK;
+}
+
+/*
+ * Copy len bytes at boff in block b to the iov position, if cached.
+ * The position only moves on a hit.
+ */
+static int
+blockif_rc_get(struct blockif_rcache *rc, uint64_t b, size_t boff,
+	       size_t len, const struct iovec *iov, int *i, size_t *voff)
+{
+	struct blockif_rc_slot *s = blockif_rc_slot(rc, b);
+	uint64_t seq;
+	size_t svoff;
+	int si;
+
+	seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+	if ((seq & 1) || __atomic_load_n(&s->tag, __ATOMIC_RELAXED) != b + 1)
+		return 0;
+	if (iov == NULL)
+		return 1;
+	si = *i;
+	svoff = *voff;
+	blockif_bounce_copy(iov, i, voff, blockif_rc_data(rc, s) + boff, len, 1);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) {
+		*i = si;
+		*voff = svoff;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Read block b into its slot and, given an iov, copy len bytes at boff
+ * out of it.  Returns 1 if another reader holds the slot.
+ */
+static int
+blockif_rc_fill(struct blockif_ctxt *bc, uint64_t b, size_t boff,
+		size_t len, const struct iovec *iov, int *i, size_t *voff)
+{
+	struct blockif_rcache *rc = bc->rc;
+	struct blockif_rc_slot *s = blockif_rc_slot(rc, b);
+	struct iovec v;
+	uint64_t seq;
+	off_t start;
+	ssize_t n;
+
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&s->seq, &seq,
+			rc->token << 32 | (uint32_t)(seq + 1),
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 1;
+	/* no tag while the data is torn, see blockif_rc_reclaim() */
+	__atomic_store_n(&s->tag, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	start = b * BLOCKIF_RC_BLKSZ;
+	v.iov_base = blockif_rc_data(rc, s);
+	v.iov_len = MIN(BLOCKIF_RC_BLKSZ, bc->size - start);
+	n = blockif_io(bc, BOP_READ, &v, 1, start + bc->sub_file_start_lba);
+	if (n >= 0) {
+		memset((uint8_t *)v.iov_base + n, 0, BLOCKIF_RC_BLKSZ - n);
+		if (iov != NULL)
+			blockif_bounce_copy(iov, i, voff,
+					    (uint8_t *)v.iov_base + boff,
+					    len, 1);
+		__atomic_store_n(&s->tag, b + 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&s->seq, (uint32_t)(seq + 2), __ATOMIC_RELEASE);
+	return (n < 0) ? n : 0;
+}
+
+/*
+ * Take back the slot for block b if the acrn-dm filling it has died.
+ * Its tag was cleared before any data was read into it, and only set
+ * again once all of it was, so the slot can be used as it was left.
+ */
+static void
+blockif_rc_reclaim(struct blockif_rcache *rc, uint64_t b)
+{
+	struct blockif_rc_slot *s = blockif_rc_slot(rc, b);
+	uint64_t seq, token;
+
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	token = seq >> 32;
+	if (!(seq & 1) || token == 0 || token == rc->token ||
+	    blockif_rc_held(rc->fd, token))
+		return;
+	if (__atomic_compare_exchange_n(&s->seq, &seq, (uint32_t)(seq + 1),
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		WPRINTF(("blockif: read cache slot of a dead filler "
+			 "reclaimed\n"));
+}
+
+/* read iov at off, block by block through the read cache */
+static ssize_t
+blockif_rc_read(struct blockif_ctxt *bc, const struct iovec *iov,
+		int iovcnt, off_t off)
+{
+	struct blockif_rcache *rc = bc->rc;
+	struct iovec v;
+	uint8_t *buf;
+	uint64_t b;
+	size_t voff, boff, len, total, done;
+	ssize_t n;
+	int i, tries, err;
+
+	total = blockif_iov_len(iov, iovcnt);
+	if (off >= bc->size)
+		return 0;
+	total = MIN(total, bc->size - off);
+	i = 0;
+	voff = 0;
+	for (done = 0; done < total; done += len) {
+		b = (off + done) / BLOCKIF_RC_BLKSZ;
+		boff = (off + done) % BLOCKIF_RC_BLKSZ;
+		len = MIN(total - done, BLOCKIF_RC_BLKSZ - boff);
+
+		if (blockif_rc_get(rc, b, boff, len, iov, &i, &voff)) {
+			__atomic_fetch_add(&bc->stats.rc_hits, 1,
+					   __ATOMIC_RELAXED);
+			continue;
+		}
+		__atomic_fetch_add(&bc->stats.rc_misses, 1, __ATOMIC_RELAXED);
+		for (tries = 0; tries < BLOCKIF_RC_TRIES; tries++) {
+			err = blockif_rc_fill(bc, b, boff, len, iov, &i, &voff);
+			if (err <= 0)
+				break;
+			/* being filled by someone else, likely this block */
+			sched_yield();
+			if (blockif_rc_get(rc, b, boff, len, iov, &i, &voff)) {
+				err = 0;
+				break;
+			}
+		}
+		if (err < 0)
+			return err;
+		if (err == 0)
+			continue;
+
+		/* the slot stayed busy, read around the cache */
+		blockif_rc_reclaim(rc, b);
+		if (posix_memalign((void **)&buf, 4096, BLOCKIF_RC_BLKSZ))
+			return -ENOMEM;
+		v.iov_base = buf;
+		v.iov_len = MIN(BLOCKIF_RC_BLKSZ,
+				bc->size - b * BLOCKIF_RC_BLKSZ);
+		n = blockif_io(bc, BOP_READ, &v, 1,
+			       b * BLOCKIF_RC_BLKSZ + bc->sub_file_start_lba);
+		if (n >= 0) {
+			memset(buf + n, 0, BLOCKIF_RC_BLKSZ - n);
+			blockif_bounce_copy(iov, &i, &voff, buf + boff, len, 1);
+		}
+		free(buf);
+		if (n < 0)
+			return n;
+	}
+	return done;
+}
+
+/*
+ * Note a read of len bytes at off, and start reading ahead if it
+ * continues a stream.
+ */
 static void
-blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
+blockif_ra_note(struct blockif_ctxt *bc, off_t off, size_t len)
+{
+	struct blockif_ra *ra = &bc->ra;
+	off_t start, end;
+	int i;
+
+	start = end = 0;
+	pthread_mutex_lock(&ra->mtx);
+	for (i = 0; i < BLOCKIF_RA_STREAMS; i++) {
+		if (ra->streams[i].next == off)
+			break;
+	}
+	if (i < BLOCKIF_RA_STREAMS)
+		ra->streams[i].hits++;
+	else {
+		i = ra->victim;
+		ra->victim = (i + 1) % BLOCKIF_RA_STREAMS;
+		ra->streams[i].hits = 0;
+		ra->streams[i].ahead = 0;
+	}
+	ra->streams[i].next = off + len;
+	if (ra->streams[i].hits >= 2 &&
+	    ra->streams[i].ahead < ra->streams[i].next + ra->window / 2) {
+		start = MAX(ra->streams[i].ahead, ra->streams[i].next);
+		end = MIN(ra->streams[i].next + ra->window, bc->size);
+		ra->streams[i].ahead = end;
+	}
+	if (start < end && bc->rc != NULL &&
+	    ra->qtail - ra->qhead < BLOCKIF_RA_QUEUE) {
+		ra->queue[ra->qtail % BLOCKIF_RA_QUEUE].off = start;
+		ra->queue[ra->qtail % BLOCKIF_RA_QUEUE].len = end - start;
+		ra->qtail++;
+		pthread_cond_signal(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->mtx);
+
+	if (start < end && bc->rc == NULL)
+		posix_fadvise(bc->fd, start + bc->sub_file_start_lba,
+			      end - start, POSIX_FADV_WILLNEED);
+}
+
+/* fill the read cache with the windows blockif_ra_note() queues */
+static void *
+blockif_ra_thr(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct blockif_ra *ra = &bc->ra;
+	off_t off, end;
+	uint64_t b;
+
+	pthread_mutex_lock(&ra->mtx);
+	for (;;) {
+		while (!ra->closing && ra->qhead == ra->qtail)
+			pthread_cond_wait(&ra->cond, &ra->mtx);
+		if (ra->closing)
+			break;
+		off = ra->queue[ra->qhead % BLOCKIF_RA_QUEUE].off;
+		end = off + ra->queue[ra->qhead % BLOCKIF_RA_QUEUE].len;
+		ra->qhead++;
+		pthread_mutex_unlock(&ra->mtx);
+
+		for (b = off / BLOCKIF_RC_BLKSZ; b * BLOCKIF_RC_BLKSZ < end;
+		     b++) {
+			if (blockif_rc_get(bc->rc, b, 0, 0, NULL, NULL, NULL) ||
+			    blockif_rc_fill(bc, b, 0, 0, NULL, NULL, NULL))
+				continue;
+			__atomic_fetch_add(&bc->stats.ra_bytes,
+					   BLOCKIF_RC_BLKSZ, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_lock(&ra->mtx);
+	}
+	pthread_mutex_unlock(&ra->mtx);
+	return NULL;
+}
+
+static ssize_t
+blockif_rw(struct blockif_ctxt *bc, enum blockop op,
+	   const struct iovec *iov, int iovcnt, off_t off)
+{
+	if (op == BOP_READ && bc->rc != NULL)
+		return blockif_rc_read(bc, iov, iovcnt, off);
+	return blockif_rw_file(bc, op, iov, iovcnt, off);
+}
+
+static void
+blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
 	struct blockif_req *br;
-	off_t arg[2];
-	ssize_t clen, len, off, boff, voff;
+	ssize_t len;
 	int i, err;
 
 	br = be->req;
-	if (br->iovcnt <= 1)
-		buf = NULL;
+	if (be->mnext != NULL) {
+		len = blockif_rw(bc, be->op, be->miov, be->miovcnt,
+				 br->offset);
+		if (len >= 0 && be->op == BOP_WRITE && blockif_wt_emul(bc) &&
+		    (err = blockif_sync(bc)) != 0)
+			len = -err;
+		blockif_io_end(bc, be, len);
+		return;
+	}
+
 	err = 0;
 	switch (be->op) {
 	case BOP_READ:
-		if (buf == NULL) {
-			len = preadv(bc->fd, br->iov, br->iovcnt,
-				     br->offset + bc->sub_file_start_lba);
-			if (len < 0)
-				err = errno;
-			else
-				br->resid -= len;
-			break;
-		}
-		i = 0;
-		off = voff = 0;
-		while (br->resid > 0) {
-			len = MIN(br->resid, MAXPHYS);
-			if (pread(bc->fd, buf, len, br->offset +
-			    off + bc->sub_file_start_lba) < 0) {
-				err = errno;
-				break;
-			}
-			boff = 0;
-			do {
-				clen = MIN(len - boff, br->iov[i].iov_len -
-				    voff);
-				memcpy(br->iov[i].iov_base + voff,
-				    buf + boff, clen);
-				if (clen < br->iov[i].iov_len - voff)
-					voff += clen;
-				else {
-					i++;
-					voff = 0;
-				}
-				boff += clen;
-			} while (boff < len);
-			off += len;
+		len = blockif_rw(bc, BOP_READ, br->iov, br->iovcnt, br->offset);
+		if (len < 0)
+			err = -len;
+		else
 			br->resid -= len;
-		}
 		break;
 	case BOP_WRITE:
 		if (bc->rdonly) {
 			err = EROFS;
 			break;
 		}
-		if (buf == NULL) {
-			len = pwritev(bc->fd, br->iov, br->iovcnt,
-				      br->offset + bc->sub_file_start_lba);
-			if (len < 0)
-				err = errno;
-			else
-				br->resid -= len;
-			break;
-		}
-		i = 0;
-		off = voff = 0;
-		while (br->resid > 0) {
-			len = MIN(br->resid, MAXPHYS);
-			boff = 0;
-			do {
-				clen = MIN(len - boff, br->iov[i].iov_len -
-				    voff);
-				memcpy(buf + boff,
-				    br->iov[i].iov_base + voff, clen);
-				if (clen < br->iov[i].iov_len - voff)
-					voff += clen;
-				else {
-					i++;
-					voff = 0;
-				}
-				boff += clen;
-			} while (boff < len);
-			if (pwrite(bc->fd, buf, len, br->offset +
-			    off + bc->sub_file_start_lba) < 0) {
-				err = errno;
-				break;
-			}
-			off += len;
+		len = blockif_rw(bc, BOP_WRITE, br->iov, br->iovcnt,
+				 br->offset);
+		if (len < 0)
+			err = -len;
+		else
 			br->resid -= len;
-		}
 		break;
 	case BOP_FLUSH:
-		if (fsync(bc->fd))
-			err = errno;
+		if (bc->cache != CACHE_UNSAFE)
+			err = blockif_sync(bc);
 		break;
 	case BOP_DELETE:
-		/* only used by AHCI */
-		if (!bc->candelete)
+	case BOP_ZERO:
+		/*
+		 * Either the one range in offset/resid, or a batch of
+		 * them in ranges[].
+		 */
+		if (be->op == BOP_DELETE && !bc->candelete)
 			err = EOPNOTSUPP;
 		else if (bc->rdonly)
 			err = EROFS;
-		else if (bc->isblk) {
-			arg[0] = br->offset;
-			arg[1] = br->resid;
-			if (ioctl(bc->fd, BLKDISCARD, arg))
-				err = errno;
-			else
+		else if (br->nranges == 0) {
+			err = blockif_range(bc, be->op, br->offset, br->resid);
+			if (!err)
 				br->resid = 0;
+		} else {
+			for (i = 0; i < br->nranges && !err; i++)
+				err = blockif_range(bc, be->op,
+						    br->ranges[i].offset,
+						    br->ranges[i].len);
+			if (!err)
+				br->resid = 0;
+		}
+		break;
+	default:
+		err = EINVAL;
+		break;
+	}
+
+	if ((be->op == BOP_WRITE || be->op == BOP_ZERO) && err == 0 &&
+	    blockif_wt_emul(bc))
+		err = blockif_sync(bc);
+
+	be->status = BST_DONE;
+
+	(*br->callback)(br, err);
+}
+
+static void *
+blockif_thr(void *arg)
+{
+	struct blockif_ctxt *bc;
+	struct blockif_elem *be;
+	pthread_t t;
+
+	bc = arg;
+	t = pthread_self();
+
+	pthread_mutex_lock(&bc->mtx);
+	for (;;) {
+		while (blockif_dequeue(bc, t, &be)) {
+			pthread_mutex_unlock(&bc->mtx);
+			blockif_proc(bc, be);
+			pthread_mutex_lock(&bc->mtx);
+			blockif_complete(bc, be);
+		}
+		/* Check ctxt status here to see if exit requested */
+		if (bc->closing)
+			break;
+		pthread_cond_wait(&bc->cond, &bc->mtx);
+	}
+	pthread_mutex_unlock(&bc->mtx);
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static int
+blockif_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		    unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/*
+ * Whether the asynchronous engines carry out a request themselves.
+ * The rest either fail, do nothing without any I/O, or need a bounce
+ * buffer, and are handed to blockif_proc() from the completion side
+ * instead.
+ */
+static int
+blockif_async_native(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	const struct iovec *iov;
+	int iovcnt;
+
+	switch (be->op) {
+	case BOP_READ:
+	case BOP_WRITE:
+		if (be->op == BOP_WRITE && bc->rdonly)
+			return 0;
+		iovcnt = blockif_elem_iov(be, &iov);
+		return blockif_dio_ok(bc, iov, iovcnt);
+	case BOP_FLUSH:
+		return bc->cache != CACHE_UNSAFE;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Requests blockif_async_native() turns down go through the ring as
+ * NOPs and are finished on the reaper thread when the NOP completes.
+ */
+
+static struct io_uring_sqe *
+blockif_uring_sqe(struct blockif_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	tail = *ring->sq_tail;
+	/* cannot fill up: the ring is sized for every request */
+	assert(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) <
+	       ring->entries);
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	return sqe;
+}
+
+static void
+blockif_uring_push(struct blockif_uring *ring)
+{
+	/* the sqe must be complete before the kernel can see it */
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+	ring->tosubmit++;
+}
+
+/*
+ * Hand everything queued to the kernel.  With SQPOLL the kernel
+ * thread picks the entries up by itself, unless it went to sleep.
+ */
+static void
+blockif_uring_submit(struct blockif_uring *ring)
+{
+	int n;
+
+	if (ring->tosubmit == 0)
+		return;
+
+	if (ring->sqpoll) {
+		mb();
+		if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_NEED_WAKEUP)
+			blockif_uring_enter(ring->fd, 0, 0,
+					    IORING_ENTER_SQ_WAKEUP);
+		ring->tosubmit = 0;
+		return;
+	}
+
+	while (ring->tosubmit) {
+		n = blockif_uring_enter(ring->fd, ring->tosubmit, 0, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EBUSY)
+				continue;
+			WPRINTF(("blockif: io_uring submit failed: %s\n",
+				 strerror(errno)));
+			break;
+		}
+		ring->tosubmit -= n;
+	}
+}
+
+/*
+ * Hand a request to the deferred worker, to be run by blockif_proc(),
+ * or failed with err if that is set.  Called with the context mutex
+ * held.
+ */
+static void
+blockif_defer(struct blockif_ctxt *bc, struct blockif_elem *be, int err)
+{
+	struct blockif_defer *dfr = &bc->dfr;
+
+	dfr->defer[dfr->ndefer] = be;
+	dfr->defer_err[dfr->ndefer] = err;
+	dfr->ndefer++;
+	if (dfr->ndefer == 1)
+		pthread_cond_signal(&bc->cond);
+}
+
+static void
+blockif_uring_prep(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_req *br = be->req;
+	const struct iovec *iov;
+	struct io_uring_sqe *sqe;
+
+	if (!blockif_async_native(bc, be)) {
+		blockif_defer(bc, be, 0);
+		return;
+	}
+
+	sqe = blockif_uring_sqe(&bc->ring);
+	sqe->user_data = (uintptr_t)be;
+	if (be->op == BOP_FLUSH) {
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = bc->fd;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	} else {
+		sqe->opcode = (be->op == BOP_READ) ?
+			IORING_OP_READV : IORING_OP_WRITEV;
+		sqe->fd = bc->fd;
+		sqe->len = blockif_elem_iov(be, &iov);
+		sqe->addr = (uintptr_t)iov;
+		blockif_account(bc, blockif_iov_len(iov, sqe->len), 0);
+		sqe->off = br->offset + bc->sub_file_start_lba;
+		if (be->op == BOP_WRITE && blockif_wt_emul(bc))
+			sqe->rw_flags = RWF_DSYNC;
+	}
+	blockif_uring_push(&bc->ring);
+}
+
+/*
+ * Start every request that is free to go.  Called with the context
+ * mutex held.
+ */
+static void
+blockif_uring_kick(struct blockif_ctxt *bc)
+{
+	struct blockif_elem *be;
+
+	while (blockif_dequeue(bc, 0, &be))
+		blockif_uring_prep(bc, be);
+	blockif_uring_submit(&bc->ring);
+}
+
+/*
+ * Reaper: complete requests as the kernel finishes them.  A NOP with
+ * no request attached is how blockif_close() asks it to leave.
+ */
+static void *
+blockif_uring_thr(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct blockif_uring *ring = &bc->ring;
+	struct blockif_elem *be;
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int res;
+
+	for (;;) {
+		head = *ring->cq_head;
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (blockif_uring_enter(ring->fd, 0, 1,
+					IORING_ENTER_GETEVENTS) < 0 &&
+			    errno != EINTR && errno != EAGAIN) {
+				WPRINTF(("blockif: io_uring wait failed: %s\n",
+					 strerror(errno)));
+				break;
+			}
+			continue;
+		}
+
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		be = (struct blockif_elem *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if (be == NULL) {
+			if (bc->closing)
+				break;
+			continue;
+		}
+
+		blockif_io_end(bc, be, res);
+
+		pthread_mutex_lock(&bc->mtx);
+		blockif_complete(bc, be);
+		blockif_uring_kick(bc);
+		pthread_mutex_unlock(&bc->mtx);
+	}
+
+	return NULL;
+}
+
+static void
+blockif_uring_close(struct blockif_uring *ring)
+{
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_maplen);
+	if (ring->sq_map != NULL)
+		munmap(ring->sq_map, ring->sq_maplen);
+	ring->sqes = NULL;
+	ring->sq_map = ring->cq_map = NULL;
+	if (ring->fd >= 0)
+		close(ring->fd);
+	ring->fd = -1;
+}
+
+static int
+blockif_uring_setup(struct blockif_uring *ring, int maxreq, int sqpoll)
+{
+	struct io_uring_params p;
+	unsigned entries;
+
+	/* room for every request plus the cancels and wakeups next to them */
+	for (entries = 1; entries < 2 * maxreq; entries <<= 1)
+		;
+
+	memset(&p, 0, sizeof(p));
+	if (sqpoll) {
+		p.flags = IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;	/* ms */
+	}
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	ring->sqpoll = sqpoll;
+	ring->entries = p.sq_entries;
+
+	ring->sq_maplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_maplen = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_maplen = ring->cq_maplen =
+			MAX(ring->sq_maplen, ring->cq_maplen);
+
+	ring->sq_map = mmap(NULL, ring->sq_maplen, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED) {
+		ring->sq_map = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_map = ring->sq_map;
+	else {
+		ring->cq_map = mmap(NULL, ring->cq_maplen,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED) {
+			ring->cq_map = NULL;
+			goto fail;
+		}
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sq_head = ring->sq_map + p.sq_off.head;
+	ring->sq_tail = ring->sq_map + p.sq_off.tail;
+	ring->sq_mask = ring->sq_map + p.sq_off.ring_mask;
+	ring->sq_flags = ring->sq_map + p.sq_off.flags;
+	ring->sq_array = ring->sq_map + p.sq_off.array;
+	ring->cq_head = ring->cq_map + p.cq_off.head;
+	ring->cq_tail = ring->cq_map + p.cq_off.tail;
+	ring->cq_mask = ring->cq_map + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_map + p.cq_off.cqes;
+	return 0;
+
+fail:
+	blockif_uring_close(ring);
+	return -1;
+}
+
+/*
+ * Start every request that is free to go as one io_submit() batch.
+ * Called with the context mutex held.
+ */
+static void
+blockif_aio_kick(struct blockif_ctxt *bc)
+{
+	struct blockif_aio *aio = &bc->aio_ctx;
+	struct iocb **batch = aio->batch;
+	struct blockif_elem *be;
+	struct blockif_req *br;
+	const struct iovec *iov;
+	struct iocb *cb;
+	int i, n, nb;
+
+	nb = 0;
+	while (blockif_dequeue(bc, 0, &be)) {
+		br = be->req;
+		if (!blockif_async_native(bc, be)) {
+			blockif_defer(bc, be, 0);
+			continue;
+		}
+
+		cb = &aio->iocb[be - bc->reqs];
+		memset(cb, 0, sizeof(*cb));
+		cb->aio_data = (uintptr_t)be;
+		cb->aio_fildes = bc->fd;
+		cb->aio_flags = IOCB_FLAG_RESFD;
+		cb->aio_resfd = aio->efd;
+		if (be->op == BOP_FLUSH)
+			cb->aio_lio_opcode = IOCB_CMD_FDSYNC;
+		else {
+			cb->aio_lio_opcode = (be->op == BOP_READ) ?
+				IOCB_CMD_PREADV : IOCB_CMD_PWRITEV;
+			cb->aio_nbytes = blockif_elem_iov(be, &iov);
+			cb->aio_buf = (uintptr_t)iov;
+			blockif_account(bc, blockif_iov_len(iov,
+					cb->aio_nbytes), 0);
+			cb->aio_offset = br->offset + bc->sub_file_start_lba;
+			if (be->op == BOP_WRITE && blockif_wt_emul(bc))
+				cb->aio_rw_flags = RWF_DSYNC;
+		}
+		batch[nb++] = cb;
+	}
+
+	for (i = 0; i < nb; i += n) {
+		n = syscall(__NR_io_submit, aio->ctx, nb - i, &batch[i]);
+		if (n > 0)
+			continue;
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
 		}
-		else
-			err = EOPNOTSUPP;
-		break;
-	default:
-		err = EINVAL;
-		break;
+		/*
+		 * The head of the batch was refused, e.g. a kernel that
+		 * cannot do FDSYNC asynchronously.  Fail just that one
+		 * and carry on with the rest.
+		 */
+		be = (struct blockif_elem *)(uintptr_t)batch[i]->aio_data;
+		blockif_defer(bc, be, n < 0 ? errno : EIO);
+		n = 1;
 	}
+}
 
-	be->status = BST_DONE;
+/* retire a request and start what it held up */
+static void
+blockif_async_done(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	pthread_mutex_lock(&bc->mtx);
+	blockif_complete(bc, be);
+	if (bc->aio == AIO_URING)
+		blockif_uring_kick(bc);
+	else
+		blockif_aio_kick(bc);
+	pthread_mutex_unlock(&bc->mtx);
+}
 
-	(*br->callback)(br, err);
+static void
+blockif_aio_handler(int fd, enum ev_type type, void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct blockif_aio *aio = &bc->aio_ctx;
+	struct io_event *events = aio->events;
+	struct timespec ts = { 0, 0 };
+	struct blockif_elem *be;
+	uint64_t cnt;
+	int i, n;
+
+	if (read(fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		return;
+
+	do {
+		n = syscall(__NR_io_getevents, aio->ctx, 0, bc->maxreq,
+			    events, &ts);
+		for (i = 0; i < n; i++) {
+			be = (struct blockif_elem *)(uintptr_t)events[i].data;
+			blockif_io_end(bc, be, (int64_t)events[i].res);
+			blockif_async_done(bc, be);
+		}
+	} while (n == bc->maxreq);
 }
 
+/*
+ * Deferred worker: finish the requests io_uring or native AIO cannot
+ * carry out, e.g. discards, zeroing, bounced I/O.  These block, so they
+ * run here rather than on the reaper or the event loop.
+ */
 static void *
-blockif_thr(void *arg)
+blockif_defer_thr(void *arg)
 {
-	struct blockif_ctxt *bc;
+	struct blockif_ctxt *bc = arg;
+	struct blockif_defer *dfr = &bc->dfr;
+	struct blockif_elem **defer;
 	struct blockif_elem *be;
-	pthread_t t;
-	uint8_t *buf;
-
-	bc = arg;
-	if (bc->isgeom)
-		buf = malloc(MAXPHYS);
-	else
-		buf = NULL;
-	t = pthread_self();
+	int *defer_err;
+	int i, ndefer;
 
 	pthread_mutex_lock(&bc->mtx);
 	for (;;) {
-		while (blockif_dequeue(bc, t, &be)) {
-			pthread_mutex_unlock(&bc->mtx);
-			blockif_proc(bc, be, buf);
-			pthread_mutex_lock(&bc->mtx);
-			blockif_complete(bc, be);
-		}
-		/* Check ctxt status here to see if exit requested */
-		if (bc->closing)
+		while (dfr->ndefer == 0 && !bc->closing)
+			pthread_cond_wait(&bc->cond, &bc->mtx);
+		if (dfr->ndefer == 0)
 			break;
-		pthread_cond_wait(&bc->cond, &bc->mtx);
+
+		ndefer = dfr->ndefer;
+		defer = dfr->defer;
+		defer_err = dfr->defer_err;
+		dfr->defer = dfr->run;
+		dfr->defer_err = dfr->run_err;
+		dfr->run = defer;
+		dfr->run_err = defer_err;
+		dfr->ndefer = 0;
+		pthread_mutex_unlock(&bc->mtx);
+
+		for (i = 0; i < ndefer; i++) {
+			be = defer[i];
+			if (defer_err[i])
+				blockif_io_end(bc, be, -defer_err[i]);
+			else
+				blockif_proc(bc, be);
+			blockif_async_done(bc, be);
+		}
+		pthread_mutex_lock(&bc->mtx);
 	}
 	pthread_mutex_unlock(&bc->mtx);
 
-	if (buf)
-		free(buf);
-	pthread_exit(NULL);
 	return NULL;
 }
 
+static void
+blockif_defer_close(struct blockif_defer *dfr)
+{
+	free(dfr->defer);
+	free(dfr->defer_err);
+	free(dfr->run);
+	free(dfr->run_err);
+	dfr->defer = dfr->run = NULL;
+	dfr->defer_err = dfr->run_err = NULL;
+}
+
+static int
+blockif_defer_setup(struct blockif_ctxt *bc)
+{
+	struct blockif_defer *dfr = &bc->dfr;
+
+	dfr->ndefer = 0;
+	dfr->defer = calloc(bc->maxreq, sizeof(*dfr->defer));
+	dfr->defer_err = calloc(bc->maxreq, sizeof(*dfr->defer_err));
+	dfr->run = calloc(bc->maxreq, sizeof(*dfr->run));
+	dfr->run_err = calloc(bc->maxreq, sizeof(*dfr->run_err));
+	if (!dfr->defer || !dfr->defer_err || !dfr->run || !dfr->run_err) {
+		blockif_defer_close(dfr);
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+blockif_aio_close(struct blockif_aio *aio)
+{
+	if (aio->mevp != NULL)
+		mevent_delete(aio->mevp);
+	aio->mevp = NULL;
+	/* io_destroy() waits for whatever is still in flight */
+	if (aio->ctx)
+		syscall(__NR_io_destroy, aio->ctx);
+	aio->ctx = 0;
+	if (aio->efd >= 0)
+		close(aio->efd);
+	aio->efd = -1;
+	free(aio->iocb);
+	free(aio->batch);
+	free(aio->events);
+	aio->iocb = NULL;
+	aio->batch = NULL;
+	aio->events = NULL;
+}
+
+static int
+blockif_aio_setup(struct blockif_ctxt *bc)
+{
+	struct blockif_aio *aio = &bc->aio_ctx;
+
+	aio->ctx = 0;
+	aio->iocb = calloc(bc->maxreq, sizeof(*aio->iocb));
+	aio->batch = calloc(bc->maxreq, sizeof(*aio->batch));
+	aio->events = calloc(bc->maxreq, sizeof(*aio->events));
+	aio->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (!aio->iocb || !aio->batch || !aio->events) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	if (aio->efd < 0)
+		goto fail;
+	if (syscall(__NR_io_setup, bc->maxreq, &aio->ctx) < 0) {
+		aio->ctx = 0;
+		goto fail;
+	}
+	aio->mevp = mevent_add(aio->efd, EVF_READ, blockif_aio_handler, bc);
+	if (aio->mevp == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	blockif_aio_close(aio);
+	return -1;
+}
+
 static void
 blockif_sigcont_handler(int signal)
 {
@@ -456,6 +1834,319 @@ sub_file_unlock(struct blockif_ctxt *bc)
 	}
 }
 
+/*
+ * Whether the backing store can discard.  Block devices report it in
+ * sysfs (partitions through their parent queue); for files, punching a
+ * hole past the end is a no-op where holes are supported at all.
+ */
+static int
+blockif_probe_discard(int fd, struct stat *sbuf)
+{
+	static const char *const paths[] = {
+		"/sys/dev/block/%u:%u/queue/discard_max_bytes",
+		"/sys/dev/block/%u:%u/../queue/discard_max_bytes",
+	};
+	char path[128];
+	unsigned long long max;
+	FILE *fp;
+	int i, n;
+
+	if (!S_ISBLK(sbuf->st_mode))
+		return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				 sbuf->st_size + DEV_BSIZE, DEV_BSIZE) == 0;
+
+	for (i = 0; i < (int)(sizeof(paths) / sizeof(paths[0])); i++) {
+		snprintf(path, sizeof(path), paths[i], major(sbuf->st_rdev),
+			 minor(sbuf->st_rdev));
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			continue;
+		n = fscanf(fp, "%llu", &max);
+		fclose(fp);
+		if (n == 1)
+			return max > 0;
+	}
+	return 0;
+}
+
+/*
+ * Set up the bounce buffers.  They are placed on the node blockif_open()
+ * runs on, and faulted in up front rather than on the first bounced
+ * I/O.
+ */
+static int
+blockif_bounce_setup(struct blockif_bpool *bp, int nbufs)
+{
+	unsigned long mask;
+	unsigned cpu, node;
+	int i;
+
+	bp->len = (size_t)nbufs * MAXPHYS;
+	bp->base = mmap(NULL, bp->len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bp->base == MAP_FAILED) {
+		bp->base = NULL;
+		return -1;
+	}
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 &&
+	    node < sizeof(mask) * 8) {
+		mask = 1UL << node;
+		/* best effort, the buffers work wherever they end up */
+		syscall(SYS_mbind, bp->base, bp->len, MPOL_PREFERRED, &mask,
+			sizeof(mask) * 8 + 1, 0);
+	}
+	memset(bp->base, 0, bp->len);
+
+	pthread_mutex_init(&bp->mtx, NULL);
+	pthread_cond_init(&bp->cond, NULL);
+	for (i = 0; i < nbufs; i++)
+		bp->free[i] = bp->base + i * MAXPHYS;
+	bp->nfree = nbufs;
+	return 0;
+}
+
+static void
+blockif_bounce_close(struct blockif_bpool *bp)
+{
+	if (bp->base == NULL)
+		return;
+	munmap(bp->base, bp->len);
+	pthread_mutex_destroy(&bp->mtx);
+	pthread_cond_destroy(&bp->cond);
+	bp->base = NULL;
+}
+
+/* unmap the read cache, and remove it if no one else has it open */
+static void
+blockif_rc_close(struct blockif_rcache *rc)
+{
+	if (flock(rc->fd, LOCK_EX | LOCK_NB) == 0)
+		shm_unlink(rc->name);
+	munmap(rc->hdr, rc->maplen);
+	close(rc->fd);
+	free(rc);
+}
+
+/*
+ * Map the shared read cache for the image, creating it if this is the
+ * first user.  Whoever creates it reserves its memory up front, so a
+ * full /dev/shm fails the open rather than a later store into a slot.
+ * A segment whose last user unlinked it after we opened it, or whose
+ * creator died before setting it up, is left for a fresh one.
+ */
+static struct blockif_rcache *
+blockif_rc_open(struct blockif_ctxt *bc, struct stat *sbuf, const char *id,
+		int mb)
+{
+	struct blockif_rcache *rc;
+	struct blockif_rc_hdr *h;
+	struct blockif_rc_slot *s;
+	struct stat st;
+	char name[BLOCKIF_RC_NAMELEN];
+	size_t hlen, slen;
+	uint64_t nslots, k, seq;
+	int fd, creator, i, tries, err;
+
+	/*
+	 * Nothing about a device node changes when the volume behind it
+	 * is rewritten, so those need to be named by the user.
+	 */
+	if (id != NULL)
+		snprintf(name, sizeof(name), "/acrn-blk-id-%s-%lx", id,
+			 (unsigned long)bc->size);
+	else if (S_ISBLK(sbuf->st_mode)) {
+		errno = EINVAL;
+		return NULL;
+	} else
+		snprintf(name, sizeof(name),
+			 "/acrn-blk-%lx-%lx-%lx-%lx-%lx.%lx",
+			 (unsigned long)sbuf->st_dev,
+			 (unsigned long)sbuf->st_ino,
+			 (unsigned long)bc->sub_file_start_lba,
+			 (unsigned long)bc->size,
+			 (unsigned long)sbuf->st_mtim.tv_sec,
+			 (unsigned long)sbuf->st_mtim.tv_nsec);
+	nslots = (uint64_t)mb * 1024 * 1024 / BLOCKIF_RC_BLKSZ;
+	hlen = roundup(sizeof(struct blockif_rc_hdr), 4096);
+
+	rc = calloc(1, sizeof(struct blockif_rcache));
+	if (rc == NULL)
+		return NULL;
+	rc->fd = -1;
+	rc->hdr = MAP_FAILED;
+	strncpy(rc->name, name, sizeof(rc->name));
+
+	for (tries = 0; ; tries++) {
+		if (tries == 10) {
+			errno = EBUSY;
+			goto fail;
+		}
+		creator = 1;
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0 && blockif_rc_lock(fd, 0, F_WRLCK)) {
+			shm_unlink(name);
+			close(fd);
+			goto fail;
+		}
+		if (fd < 0 && errno == EEXIST) {
+			creator = 0;
+			fd = shm_open(name, O_RDWR, 0600);
+		}
+		if (fd < 0)
+			goto fail;
+		rc->fd = fd;
+		if (flock(fd, LOCK_SH) || fstat(fd, &st))
+			goto fail;
+		if (st.st_nlink == 0) {
+			/* unlinked by its last user in between */
+			close(fd);
+			rc->fd = -1;
+			continue;
+		}
+
+		if (creator) {
+			slen = roundup(nslots * sizeof(struct blockif_rc_slot),
+				       4096);
+			err = posix_fallocate(fd, 0, hlen + slen +
+					      nslots * BLOCKIF_RC_BLKSZ);
+			if (err != 0) {
+				shm_unlink(name);
+				errno = err;
+				goto fail;
+			}
+		}
+
+		/*
+		 * Wait for the creator to size the segment and set up its
+		 * header, for as long as it is around to do so.  Its lock
+		 * is checked first: it only drops it once both are done.
+		 */
+		for (i = 0; ; i++) {
+			if (i >= BLOCKIF_RC_WAIT && !blockif_rc_held(fd, 0))
+				i = -1;
+			if (fstat(fd, &st))
+				goto fail;
+			if (st.st_size != 0 || i < 0)
+				break;
+			usleep(1000);
+		}
+		if (st.st_size == 0)
+			goto stale;
+		if (rc->hdr == MAP_FAILED) {
+			rc->maplen = st.st_size;
+			rc->hdr = mmap(NULL, rc->maplen,
+				       PROT_READ | PROT_WRITE, MAP_SHARED,
+				       fd, 0);
+			if (rc->hdr == MAP_FAILED)
+				goto fail;
+		}
+		h = rc->hdr;
+		if (creator) {
+			h->blksz = BLOCKIF_RC_BLKSZ;
+			h->nslots = nslots;
+			h->size = bc->size;
+			strncpy(h->name, name, sizeof(h->name));
+			__atomic_store_n(&h->magic, BLOCKIF_RC_MAGIC,
+					 __ATOMIC_RELEASE);
+			blockif_rc_lock(fd, 0, F_UNLCK);
+		}
+		for (i = 0; ; i++) {
+			if (i >= BLOCKIF_RC_WAIT && !blockif_rc_held(fd, 0))
+				i = -1;
+			if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) ==
+			    BLOCKIF_RC_MAGIC || i < 0)
+				break;
+			usleep(1000);
+		}
+		if (h->magic == BLOCKIF_RC_MAGIC)
+			break;
+stale:
+		/*
+		 * The creator died half way: whoever is the only one left
+		 * with it open removes it, then all start over.
+		 */
+		WPRINTF(("blockif: read cache %s left unset, "
+			 "recreating\n", name));
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+			shm_unlink(name);
+		if (rc->hdr != MAP_FAILED)
+			munmap(rc->hdr, rc->maplen);
+		rc->hdr = MAP_FAILED;
+		close(fd);
+		rc->fd = -1;
+	}
+
+	nslots = h->nslots;
+	slen = roundup(nslots * sizeof(struct blockif_rc_slot), 4096);
+	if (h->blksz != BLOCKIF_RC_BLKSZ || h->size != bc->size ||
+	    strncmp(h->name, name, sizeof(h->name)) || nslots == 0 ||
+	    hlen + slen + nslots * BLOCKIF_RC_BLKSZ > rc->maplen) {
+		errno = EINVAL;
+		goto fail;
+	}
+	rc->nslots = nslots;
+	rc->slots = (struct blockif_rc_slot *)((uint8_t *)h + hlen);
+	rc->data = (uint8_t *)h + hlen + slen;
+
+	/*
+	 * Take an owner token.  Whoever had it last is gone, so slots it
+	 * left half filled can be taken back now.
+	 */
+	for (rc->token = 1; rc->token <= BLOCKIF_RC_USERS; rc->token++)
+		if (blockif_rc_lock(fd, rc->token, F_WRLCK) == 0)
+			break;
+	if (rc->token > BLOCKIF_RC_USERS) {
+		errno = EUSERS;
+		goto fail;
+	}
+	for (k = 0; k < nslots; k++) {
+		s = &rc->slots[k];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+		if ((seq & 1) && (seq >> 32) == rc->token)
+			__atomic_compare_exchange_n(&s->seq, &seq,
+				(uint32_t)(seq + 1), 0, __ATOMIC_RELEASE,
+				__ATOMIC_RELAXED);
+	}
+	return rc;
+
+fail:
+	err = errno;
+	if (rc->hdr != MAP_FAILED)
+		munmap(rc->hdr, rc->maplen);
+	if (rc->fd >= 0)
+		close(rc->fd);
+	free(rc);
+	errno = err;
+	return NULL;
+}
+
+/*
+ * O_DIRECT alignment: the logical block size for devices; for files
+ * what the filesystem reports, where the kernel can tell, or else the
+ * common 512 bytes.
+ */
+static void
+blockif_dio_align(int fd, int isblk, size_t *mem, size_t *len)
+{
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+#endif
+	int ssz;
+
+	*mem = *len = DEV_BSIZE;
+	if (isblk) {
+		if (ioctl(fd, BLKSSZGET, &ssz) == 0 && ssz > 0)
+			*mem = *len = ssz;
+		return;
+	}
+#ifdef STATX_DIOALIGN
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+	    (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_mem_align != 0) {
+		*mem = stx.stx_dio_mem_align;
+		*len = stx.stx_dio_offset_align;
+	}
+#endif
+}
 
 struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident)
@@ -468,7 +2159,16 @@ blockif_open(const char *optstr, const char *ident)
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
 	int extra, fd, i, sectsz;
-	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
+	int nocache, sync, ro, candelete, ssopt, pssopt;
+	int sqpoll;
+	enum blockaio aio;
+	int cache;
+	int depth;
+	int merge, merge_kb;
+	int qcache;
+	struct qcow2 *qcow;
+	int rcache_mb, ra_kb;
+	char *rcache_id;
 	long sz;
 	long long b;
 	int err_code = -1;
@@ -483,6 +2183,17 @@ blockif_open(const char *optstr, const char *ident)
 	sync = 0;
 	ro = 0;
 	sub_file_assign = 0;
+	aio = AIO_THREADS;
+	sqpoll = 0;
+	cache = -1;
+	depth = BLOCKIF_DEPTH;
+	merge = 0;
+	merge_kb = BLOCKIF_MERGE_MAX / 1024;
+	qcache = QCOW2_CACHE_DEFAULT;
+	qcow = NULL;
+	rcache_mb = 0;
+	rcache_id = NULL;
+	ra_kb = BLOCKIF_RA_DEFAULT;
 
 	/*
 	 * The first element in the optstring is always a pathname.
@@ -503,6 +2214,63 @@ blockif_open(const char *optstr, const char *ident)
 			sync = 1;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strcmp(cp, "aio=threads"))
+			aio = AIO_THREADS;
+		else if (!strcmp(cp, "aio=io_uring"))
+			aio = AIO_URING;
+		else if (!strcmp(cp, "aio=native"))
+			aio = AIO_NATIVE;
+		else if (!strcmp(cp, "sqpoll"))
+			sqpoll = 1;
+		else if (sscanf(cp, "depth=%d", &depth) == 1) {
+			if (depth < 1 || depth > BLOCKIF_DEPTH_MAX) {
+				fprintf(stderr, "Invalid depth \"%s\"\n", cp);
+				goto err;
+			}
+		} else if (!strcmp(cp, "merge"))
+			merge = 1;
+		else if (sscanf(cp, "merge=%d", &merge_kb) == 1) {
+			if (merge_kb < 4 || merge_kb > 64 * 1024) {
+				fprintf(stderr, "Invalid merge size \"%s\"\n",
+					cp);
+				goto err;
+			}
+			merge = 1;
+		} else if (sscanf(cp, "qcow2_cache=%d", &qcache) == 1) {
+			if (qcache < 4 || qcache > 65536) {
+				fprintf(stderr, "Invalid qcow2 cache \"%s\"\n",
+					cp);
+				goto err;
+			}
+		} else if (sscanf(cp, "rcache=%d", &rcache_mb) == 1) {
+			if (rcache_mb < 1 || rcache_mb > 64 * 1024) {
+				fprintf(stderr, "Invalid rcache \"%s\"\n", cp);
+				goto err;
+			}
+		} else if (!strncmp(cp, "rcache_id=", 10)) {
+			rcache_id = cp + 10;
+			if (*rcache_id == '\0' ||
+			    strlen(rcache_id) > BLOCKIF_RC_IDLEN ||
+			    strspn(rcache_id, "abcdefghijklmnopqrstuvwxyz"
+				   "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.") !=
+			    strlen(rcache_id)) {
+				fprintf(stderr, "Invalid rcache_id \"%s\"\n",
+					cp);
+				goto err;
+			}
+		} else if (sscanf(cp, "ra=%d", &ra_kb) == 1) {
+			if (ra_kb < 0 || ra_kb > 64 * 1024) {
+				fprintf(stderr, "Invalid ra \"%s\"\n", cp);
+				goto err;
+			}
+		} else if (!strcmp(cp, "cache=writethrough"))
+			cache = CACHE_WRITETHROUGH;
+		else if (!strcmp(cp, "cache=writeback"))
+			cache = CACHE_WRITEBACK;
+		else if (!strcmp(cp, "cache=none"))
+			cache = CACHE_NONE;
+		else if (!strcmp(cp, "cache=unsafe"))
+			cache = CACHE_UNSAFE;
 		else if (sscanf(cp, "sectorsize=%d/%d", &ssopt, &pssopt) == 2)
 			;
 		else if (sscanf(cp, "sectorsize=%d", &ssopt) == 1)
@@ -516,9 +2284,25 @@ blockif_open(const char *optstr, const char *ident)
 		}
 	}
 
-	/* enforce a write-through policy by default */
-	nocache = 1;
-	sync = 1;
+	/*
+	 * Write-through unless asked otherwise.  The older nocache and
+	 * sync/direct options map onto the nearest cache mode.
+	 */
+	if (cache < 0)
+		cache = (nocache && !sync) ? CACHE_NONE : CACHE_WRITETHROUGH;
+
+	switch (cache) {
+	case CACHE_WRITETHROUGH:
+		nocache = sync = 1;
+		break;
+	case CACHE_NONE:
+		nocache = 1;
+		sync = 0;
+		break;
+	default:
+		nocache = sync = 0;
+		break;
+	}
 
 	extra = 0;
 	if (nocache)
@@ -549,7 +2333,7 @@ blockif_open(const char *optstr, const char *ident)
 	size = sbuf.st_size;
 	sectsz = DEV_BSIZE;
 	psectsz = psectoff = 0;
-	candelete = geom = 0;
+	candelete = 0;
 
 	if (S_ISBLK(sbuf.st_mode)) {
 		/* get size */
@@ -587,6 +2371,24 @@ blockif_open(const char *optstr, const char *ident)
 	} else
 		psectsz = sbuf.st_blksize;
 
+	/*
+	 * qcow2 images go through the qcow2 layer, and have the size of
+	 * the disk they hold.
+	 */
+	if (S_ISREG(sbuf.st_mode) && qcow2_probe(fd)) {
+		if (sub_file_assign) {
+			fprintf(stderr, "range= not supported for qcow2\n");
+			goto err;
+		}
+		qcow = qcow2_open(fd, nopt, ro, extra, qcache);
+		if (qcow == NULL)
+			goto err;
+		size = qcow2_size(qcow);
+	}
+
+	if (!ro && qcow == NULL)
+		candelete = blockif_probe_discard(fd, &sbuf);
+
 	if (ssopt != 0) {
 		if (!powerof2(ssopt) || !powerof2(pssopt) || ssopt < 512 ||
 		    ssopt > pssopt) {
@@ -644,9 +2446,11 @@ blockif_open(const char *optstr, const char *ident)
 	bc->magic = BLOCKIF_SIG;
 	bc->fd = fd;
 	bc->isblk = S_ISBLK(sbuf.st_mode);
-	bc->isgeom = geom;
+	bc->qcow = qcow;
 	bc->candelete = candelete;
 	bc->rdonly = ro;
+	bc->cache = cache;
+	bc->wce = (cache != CACHE_WRITETHROUGH);
 	bc->size = size;
 	bc->sectsz = sectsz;
 	bc->psectsz = psectsz;
@@ -655,20 +2459,147 @@ blockif_open(const char *optstr, const char *ident)
 	pthread_cond_init(&bc->cond, NULL);
 	TAILQ_INIT(&bc->freeq);
 	TAILQ_INIT(&bc->pendq);
+	TAILQ_INIT(&bc->blockq);
 	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+	bc->maxreq = depth + BLOCKIF_NUMTHR;
+	for (bc->hbits = 4; (1 << bc->hbits) < bc->maxreq; bc->hbits++)
+		;
+	bc->reqs = calloc(bc->maxreq, sizeof(struct blockif_elem));
+	bc->endh = calloc(1 << bc->hbits, sizeof(struct blockif_bucket));
+	bc->starth = calloc(1 << bc->hbits, sizeof(struct blockif_bucket));
+	if (bc->reqs == NULL || bc->endh == NULL || bc->starth == NULL) {
+		perror("calloc");
+		free(bc->reqs);
+		free(bc->endh);
+		free(bc->starth);
+		free(bc);
+		goto err;
+	}
+	bc->merge = merge;
+	bc->merge_max = merge_kb * 1024UL;
+	for (i = 0; i < bc->maxreq && merge; i++) {
+		bc->reqs[i].miov = calloc(BLOCKIF_MERGE_IOV,
+					  sizeof(struct iovec));
+		if (bc->reqs[i].miov == NULL) {
+			WPRINTF(("blockif: no memory to merge requests\n"));
+			bc->merge = 0;
+			break;
+		}
+	}
+	for (i = 0; i < bc->maxreq; i++) {
 		bc->reqs[i].status = BST_FREE;
 		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
 	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
-		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
-		pthread_setname_np(bc->btid[i], tname);
+	bc->ring.fd = -1;
+	bc->aio_ctx.efd = -1;
+	if (qcow != NULL && aio != AIO_THREADS) {
+		/* cluster lookup and allocation happen in blockif_proc() */
+		WPRINTF(("blockif: qcow2 images use aio=threads\n"));
+		aio = AIO_THREADS;
+	}
+	if (aio == AIO_NATIVE && !(extra & O_DIRECT)) {
+		/*
+		 * Without O_DIRECT io_submit() does the I/O synchronously,
+		 * on the vCPU thread and under the context mutex.
+		 */
+		WPRINTF(("blockif: aio=native needs cache=none or "
+			 "writethrough, using threads\n"));
+		aio = AIO_THREADS;
+	}
+
+	/*
+	 * The read cache and read-ahead are for read-only disks, where
+	 * nothing can make a cached block stale.  Read-ahead needs the
+	 * read cache, or the page cache, to read into.
+	 */
+	if (rcache_mb != 0 && !ro)
+		WPRINTF(("blockif: rcache= only applies to ro disks\n"));
+	else if (rcache_mb != 0) {
+		bc->rc = blockif_rc_open(bc, &sbuf, rcache_id, rcache_mb);
+		if (bc->rc == NULL && rcache_id == NULL &&
+		    S_ISBLK(sbuf.st_mode))
+			WPRINTF(("blockif: rcache= on a device needs "
+				 "rcache_id=\n"));
+		else if (bc->rc == NULL)
+			WPRINTF(("blockif: no read cache for %s: %s\n", nopt,
+				 strerror(errno)));
+	}
+	if (bc->rc != NULL && aio != AIO_THREADS) {
+		WPRINTF(("blockif: read cache uses aio=threads\n"));
+		aio = AIO_THREADS;
+	}
+	pthread_mutex_init(&bc->ra.mtx, NULL);
+	pthread_cond_init(&bc->ra.cond, NULL);
+	if (ro && (bc->rc != NULL || (!(extra & O_DIRECT) && qcow == NULL)))
+		bc->ra.window = ra_kb * 1024L;
+	if (bc->ra.window != 0 && bc->rc != NULL) {
+		pthread_create(&bc->ra.tid, NULL, blockif_ra_thr, bc);
+		snprintf(tname, sizeof(tname), "blk-%s-ra", ident);
+		pthread_setname_np(bc->ra.tid, tname);
+		bc->ra.running = 1;
+	}
+	if (aio == AIO_URING && sqpoll &&
+	    blockif_uring_setup(&bc->ring, bc->maxreq, 1))
+		WPRINTF(("blockif: io_uring sqpoll unavailable (%s), "
+			 "using a plain ring\n", strerror(errno)));
+	if (aio == AIO_URING && bc->ring.fd < 0 &&
+	    blockif_uring_setup(&bc->ring, bc->maxreq, 0)) {
+		WPRINTF(("blockif: io_uring unavailable (%s), using threads\n",
+			 strerror(errno)));
+		aio = AIO_THREADS;
+	}
+	if (aio == AIO_NATIVE && blockif_aio_setup(bc)) {
+		WPRINTF(("blockif: native aio unavailable (%s), using threads\n",
+			 strerror(errno)));
+		aio = AIO_THREADS;
+	}
+	if (aio != AIO_THREADS && blockif_defer_setup(bc)) {
+		WPRINTF(("blockif: %s, using threads\n", strerror(errno)));
+		blockif_uring_close(&bc->ring);
+		blockif_aio_close(&bc->aio_ctx);
+		aio = AIO_THREADS;
+	}
+	bc->aio = aio;
+
+	/*
+	 * Under O_DIRECT, misaligned guest buffers are bounced; every
+	 * thread that runs blockif_proc() gets a buffer.
+	 */
+	if (extra & O_DIRECT) {
+		if (blockif_bounce_setup(&bc->bpool, (aio == AIO_THREADS) ?
+					 BLOCKIF_NUMTHR : 1) == 0)
+			blockif_dio_align(fd, bc->isblk, &bc->dio_memalign,
+					  &bc->dio_lenalign);
+		else
+			WPRINTF(("blockif: no bounce buffers, misaligned "
+				 "I/O will fail\n"));
+	}
+
+	if (bc->aio != AIO_THREADS) {
+		bc->nthr = 1;
+		pthread_create(&bc->btid[0], NULL, blockif_defer_thr, bc);
+		snprintf(tname, sizeof(tname), "blk-%s-aio", ident);
+		pthread_setname_np(bc->btid[0], tname);
+	}
+	if (bc->aio == AIO_URING) {
+		bc->nthr = 2;
+		pthread_create(&bc->btid[1], NULL, blockif_uring_thr, bc);
+		snprintf(tname, sizeof(tname), "blk-%s-uring", ident);
+		pthread_setname_np(bc->btid[1], tname);
+	} else if (bc->aio == AIO_THREADS) {
+		bc->nthr = BLOCKIF_NUMTHR;
+		for (i = 0; i < BLOCKIF_NUMTHR; i++) {
+			pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
+			snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
+			pthread_setname_np(bc->btid[i], tname);
+		}
 	}
 
 	return bc;
 err:
+	if (qcow != NULL)
+		qcow2_close(qcow);
 	if (fd >= 0)
 		close(fd);
 	return NULL;
@@ -686,10 +2617,17 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 	if (!TAILQ_EMPTY(&bc->freeq)) {
 		/*
 		 * Enqueue and inform the block i/o thread
-		 * that there is work available
+		 * that there is work available, or with io_uring
+		 * start it right away.
 		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->cond);
+		if (blockif_enqueue(bc, breq, op)) {
+			if (bc->aio == AIO_URING)
+				blockif_uring_kick(bc);
+			else if (bc->aio == AIO_NATIVE)
+				blockif_aio_kick(bc);
+			else
+				pthread_cond_signal(&bc->cond);
+		}
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -708,6 +2646,9 @@ int
 blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
 	assert(bc->magic == BLOCKIF_SIG);
+	if (bc->ra.window != 0)
+		blockif_ra_note(bc, breq->offset,
+				blockif_iov_len(breq->iov, breq->iovcnt));
 	return blockif_request(bc, breq, BOP_READ);
 }
 
@@ -732,6 +2673,13 @@ blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DELETE);
 }
 
+int
+blockif_zero(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	return blockif_request(bc, breq, BOP_ZERO);
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
@@ -747,6 +2695,12 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		if (be->req == breq)
 			break;
 	}
+	if (be == NULL) {
+		TAILQ_FOREACH(be, &bc->blockq, link) {
+			if (be->req == breq)
+				break;
+		}
+	}
 	if (be != NULL) {
 		/*
 		 * Found it.
@@ -772,6 +2726,39 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		return -1;
 	}
 
+	/*
+	 * With io_uring ask the kernel to abort it; it still completes
+	 * through the normal callback path, with ECANCELED if that
+	 * worked in time.
+	 */
+	if (bc->aio == AIO_URING) {
+		struct io_uring_sqe *sqe;
+
+		if (be->status == BST_BUSY) {
+			sqe = blockif_uring_sqe(&bc->ring);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uintptr_t)be;
+			blockif_uring_push(&bc->ring);
+			blockif_uring_submit(&bc->ring);
+		}
+		pthread_mutex_unlock(&bc->mtx);
+		return -EBUSY;
+	}
+
+	/*
+	 * Native AIO: O_DIRECT file I/O is rarely cancellable, so this is
+	 * best effort and the request normally just runs to completion.
+	 */
+	if (bc->aio == AIO_NATIVE) {
+		struct io_event ev;
+
+		if (be->status == BST_BUSY)
+			syscall(__NR_io_cancel, bc->aio_ctx.ctx,
+				&bc->aio_ctx.iocb[be - bc->reqs], &ev);
+		pthread_mutex_unlock(&bc->mtx);
+		return -EBUSY;
+	}
+
 	/*
 	 * Interrupt the processing thread to force it return
 	 * prematurely via it's normal callback path.
@@ -823,10 +2810,29 @@ blockif_close(struct blockif_ctxt *bc)
 	 */
 	pthread_mutex_lock(&bc->mtx);
 	bc->closing = 1;
+	if (bc->aio == AIO_URING) {
+		/* an empty NOP wakes the reaper up to see it */
+		blockif_uring_sqe(&bc->ring)->opcode = IORING_OP_NOP;
+		blockif_uring_push(&bc->ring);
+		blockif_uring_submit(&bc->ring);
+	}
 	pthread_mutex_unlock(&bc->mtx);
 	pthread_cond_broadcast(&bc->cond);
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
+	for (i = 0; i < bc->nthr; i++)
 		pthread_join(bc->btid[i], &jval);
+	blockif_uring_close(&bc->ring);
+	blockif_aio_close(&bc->aio_ctx);
+	blockif_defer_close(&bc->dfr);
+	blockif_bounce_close(&bc->bpool);
+	if (bc->ra.running) {
+		pthread_mutex_lock(&bc->ra.mtx);
+		bc->ra.closing = 1;
+		pthread_cond_signal(&bc->ra.cond);
+		pthread_mutex_unlock(&bc->ra.mtx);
+		pthread_join(bc->ra.tid, &jval);
+	}
+	if (bc->rc != NULL)
+		blockif_rc_close(bc->rc);
 
 	/* XXX Cancel queued i/o's ??? */
 
@@ -834,7 +2840,14 @@ blockif_close(struct blockif_ctxt *bc)
 	 * Release resources
 	 */
 	bc->magic = 0;
+	if (bc->qcow != NULL)
+		qcow2_close(bc->qcow);
 	close(bc->fd);
+	for (i = 0; i < bc->maxreq; i++)
+		free(bc->reqs[i].miov);
+	free(bc->reqs);
+	free(bc->endh);
+	free(bc->starth);
 	free(bc);
 
 	return 0;
@@ -918,7 +2931,7 @@ int
 blockif_queuesz(struct blockif_ctxt *bc)
 {
 	assert(bc->magic == BLOCKIF_SIG);
-	return (BLOCKIF_MAXREQ - 1);
+	return (bc->maxreq - 1);
 }
 
 int
@@ -934,3 +2947,39 @@ blockif_candelete(struct blockif_ctxt *bc)
 	assert(bc->magic == BLOCKIF_SIG);
 	return bc->candelete;
 }
+
+void
+blockif_get_stats(struct blockif_ctxt *bc, struct blockif_stats *st)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	pthread_mutex_lock(&bc->mtx);
+	*st = bc->stats;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+/*
+ * Whether the guest should treat the disk as having a volatile write
+ * cache, i.e. whether writes are only durable after a flush.
+ */
+int
+blockif_get_wce(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	return bc->wce;
+}
+
+/*
+ * Let the guest turn the write cache off.  A disk opened write-through
+ * has none to turn on; the others make each write durable while it is
+ * off.
+ */
+void
+blockif_set_wce(struct blockif_ctxt *bc, int wce)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	if (bc->cache == CACHE_WRITETHROUGH)
+		return;
+	pthread_mutex_lock(&bc->mtx);
+	bc->wce = !!wce;
+	pthread_mutex_unlock(&bc->mtx);
+}
@@ -0,0 +1,1138 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * qcow2 images for block_if.
+ *
+ * Guest clusters map through the L1 table, kept whole in memory, and
+ * L2 tables, which share an LRU cache with the refcount blocks.  All
+ * metadata is handled under one mutex; data I/O runs without it.  New
+ * clusters are appended at the end of the file and never freed, so the
+ * only refcount change ever made is 0 -> 1.  A guest cluster being
+ * allocated is on the allocs list until its L2 entry is set; other
+ * writers to that cluster wait for it, everyone else carries on.
+ *
+ * Metadata reaches the disk on qcow2_flush(), or when a dirty table is
+ * evicted: refcounts first, then a data sync, then L2 and L1 tables,
+ * so a table never points at a cluster whose data or refcount could be
+ * lost.  Leaked clusters after a crash are harmless.
+ *
+ * Not supported: encryption, compressed clusters, external data files,
+ * extended L2 entries, and writing to images with internal snapshots,
+ * marked dirty, or with refcounts other than 16 bits wide.  Those are
+ * either refused at open, or opened read-only only.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qcow2.h"
+
+#define WPRINTF(params) (printf params)
+
+#define QCOW2_MAGIC		0x514649fbU	/* "QFI\xfb" */
+#define QCOW2_CHAIN_MAX		16		/* backing files deep */
+#define QCOW2_SLICE_IOV		64		/* iovecs per data syscall */
+
+#define QCOW2_OFLAG_COPIED	(1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED	(1ULL << 62)
+#define QCOW2_OFLAG_ZERO	(1ULL << 0)	/* version 3 only */
+#define QCOW2_OFFSET_MASK	0x00fffffffffffe00ULL
+#define QCOW2_REFT_OFFSET_MASK	0xfffffffffffffe00ULL
+
+#define QCOW2_INCOMPAT_DIRTY	(1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT	(1ULL << 1)
+
+#define QCOW2_EXT_END		0
+#define QCOW2_EXT_BACKING_FMT	0xe2792acaU
+
+/* on-disk header, big-endian */
+struct qcow2_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	backing_file_offset;
+	uint32_t	backing_file_size;
+	uint32_t	cluster_bits;
+	uint64_t	size;
+	uint32_t	crypt_method;
+	uint32_t	l1_size;
+	uint64_t	l1_table_offset;
+	uint64_t	refcount_table_offset;
+	uint32_t	refcount_table_clusters;
+	uint32_t	nb_snapshots;
+	uint64_t	snapshots_offset;
+	/* version 3 */
+	uint64_t	incompatible_features;
+	uint64_t	compatible_features;
+	uint64_t	autoclear_features;
+	uint32_t	refcount_order;
+	uint32_t	header_length;
+} __attribute__((packed));
+
+#define QCOW2_V2_HDRLEN		72
+
+/* one cached L2 table or refcount block */
+struct qcow2_table {
+	TAILQ_ENTRY(qcow2_table) lru;
+	LIST_ENTRY(qcow2_table)	hlink;
+	uint64_t		off;	/* host offset, 0 if unused */
+	int			refblock;
+	int			dirty;
+	void			*data;
+};
+
+/* a guest cluster whose first write is in progress */
+struct qcow2_alloc {
+	LIST_ENTRY(qcow2_alloc)	link;
+	uint64_t		gc;
+};
+
+/* where a guest cluster's data is */
+enum qcow2_kind {
+	QK_DATA,
+	QK_ZERO,
+	QK_BACKING,
+	QK_COMPRESSED
+};
+
+struct qcow2 {
+	int			fd;
+	int			ownfd;	/* a backing file we opened */
+	int			ro;
+	uint32_t		version;
+	int			cluster_bits;
+	size_t			cluster_size;
+	uint64_t		size;
+	int			l2_bits;	/* log2 of entries per table */
+	int			refblock_bits;
+	uint8_t			*hdr;		/* first cluster */
+
+	uint64_t		*l1;		/* big-endian, as on disk */
+	uint32_t		l1_size;
+	uint64_t		l1_off;
+	size_t			l1_len;		/* whole clusters */
+	int			l1_dirty;
+
+	uint64_t		*reftable;	/* big-endian, as on disk */
+	uint64_t		reftable_n;
+	uint64_t		reftable_off;
+	uint32_t		reftable_clusters;
+	int			reftable_dirty;	/* and the header */
+	int			refs_unsynced;	/* refblocks written, not synced */
+	uint64_t		next_free;	/* where clusters are added */
+
+	/* backing file: another qcow2 image, or raw */
+	struct qcow2		*backing;
+	int			backing_fd;
+	uint64_t		backing_size;
+
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	struct qcow2_table	*tables;
+	int			ntables;
+	uint8_t			*tabmem;
+	int			hbits;
+	LIST_HEAD(, qcow2_table) *hash;
+	TAILQ_HEAD(qcow2_table_lru, qcow2_table) lru;
+	LIST_HEAD(, qcow2_alloc) allocs;
+};
+
+/* a position in a caller's iovec array */
+struct qcow2_iovcur {
+	const struct iovec	*iov;
+	int			cnt;
+	int			i;
+	size_t			off;
+};
+
+static struct qcow2 *qcow2_open_chain(int fd, const char *path, int ro,
+				      int oflags, int ntables, int depth);
+
+static void *
+qcow2_alloc_buf(size_t len)
+{
+	void *p;
+
+	/* page-aligned, so it can go to an O_DIRECT file as is */
+	if (posix_memalign(&p, 4096, len))
+		return NULL;
+	memset(p, 0, len);
+	return p;
+}
+
+static int
+qcow2_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	n = pread(fd, buf, len, off);
+	if (n < 0)
+		return -errno;
+	/* past the end of the file reads as zeroes */
+	if (n < len)
+		memset((uint8_t *)buf + n, 0, len - n);
+	return 0;
+}
+
+static int
+qcow2_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	n = pwrite(fd, buf, len, off);
+	if (n < 0)
+		return -errno;
+	return (n == len) ? 0 : -EIO;
+}
+
+/*
+ * Take up to len bytes off the cursor into out[], at most
+ * QCOW2_SLICE_IOV entries.  Returns the bytes taken.
+ */
+static size_t
+qcow2_iov_take(struct qcow2_iovcur *c, size_t len, struct iovec *out,
+	       int *nout)
+{
+	size_t taken, l;
+	int n;
+
+	for (taken = 0, n = 0; taken < len && c->i < c->cnt &&
+	     n < QCOW2_SLICE_IOV; n++) {
+		l = MIN(c->iov[c->i].iov_len - c->off, len - taken);
+		out[n].iov_base = (uint8_t *)c->iov[c->i].iov_base + c->off;
+		out[n].iov_len = l;
+		taken += l;
+		c->off += l;
+		if (c->off == c->iov[c->i].iov_len) {
+			c->i++;
+			c->off = 0;
+		}
+	}
+	*nout = n;
+	return taken;
+}
+
+/*
+ * Move len bytes between the cursor and fd at off; reads past the end
+ * of the file give zeroes.  fd < 0 just zero-fills.
+ */
+static int
+qcow2_iov_io(int fd, int write, struct qcow2_iovcur *c, size_t len,
+	     off_t off)
+{
+	struct iovec out[QCOW2_SLICE_IOV];
+	size_t t, z;
+	ssize_t n;
+	int i, nout;
+
+	while (len > 0) {
+		t = qcow2_iov_take(c, len, out, &nout);
+		if (t == 0)
+			return -EINVAL;
+		if (fd < 0)
+			n = 0;
+		else if (write)
+			n = pwritev(fd, out, nout, off);
+		else
+			n = preadv(fd, out, nout, off);
+		if (n < 0)
+			return -errno;
+		if (n < t) {
+			if (write)
+				return -EIO;
+			for (i = 0; i < nout; i++) {
+				if (n >= out[i].iov_len) {
+					n -= out[i].iov_len;
+					continue;
+				}
+				z = out[i].iov_len - n;
+				memset((uint8_t *)out[i].iov_base + n, 0, z);
+				n = 0;
+			}
+		}
+		len -= t;
+		off += t;
+	}
+	return 0;
+}
+
+/*
+ * Metadata table cache
+ */
+
+static inline unsigned
+qcow2_hash(struct qcow2 *q, uint64_t off)
+{
+	return (off * 0x9e3779b97f4a7c15ULL) >> (64 - q->hbits);
+}
+
+static int qcow2_flush_refs(struct qcow2 *q);
+
+/*
+ * Write a table out.  An L2 table may point at clusters only the
+ * refcounts account for: callers make those durable first.
+ */
+static int
+qcow2_table_writeback(struct qcow2 *q, struct qcow2_table *t)
+{
+	int err;
+
+	err = qcow2_pwrite(q->fd, t->data, q->cluster_size, t->off);
+	if (err == 0) {
+		t->dirty = 0;
+		if (t->refblock)
+			q->refs_unsynced = 1;
+	}
+	return err;
+}
+
+/*
+ * The table at host offset off, read in unless it is new.  The pointer
+ * is good until the next call that can evict.  Called with mtx held.
+ */
+static struct qcow2_table *
+qcow2_table_get(struct qcow2 *q, uint64_t off, int refblock, int load)
+{
+	struct qcow2_table *t;
+	unsigned h;
+	int err;
+
+	h = qcow2_hash(q, off);
+	LIST_FOREACH(t, &q->hash[h], hlink) {
+		if (t->off == off)
+			break;
+	}
+	if (t != NULL) {
+		TAILQ_REMOVE(&q->lru, t, lru);
+		TAILQ_INSERT_HEAD(&q->lru, t, lru);
+		return t;
+	}
+
+	t = TAILQ_LAST(&q->lru, qcow2_table_lru);
+	if (t->off != 0) {
+		err = 0;
+		if (t->dirty && !t->refblock)
+			err = qcow2_flush_refs(q);
+		if (t->dirty && err == 0)
+			err = qcow2_table_writeback(q, t);
+		if (err) {
+			errno = -err;
+			return NULL;
+		}
+		LIST_REMOVE(t, hlink);
+		t->off = 0;
+	}
+	if (load) {
+		err = qcow2_pread(q->fd, t->data, q->cluster_size, off);
+		if (err) {
+			errno = -err;
+			return NULL;
+		}
+	} else
+		memset(t->data, 0, q->cluster_size);
+	t->off = off;
+	t->refblock = refblock;
+	t->dirty = !load;
+	LIST_INSERT_HEAD(&q->hash[h], t, hlink);
+	TAILQ_REMOVE(&q->lru, t, lru);
+	TAILQ_INSERT_HEAD(&q->lru, t, lru);
+	return t;
+}
+
+/*
+ * Refcounts and cluster allocation, all called with mtx held
+ */
+
+static int qcow2_ref_inc(struct qcow2 *q, uint64_t host);
+
+/*
+ * Move the refcount table to the end of the file, large enough for
+ * entry ti.  The old table's clusters are leaked.
+ */
+static int
+qcow2_reftable_grow(struct qcow2 *q, uint64_t ti)
+{
+	uint64_t *t, n, per, off;
+	uint32_t nclu, i;
+	int err;
+
+	per = q->cluster_size / sizeof(uint64_t);
+	n = roundup(MAX(ti + 1, q->reftable_n * 2), per);
+	nclu = n / per;
+	t = qcow2_alloc_buf(nclu * q->cluster_size);
+	if (t == NULL)
+		return -ENOMEM;
+	memcpy(t, q->reftable, q->reftable_n * sizeof(uint64_t));
+	off = q->next_free;
+	q->next_free += (uint64_t)nclu * q->cluster_size;
+
+	free(q->reftable);
+	q->reftable = t;
+	q->reftable_n = n;
+	q->reftable_off = off;
+	q->reftable_clusters = nclu;
+	q->reftable_dirty = 1;
+	for (i = 0; i < nclu; i++) {
+		err = qcow2_ref_inc(q, off + (uint64_t)i * q->cluster_size);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int
+qcow2_ref_inc(struct qcow2 *q, uint64_t host)
+{
+	struct qcow2_table *t;
+	uint64_t ci, ti, blk;
+	uint16_t *p;
+	int err;
+
+	ci = host >> q->cluster_bits;
+	ti = ci >> q->refblock_bits;
+	if (ti >= q->reftable_n && (err = qcow2_reftable_grow(q, ti)) != 0)
+		return err;
+	blk = be64toh(q->reftable[ti]) & QCOW2_REFT_OFFSET_MASK;
+	if (blk == 0) {
+		/* a new refcount block, which counts itself if in range */
+		blk = q->next_free;
+		q->next_free += q->cluster_size;
+		if (qcow2_table_get(q, blk, 1, 0) == NULL)
+			return -errno;
+		q->reftable[ti] = htobe64(blk);
+		q->reftable_dirty = 1;
+		if ((err = qcow2_ref_inc(q, blk)) != 0)
+			return err;
+	}
+
+	t = qcow2_table_get(q, blk, 1, 1);
+	if (t == NULL)
+		return -errno;
+	p = (uint16_t *)t->data + (ci & ((1ULL << q->refblock_bits) - 1));
+	*p = htobe16(be16toh(*p) + 1);
+	t->dirty = 1;
+	return 0;
+}
+
+static int64_t
+qcow2_alloc_cluster(struct qcow2 *q)
+{
+	uint64_t off;
+	int err;
+
+	off = q->next_free;
+	q->next_free += q->cluster_size;
+	err = qcow2_ref_inc(q, off);
+	return err ? err : (int64_t)off;
+}
+
+/*
+ * Write out dirty refcount blocks, and the refcount table and header
+ * if they moved, then make those and all data written so far durable.
+ * With nothing to write they already are.
+ */
+static int
+qcow2_flush_refs(struct qcow2 *q)
+{
+	struct qcow2_header *h;
+	int err, i;
+
+	for (i = 0; i < q->ntables; i++) {
+		if (q->tables[i].refblock && q->tables[i].dirty &&
+		    (err = qcow2_table_writeback(q, &q->tables[i])) != 0)
+			return err;
+	}
+	if (!q->refs_unsynced && !q->reftable_dirty)
+		return 0;
+	if (q->reftable_dirty) {
+		err = qcow2_pwrite(q->fd, q->reftable,
+				   q->reftable_clusters * q->cluster_size,
+				   q->reftable_off);
+		if (err)
+			return err;
+		if (fdatasync(q->fd))
+			return -errno;
+		h = (struct qcow2_header *)q->hdr;
+		h->refcount_table_offset = htobe64(q->reftable_off);
+		h->refcount_table_clusters = htobe32(q->reftable_clusters);
+		err = qcow2_pwrite(q->fd, q->hdr, q->cluster_size, 0);
+		if (err)
+			return err;
+		q->reftable_dirty = 0;
+	}
+	if (fdatasync(q->fd))
+		return -errno;
+	q->refs_unsynced = 0;
+	return 0;
+}
+
+/*
+ * Mapping.  Called with mtx held.
+ */
+
+static int
+qcow2_l2_get(struct qcow2 *q, uint64_t gc, uint64_t *entry)
+{
+	struct qcow2_table *t;
+	uint64_t l1i, l2off;
+
+	*entry = 0;
+	l1i = gc >> q->l2_bits;
+	if (l1i >= q->l1_size)
+		return 0;
+	l2off = be64toh(q->l1[l1i]) & QCOW2_OFFSET_MASK;
+	if (l2off == 0)
+		return 0;
+	t = qcow2_table_get(q, l2off, 0, 1);
+	if (t == NULL)
+		return -errno;
+	*entry = be64toh(((uint64_t *)t->data)[gc &
+		((1ULL << q->l2_bits) - 1)]);
+	if (q->version < 3)
+		*entry &= ~QCOW2_OFLAG_ZERO;
+	return 0;
+}
+
+static int
+qcow2_l2_set(struct qcow2 *q, uint64_t gc, uint64_t entry)
+{
+	struct qcow2_table *t;
+	uint64_t l1i;
+	int64_t l2off;
+
+	l1i = gc >> q->l2_bits;
+	l2off = be64toh(q->l1[l1i]) & QCOW2_OFFSET_MASK;
+	if (l2off == 0) {
+		l2off = qcow2_alloc_cluster(q);
+		if (l2off < 0)
+			return l2off;
+		if (qcow2_table_get(q, l2off, 0, 0) == NULL)
+			return -errno;
+		q->l1[l1i] = htobe64(l2off | QCOW2_OFLAG_COPIED);
+		q->l1_dirty = 1;
+	}
+	t = qcow2_table_get(q, l2off, 0, 1);
+	if (t == NULL)
+		return -errno;
+	((uint64_t *)t->data)[gc & ((1ULL << q->l2_bits) - 1)] =
+		htobe64(entry);
+	t->dirty = 1;
+	return 0;
+}
+
+static enum qcow2_kind
+qcow2_kind(uint64_t entry)
+{
+	if (entry & QCOW2_OFLAG_COMPRESSED)
+		return QK_COMPRESSED;
+	if (entry & QCOW2_OFLAG_ZERO)
+		return QK_ZERO;
+	return (entry & QCOW2_OFFSET_MASK) ? QK_DATA : QK_BACKING;
+}
+
+/*
+ * Read len bytes at guest offset off from what lies under this image.
+ */
+static int
+qcow2_backing_read(struct qcow2 *q, struct qcow2_iovcur *c, size_t len,
+		   off_t off)
+{
+	struct iovec out[QCOW2_SLICE_IOV], skip[QCOW2_SLICE_IOV];
+	struct qcow2_iovcur sub;
+	size_t t, inside;
+	ssize_t n;
+	int nout, err;
+
+	if (q->backing == NULL) {
+		inside = (off < q->backing_size) ?
+			MIN(len, q->backing_size - off) : 0;
+		if (inside > 0 &&
+		    (err = qcow2_iov_io(q->backing_fd, 0, c, inside, off)) != 0)
+			return err;
+		return qcow2_iov_io(-1, 0, c, len - inside, 0);
+	}
+
+	while (len > 0) {
+		t = qcow2_iov_take(c, len, out, &nout);
+		if (t == 0)
+			return -EINVAL;
+		n = qcow2_preadv(q->backing, out, nout, off);
+		if (n < 0)
+			return n;
+		if (n < t) {
+			/* past the backing image's end */
+			sub = (struct qcow2_iovcur){ out, nout, 0, 0 };
+			qcow2_iov_take(&sub, n, skip, &nout);
+			if ((err = qcow2_iov_io(-1, 0, &sub, t - n, 0)) != 0)
+				return err;
+		}
+		len -= t;
+		off += t;
+	}
+	return 0;
+}
+
+ssize_t
+qcow2_preadv(struct qcow2 *q, const struct iovec *iov, int iovcnt,
+	     off_t off)
+{
+	struct qcow2_iovcur c = { iov, iovcnt, 0, 0 };
+	uint64_t entry, host, gc, pos, len, total, done;
+	enum qcow2_kind kind;
+	int err, i;
+
+	for (total = 0, i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (off >= q->size)
+		return 0;
+	total = MIN(total, q->size - off);
+
+	for (done = 0; done < total; done += len) {
+		pos = off + done;
+		gc = pos >> q->cluster_bits;
+
+		/* the run of clusters that read the same way */
+		pthread_mutex_lock(&q->mtx);
+		err = qcow2_l2_get(q, gc, &entry);
+		kind = qcow2_kind(entry);
+		host = (entry & QCOW2_OFFSET_MASK) +
+			(pos & (q->cluster_size - 1));
+		len = MIN(total - done,
+			  q->cluster_size - (pos & (q->cluster_size - 1)));
+		while (!err && kind != QK_COMPRESSED && done + len < total) {
+			err = qcow2_l2_get(q, ++gc, &entry);
+			if (err || qcow2_kind(entry) != kind ||
+			    (kind == QK_DATA &&
+			     (entry & QCOW2_OFFSET_MASK) != host + len))
+				break;
+			len = MIN(total - done, len + q->cluster_size);
+		}
+		pthread_mutex_unlock(&q->mtx);
+		if (err)
+			return err;
+
+		switch (kind) {
+		case QK_DATA:
+			err = qcow2_iov_io(q->fd, 0, &c, len, host);
+			break;
+		case QK_ZERO:
+			err = qcow2_iov_io(-1, 0, &c, len, 0);
+			break;
+		case QK_BACKING:
+			err = qcow2_backing_read(q, &c, len, pos);
+			break;
+		default:
+			WPRINTF(("qcow2: compressed clusters not supported\n"));
+			err = -EOPNOTSUPP;
+			break;
+		}
+		if (err)
+			return err;
+	}
+	return total;
+}
+
+/*
+ * Find where guest cluster gc is written.  A cluster with data is
+ * written in place; otherwise it gets a host cluster, *fresh is set (to
+ * 2 if the host cluster is new), and the caller must fill it and call
+ * qcow2_commit().
+ */
+static int
+qcow2_prepare(struct qcow2 *q, uint64_t gc, struct qcow2_alloc *a,
+	      uint64_t *host, int *fresh, enum qcow2_kind *kind)
+{
+	struct qcow2_alloc *b;
+	uint64_t entry;
+	int64_t h;
+	int err;
+
+	*fresh = 0;
+	pthread_mutex_lock(&q->mtx);
+	for (;;) {
+		err = qcow2_l2_get(q, gc, &entry);
+		if (err)
+			break;
+		*kind = qcow2_kind(entry);
+		if (*kind == QK_COMPRESSED) {
+			WPRINTF(("qcow2: compressed clusters not supported\n"));
+			err = -EOPNOTSUPP;
+			break;
+		}
+		if (*kind == QK_DATA) {
+			*host = entry & QCOW2_OFFSET_MASK;
+			break;
+		}
+		LIST_FOREACH(b, &q->allocs, link) {
+			if (b->gc == gc)
+				break;
+		}
+		if (b != NULL) {
+			pthread_cond_wait(&q->cond, &q->mtx);
+			continue;
+		}
+
+		/* a preallocated zero cluster keeps its host cluster */
+		*host = entry & QCOW2_OFFSET_MASK;
+		if (*host == 0) {
+			h = qcow2_alloc_cluster(q);
+			if (h < 0) {
+				err = h;
+				break;
+			}
+			*host = h;
+			*fresh = 2;
+		} else
+			*fresh = 1;
+		a->gc = gc;
+		LIST_INSERT_HEAD(&q->allocs, a, link);
+		break;
+	}
+	pthread_mutex_unlock(&q->mtx);
+	return err;
+}
+
+static int
+qcow2_commit(struct qcow2 *q, struct qcow2_alloc *a, uint64_t host, int ok)
+{
+	int err;
+
+	pthread_mutex_lock(&q->mtx);
+	err = ok ? qcow2_l2_set(q, a->gc, host | QCOW2_OFLAG_COPIED) : 0;
+	LIST_REMOVE(a, link);
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mtx);
+	return err;
+}
+
+/*
+ * Fill the parts of a host cluster the guest write does not cover,
+ * [0, head) and [tail, cluster_size), from what was there before.
+ */
+static int
+qcow2_cow(struct qcow2 *q, uint64_t gc, uint64_t host, enum qcow2_kind kind,
+	  int fresh, size_t head, size_t tail)
+{
+	struct qcow2_iovcur c;
+	struct iovec iov;
+	uint8_t *buf;
+	size_t cs = q->cluster_size;
+	int err;
+
+	if (head == 0 && tail == cs)
+		return 0;
+	if (kind == QK_BACKING && q->backing == NULL && q->backing_fd < 0)
+		kind = QK_ZERO;
+	/* a new cluster is past the old end of file, so zero already */
+	if (kind == QK_ZERO && fresh == 2)
+		return 0;
+	buf = qcow2_alloc_buf(cs);
+	if (buf == NULL)
+		return -ENOMEM;
+	if (kind == QK_BACKING) {
+		iov.iov_base = buf;
+		iov.iov_len = cs;
+		c = (struct qcow2_iovcur){ &iov, 1, 0, 0 };
+		err = qcow2_backing_read(q, &c, cs, gc << q->cluster_bits);
+		if (err)
+			goto out;
+	}
+	err = 0;
+	if (head > 0)
+		err = qcow2_pwrite(q->fd, buf, head, host);
+	if (!err && tail < cs)
+		err = qcow2_pwrite(q->fd, buf + tail, cs - tail, host + tail);
+out:
+	free(buf);
+	return err;
+}
+
+ssize_t
+qcow2_pwritev(struct qcow2 *q, const struct iovec *iov, int iovcnt,
+	      off_t off)
+{
+	struct qcow2_iovcur c = { iov, iovcnt, 0, 0 };
+	struct qcow2_alloc a;
+	enum qcow2_kind kind;
+	uint64_t host, gc, pos, inoff, len, total, done;
+	int err, fresh, i;
+
+	if (q->ro)
+		return -EROFS;
+	for (total = 0, i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (off + total > q->size)
+		return -ENOSPC;
+
+	for (done = 0; done < total; done += len) {
+		pos = off + done;
+		gc = pos >> q->cluster_bits;
+		inoff = pos & (q->cluster_size - 1);
+		len = MIN(total - done, q->cluster_size - inoff);
+
+		err = qcow2_prepare(q, gc, &a, &host, &fresh, &kind);
+		if (err)
+			return err;
+		err = qcow2_iov_io(q->fd, 1, &c, len, host + inoff);
+		if (fresh) {
+			if (!err)
+				err = qcow2_cow(q, gc, host, kind, fresh,
+						inoff, inoff + len);
+			i = qcow2_commit(q, &a, host, !err);
+			if (!err)
+				err = i;
+		}
+		if (err)
+			return err;
+	}
+	return total;
+}
+
+int
+qcow2_flush(struct qcow2 *q)
+{
+	int err, i;
+
+	if (q->ro)
+		return 0;
+	pthread_mutex_lock(&q->mtx);
+	for (i = 0; i < q->ntables && !q->tables[i].dirty; i++)
+		;
+	if (i == q->ntables && !q->l1_dirty && !q->reftable_dirty) {
+		/* no metadata to write, only data to sync */
+		pthread_mutex_unlock(&q->mtx);
+		return fdatasync(q->fd) ? -errno : 0;
+	}
+	/* refcounts once, then the L2 tables that depend on them */
+	err = qcow2_flush_refs(q);
+	for (i = 0; i < q->ntables && !err; i++) {
+		if (!q->tables[i].refblock && q->tables[i].dirty)
+			err = qcow2_table_writeback(q, &q->tables[i]);
+	}
+	if (!err && q->l1_dirty) {
+		err = qcow2_pwrite(q->fd, q->l1, q->l1_len, q->l1_off);
+		if (!err)
+			q->l1_dirty = 0;
+	}
+	pthread_mutex_unlock(&q->mtx);
+	if (!err && fdatasync(q->fd))
+		err = -errno;
+	return err;
+}
+
+off_t
+qcow2_size(struct qcow2 *q)
+{
+	return q->size;
+}
+
+int
+qcow2_probe(int fd)
+{
+	/* a whole aligned block, in case fd is O_DIRECT */
+	uint8_t buf[4096] __attribute__((aligned(4096)));
+	uint32_t magic;
+
+	if (pread(fd, buf, sizeof(buf), 0) < (ssize_t)sizeof(magic))
+		return 0;
+	memcpy(&magic, buf, sizeof(magic));
+	return be32toh(magic) == QCOW2_MAGIC;
+}
+
+/*
+ * Open the backing file named in the header, relative to the image's
+ * directory unless absolute.
+ */
+static int
+qcow2_open_backing(struct qcow2 *q, const char *path, const char *name,
+		   const char *fmt, int oflags, int depth)
+{
+	char bpath[PATH_MAX], *dup;
+	struct stat sbuf;
+	int fd, isqcow, n;
+
+	if (name[0] == '/')
+		n = snprintf(bpath, sizeof(bpath), "%s", name);
+	else {
+		dup = strdup(path);
+		if (dup == NULL)
+			return -1;
+		n = snprintf(bpath, sizeof(bpath), "%s/%s", dirname(dup), name);
+		free(dup);
+	}
+	if (n >= sizeof(bpath)) {
+		fprintf(stderr, "qcow2: backing file path too long\n");
+		return -1;
+	}
+
+	fd = open(bpath, O_RDONLY | oflags);
+	if (fd < 0 || fstat(fd, &sbuf) < 0) {
+		fprintf(stderr, "qcow2: cannot open backing file %s\n", bpath);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (fmt[0] != '\0')
+		isqcow = !strcmp(fmt, "qcow2");
+	else
+		isqcow = qcow2_probe(fd);
+	if (fmt[0] != '\0' && !isqcow && strcmp(fmt, "raw")) {
+		fprintf(stderr, "qcow2: backing format %s not supported\n",
+			fmt);
+		close(fd);
+		return -1;
+	}
+
+	if (isqcow) {
+		q->backing = qcow2_open_chain(fd, bpath, 1, oflags,
+					      q->ntables, depth + 1);
+		if (q->backing == NULL) {
+			close(fd);
+			return -1;
+		}
+		q->backing->ownfd = 1;
+	} else {
+		q->backing_fd = fd;
+		q->backing_size = sbuf.st_size;
+	}
+	return 0;
+}
+
+static struct qcow2 *
+qcow2_open_chain(int fd, const char *path, int ro, int oflags, int ntables,
+		 int depth)
+{
+	struct qcow2_header *h;
+	struct qcow2 *q;
+	char name[PATH_MAX], fmt[16];
+	uint64_t incompat, hlen, boff, l1need, ext;
+	uint32_t etype, elen, bsize, order;
+	off_t end;
+	size_t cs;
+	int i;
+
+	if (depth > QCOW2_CHAIN_MAX) {
+		fprintf(stderr, "qcow2: backing chain too deep\n");
+		return NULL;
+	}
+	q = calloc(1, sizeof(struct qcow2));
+	if (q == NULL)
+		return NULL;
+	q->fd = fd;
+	q->ro = ro;
+	q->backing_fd = -1;
+	pthread_mutex_init(&q->mtx, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	TAILQ_INIT(&q->lru);
+	LIST_INIT(&q->allocs);
+
+	/* the header first, to learn the cluster size, then the cluster */
+	q->hdr = qcow2_alloc_buf(4096);
+	if (q->hdr == NULL || qcow2_pread(fd, q->hdr, 4096, 0))
+		goto fail;
+	h = (struct qcow2_header *)q->hdr;
+	q->version = be32toh(h->version);
+	q->cluster_bits = be32toh(h->cluster_bits);
+	if (be32toh(h->magic) != QCOW2_MAGIC ||
+	    (q->version != 2 && q->version != 3) ||
+	    q->cluster_bits < 9 || q->cluster_bits > 21) {
+		fprintf(stderr, "qcow2: %s: bad header\n", path);
+		goto fail;
+	}
+	cs = q->cluster_size = 1UL << q->cluster_bits;
+	if (cs > 4096) {
+		free(q->hdr);
+		q->hdr = qcow2_alloc_buf(cs);
+		if (q->hdr == NULL || qcow2_pread(fd, q->hdr, cs, 0))
+			goto fail;
+		h = (struct qcow2_header *)q->hdr;
+	}
+
+	incompat = 0;
+	order = 4;
+	hlen = QCOW2_V2_HDRLEN;
+	if (q->version >= 3) {
+		incompat = be64toh(h->incompatible_features);
+		order = be32toh(h->refcount_order);
+		hlen = be32toh(h->header_length);
+	}
+	if (be32toh(h->crypt_method) != 0) {
+		fprintf(stderr, "qcow2: %s: encrypted images not supported\n",
+			path);
+		goto fail;
+	}
+	if (incompat & ~(QCOW2_INCOMPAT_DIRTY)) {
+		fprintf(stderr, "qcow2: %s: unsupported features 0x%lx\n",
+			path, incompat);
+		goto fail;
+	}
+	if (!ro && ((incompat & QCOW2_INCOMPAT_DIRTY) || order != 4 ||
+		    be32toh(h->nb_snapshots) != 0)) {
+		fprintf(stderr, "qcow2: %s: dirty, snapshots or refcount "
+			"width %d, can only be opened ro\n", path, 1 << order);
+		goto fail;
+	}
+
+	/*
+	 * Autoclear features (persistent bitmaps and the like) describe
+	 * data we are about to change without keeping them up to date: a
+	 * writer that doesn't know them must clear them first.
+	 */
+	if (!ro && q->version >= 3 && h->autoclear_features != 0) {
+		h->autoclear_features = 0;
+		if (qcow2_pwrite(fd, q->hdr, cs, 0) || fdatasync(fd)) {
+			fprintf(stderr, "qcow2: %s: header update failed\n",
+				path);
+			goto fail;
+		}
+	}
+
+	q->size = be64toh(h->size);
+	q->l2_bits = q->cluster_bits - 3;
+	q->refblock_bits = q->cluster_bits - (order - 3);
+	q->l1_size = be32toh(h->l1_size);
+	q->l1_off = be64toh(h->l1_table_offset);
+	l1need = howmany(howmany(q->size, cs), 1ULL << q->l2_bits);
+	if (q->l1_size < l1need) {
+		fprintf(stderr, "qcow2: %s: L1 table too small\n", path);
+		goto fail;
+	}
+	q->l1_len = roundup((size_t)q->l1_size * sizeof(uint64_t), cs);
+	q->l1 = qcow2_alloc_buf(q->l1_len);
+	if (q->l1 == NULL || qcow2_pread(fd, q->l1, q->l1_len, q->l1_off))
+		goto fail;
+
+	q->reftable_off = be64toh(h->refcount_table_offset);
+	q->reftable_clusters = be32toh(h->refcount_table_clusters);
+	q->reftable_n = (uint64_t)q->reftable_clusters * cs / sizeof(uint64_t);
+	q->reftable = qcow2_alloc_buf(q->reftable_clusters * cs);
+	if (q->reftable == NULL ||
+	    qcow2_pread(fd, q->reftable, q->reftable_clusters * cs,
+			q->reftable_off))
+		goto fail;
+	end = lseek(fd, 0, SEEK_END);
+	if (end < 0)
+		goto fail;
+	q->next_free = roundup((uint64_t)end, cs);
+
+	/* metadata cache */
+	q->ntables = MAX(ntables, 4);
+	for (q->hbits = 4; (1 << q->hbits) < q->ntables; q->hbits++)
+		;
+	q->tables = calloc(q->ntables, sizeof(struct qcow2_table));
+	q->hash = calloc(1 << q->hbits, sizeof(*q->hash));
+	q->tabmem = qcow2_alloc_buf(q->ntables * cs);
+	if (q->tables == NULL || q->hash == NULL || q->tabmem == NULL)
+		goto fail;
+	for (i = 0; i < q->ntables; i++) {
+		q->tables[i].data = q->tabmem + i * cs;
+		TAILQ_INSERT_TAIL(&q->lru, &q->tables[i], lru);
+	}
+
+	/* header extensions: only the backing file format matters */
+	fmt[0] = '\0';
+	for (ext = hlen; ext + 8 <= cs; ext += 8 + roundup(elen, 8)) {
+		memcpy(&etype, q->hdr + ext, sizeof(etype));
+		memcpy(&elen, q->hdr + ext + 4, sizeof(elen));
+		etype = be32toh(etype);
+		elen = be32toh(elen);
+		if (etype == QCOW2_EXT_END)
+			break;
+		if (etype == QCOW2_EXT_BACKING_FMT && elen < sizeof(fmt) &&
+		    ext + 8 + elen <= cs) {
+			memcpy(fmt, q->hdr + ext + 8, elen);
+			fmt[elen] = '\0';
+		}
+	}
+
+	boff = be64toh(h->backing_file_offset);
+	bsize = be32toh(h->backing_file_size);
+	if (boff != 0 && bsize != 0) {
+		if (bsize >= sizeof(name) || boff + bsize > cs) {
+			fprintf(stderr, "qcow2: %s: bad backing file name\n",
+				path);
+			goto fail;
+		}
+		memcpy(name, q->hdr + boff, bsize);
+		name[bsize] = '\0';
+		if (qcow2_open_backing(q, path, name, fmt, oflags, depth))
+			goto fail;
+	}
+	return q;
+
+fail:
+	qcow2_close(q);
+	return NULL;
+}
+
+struct qcow2 *
+qcow2_open(int fd, const char *path, int ro, int oflags, int ntables)
+{
+	return qcow2_open_chain(fd, path, ro, oflags & O_DIRECT,
+				ntables ? ntables : QCOW2_CACHE_DEFAULT, 0);
+}
+
+void
+qcow2_close(struct qcow2 *q)
+{
+	int err;
+
+	if (q->tables != NULL && (err = qcow2_flush(q)) != 0)
+		WPRINTF(("qcow2: metadata flush failed: %s\n",
+			 strerror(-err)));
+	if (q->backing != NULL)
+		qcow2_close(q->backing);
+	if (q->backing_fd >= 0)
+		close(q->backing_fd);
+	if (q->ownfd)
+		close(q->fd);
+	pthread_mutex_destroy(&q->mtx);
+	pthread_cond_destroy(&q->cond);
+	free(q->hdr);
+	free(q->l1);
+	free(q->reftable);
+	free(q->tables);
+	free(q->hash);
+	free(q->tabmem);
+	free(q);
+}
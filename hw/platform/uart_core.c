@@ -190,8 +190,10 @@ rxfifo_reset(struct uart_vdev *uart, int size)
 		 * Enable mevent to trigger when new characters are available
 		 * on the tty fd.
 		 */
-		error = mevent_enable(uart->mev);
-		assert(error == 0);
+		if (uart->mev != NULL) {
+			error = mevent_enable(uart->mev);
+			assert(error == 0);
+		}
 	}
 }
 
@@ -217,7 +219,7 @@ rxfifo_putchar(struct uart_vdev *uart, uint8_t ch)
 		fifo->windex = (fifo->windex + 1) % fifo->size;
 		fifo->num++;
 		if (!rxfifo_available(uart)) {
-			if (uart->tty.opened) {
+			if (uart->tty.opened && uart->mev != NULL) {
 				/*
 				 * Disable mevent callback if the FIFO is full.
 				 */
@@ -245,7 +247,7 @@ rxfifo_getchar(struct uart_vdev *uart)
 		fifo->rindex = (fifo->rindex + 1) % fifo->size;
 		fifo->num--;
 		if (wasfull) {
-			if (uart->tty.opened) {
+			if (uart->tty.opened && uart->mev != NULL) {
 				error = mevent_enable(uart->mev);
 				assert(error == 0);
 			}
@@ -392,7 +394,13 @@ uart_drain(int fd, enum ev_type ev, void *arg)
 	if ((uart->mcr & MCR_LOOPBACK) != 0) {
 		(void) ttyread(&uart->tty);
 	} else {
-		while ((ch = ttyread(&uart->tty)) != -1)
+		/*
+		 * Once the FIFO fills up the tty fd is parked; leave the
+		 * rest of the input in the tty until rxfifo_getchar()
+		 * makes room and re-enables it.
+		 */
+		while (rxfifo_available(uart) &&
+		       (ch = ttyread(&uart->tty)) != -1)
 			rxfifo_putchar(uart, ch);
 
 		uart_toggle_intr(uart);
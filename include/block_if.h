@@ -39,17 +39,38 @@
 #include <sys/uio.h>
 #include <sys/unistd.h>
 
-#define BLOCKIF_IOV_MAX		33	/* not practical to be IOV_MAX */
+#define BLOCKIF_IOV_MAX		33	/* default segments per request */
+
+/* one extent of a batched discard or write-zeroes request */
+struct blockif_range {
+	off_t		offset;
+	off_t		len;
+};
 
 struct blockif_req {
-	struct iovec	iov[BLOCKIF_IOV_MAX];
+	struct iovec	*iov;		/* caller-provided, iovcnt long */
 	int		iovcnt;
 	off_t		offset;
 	ssize_t		resid;
+	struct blockif_range *ranges;	/* delete/zero; if none, */
+	int		nranges;	/* offset and resid are the range */
 	void		(*callback)(struct blockif_req *req, int err);
 	void		*param;
 };
 
+/* counters kept per disk, see blockif_get_stats() */
+struct blockif_stats {
+	uint64_t	reqs;		/* requests queued */
+	uint64_t	merged;		/* requests folded into another's I/O */
+	uint64_t	merge_ios;	/* I/Os carrying merged requests */
+	uint64_t	merge_bytes;	/* bytes moved by those I/Os */
+	uint64_t	direct_bytes;	/* read/written from guest buffers */
+	uint64_t	bounce_bytes;	/* copied through a bounce buffer */
+	uint64_t	rc_hits;	/* read cache blocks found */
+	uint64_t	rc_misses;	/* and read in */
+	uint64_t	ra_bytes;	/* read ahead into the cache */
+};
+
 struct blockif_ctxt;
 struct blockif_ctxt *blockif_open(const char *optstr, const char *ident);
 off_t	blockif_size(struct blockif_ctxt *bc);
@@ -60,10 +81,14 @@ void	blockif_psectsz(struct blockif_ctxt *bc, int *size, int *off);
 int	blockif_queuesz(struct blockif_ctxt *bc);
 int	blockif_is_ro(struct blockif_ctxt *bc);
 int	blockif_candelete(struct blockif_ctxt *bc);
+int	blockif_get_wce(struct blockif_ctxt *bc);
+void	blockif_set_wce(struct blockif_ctxt *bc, int wce);
+void	blockif_get_stats(struct blockif_ctxt *bc, struct blockif_stats *st);
 int	blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq);
+int	blockif_zero(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_close(struct blockif_ctxt *bc);
 
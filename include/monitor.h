@@ -79,4 +79,14 @@ int monitor_register_handler(struct vmm_msg *msg,
 			     void (*callback) (struct vmm_msg * msg,
 					       struct msg_sender * sender,
 					       void *priv), void *priv);
+
+/**
+ * monitor_reply()
+ * Msg handlers can use monitor_reply() to send a vmm_msg back to the client
+ * which sent the message being handled.
+ * @arguements:
+ * @sender: the sender passed to the msg handler
+ * @msg: any valid vmm_msg data structure, msg->len must be set
+ */
+int monitor_reply(struct msg_sender *sender, struct vmm_msg *msg);
 #endif
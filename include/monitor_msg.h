@@ -57,6 +57,10 @@ enum msgid {
 
 	MSG_STR,
 	MSG_HANDSHAKE,		/* handshake */
+	REQ_VQ_STATS,		/* client -> ACRN-DM, virtqueue statistics */
+	REQ_NET_RATELIMIT,	/* client -> ACRN-DM, virtio-net rate limits */
+	REQ_NET_CAPTURE,	/* client -> ACRN-DM, virtio-net packet capture */
+	REQ_BLK_STATS,		/* client -> ACRN-DM, block request statistics */
 
 	MSGID_MAX
 };
@@ -104,4 +108,33 @@ struct vmm_msg_handshake {
 	/*   message to such client */
 };
 
+/* REQ_NET_RATELIMIT: change the rate limits of one virtio-net device.
+ * spec uses the slot option syntax, e.g. "tx_bps=100000000,rx_pps=20000:500";
+ * a rate of 0 removes that limit. The reply is a MSG_STR with the limits
+ * now in effect, or an error.
+ */
+struct vmm_msg_net_ratelimit {
+	struct vmm_msg vmsg;
+	unsigned int bus;
+	unsigned int slot;
+	unsigned int func;
+	char spec[128];		/* '\0' terminated */
+};
+
+/* REQ_NET_CAPTURE: start or stop capturing the frames one virtio-net
+ * device exchanges with its guest into a pcapng file. filter is the
+ * output of "tcpdump -ddd", or empty to capture everything. The reply
+ * is a MSG_STR saying what was done, or an error.
+ */
+struct vmm_msg_net_capture {
+	struct vmm_msg vmsg;
+	unsigned int bus;
+	unsigned int slot;
+	unsigned int func;
+	int enable;		/* 1 to start, 0 to stop */
+	unsigned int snaplen;	/* 0 for the default */
+	char path[256];		/* pcapng file, '\0' terminated */
+	char filter[2048];	/* '\0' terminated */
+};
+
 #endif
@@ -217,6 +217,7 @@ static_assert(sizeof(struct pciecap) == 60, "compile-time assertion failed");
 
 typedef void (*pci_lintr_cb)(int b, int s, int pin, int pirq_pin,
 			     int ioapic_irq, void *arg);
+typedef void (*pci_vdev_cb)(struct pci_vdev *dev, void *arg);
 
 int	init_pci(struct vmctx *ctx);
 void	deinit_pci(struct vmctx *ctx);
@@ -253,6 +254,7 @@ int	pci_emul_msix_twrite(struct pci_vdev *pi, uint64_t offset, int size,
 uint64_t pci_emul_msix_tread(struct pci_vdev *pi, uint64_t offset, int size);
 int	pci_count_lintr(int bus);
 void	pci_walk_lintr(int bus, pci_lintr_cb cb, void *arg);
+void	pci_walk_vdev(pci_vdev_cb cb, void *arg);
 void	pci_write_dsdt(void);
 uint64_t pci_ecfg_base(void);
 int	pci_bus_configured(int bus);
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * qcow2 image format, as used by block_if.  Offsets are those of the
+ * virtual disk; reads and writes may run concurrently from any number
+ * of threads.  Functions return -errno on failure.
+ */
+
+#ifndef _QCOW2_H_
+#define _QCOW2_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define QCOW2_CACHE_DEFAULT	64	/* metadata tables kept per image */
+
+struct qcow2;
+
+int	qcow2_probe(int fd);
+struct qcow2 *qcow2_open(int fd, const char *path, int ro, int oflags,
+			 int ntables);
+off_t	qcow2_size(struct qcow2 *q);
+ssize_t	qcow2_preadv(struct qcow2 *q, const struct iovec *iov, int iovcnt,
+		     off_t off);
+ssize_t	qcow2_pwritev(struct qcow2 *q, const struct iovec *iov, int iovcnt,
+		      off_t off);
+int	qcow2_flush(struct qcow2 *q);
+void	qcow2_close(struct qcow2 *q);
+
+#endif /* _QCOW2_H_ */
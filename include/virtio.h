@@ -372,11 +372,18 @@ struct virtio_vq_info;
  * However, the driver must verify the read or write size and offset
  * and that no one is writing a readonly register.)
  *
+ * Devices with several independently serviced queues may set the
+ * VIRTIO_VQ_LOCKING flag.  Queue notifications are then dispatched
+ * holding only the per-queue lock of the notified queue instead of the
+ * device-wide mutex, so that kicks on different queues do not serialize
+ * against each other or against config space accesses.
+ *
  * The BROKED flag ("this thing done gone and broked") is for future
  * use.
  */
 #define	VIRTIO_USE_MSIX		0x01
 #define	VIRTIO_EVENT_IDX	0x02	/* use the event-index values */
+#define	VIRTIO_VQ_LOCKING	0x04	/* notify under vq lock, not base lock */
 #define	VIRTIO_BROKED		0x08	/* ??? */
 
 /*
@@ -555,6 +562,33 @@ struct virtio_ops {
 
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
 #define	VQ_BROKED	0x02	/* ??? */
+
+/**
+ * @brief Virtqueue statistics
+ *
+ * Maintained by the generic code and kept across device resets.  The
+ * counters are updated without atomics under whatever lock the device
+ * uses for the queue, so they are only approximate for readers.
+ */
+struct virtio_vq_stats {
+	uint64_t kicks;		/**< guest notifications received */
+	uint64_t chains;	/**< chains returned by vq_getchain */
+	uint64_t descs;		/**< descriptors in those chains */
+	uint64_t bytes;		/**< bytes reported via vq_relchain */
+	uint64_t intr_sent;	/**< interrupts delivered */
+	uint64_t intr_suppressed; /**< used entries added without intr */
+	uint64_t ring_empty;	/**< device found no available chain */
+	uint64_t ring_full;	/**< every ring entry was available */
+	uint64_t drops;		/**< frames the device had to discard */
+	uint64_t batches;	/**< service passes that moved chains */
+	uint64_t svc_ns;	/**< time spent in those passes */
+	uint64_t polls;		/**< times the device polled for more */
+	uint64_t poll_hits;	/**< polls that found a chain */
+	uint64_t poll_ns;	/**< time spent polling */
+	uint64_t throttled;	/**< pauses imposed by a rate limit */
+	uint64_t throttle_ns;	/**< time spent paused */
+};
+
 /**
  * @brief Virtqueue data structure
  *
@@ -601,6 +635,42 @@ struct virtio_vq_info {
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
+
+	pthread_mutex_t mtx;	/**< per-queue lock, see VIRTIO_VQ_LOCKING */
+	struct virtio_vq_stats stats;	/**< statistics, see above */
+};
+
+#define	VQ_LOCK(vq)	pthread_mutex_lock(&(vq)->mtx)
+#define	VQ_UNLOCK(vq)	pthread_mutex_unlock(&(vq)->mtx)
+
+/**
+ * @brief Virtqueue pair serviced by a dedicated worker thread
+ *
+ * Multi-queue devices group their virtqueues into pairs, queue 2N
+ * being the receive side and queue 2N+1 the transmit side of pair N
+ * (the layout virtio-net uses).  Each pair gets its own worker thread,
+ * optionally pinned to a host CPU, which runs the device handler every
+ * time the pair is kicked.  Kicks arriving while the handler runs are
+ * coalesced into one more pass of the handler.
+ */
+struct virtio_vq_pair {
+	struct virtio_base *base;	/**< backpointer to virtio_base */
+	struct virtio_vq_info *rx;	/**< receive queue, 2 * idx */
+	struct virtio_vq_info *tx;	/**< transmit queue, 2 * idx + 1 */
+	int	idx;			/**< index of this pair */
+	int	cpu;			/**< host CPU of worker, or -1 */
+	void	(*handler)(void *, struct virtio_vq_pair *);
+					/**< called on the worker on kick */
+	void	*priv;			/**< device private data */
+
+	pthread_t tid;			/**< worker thread */
+	pthread_mutex_t mtx;		/**< protects the fields below */
+	pthread_cond_t cond;		/**< worker waits here for kicks */
+	pthread_cond_t idle;		/**< signalled when busy drops */
+	int	kicked;			/**< kick pending */
+	int	busy;			/**< handler running */
+	int	started;		/**< worker thread created */
+	int	closing;		/**< worker exit requested */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -638,6 +708,40 @@ vq_has_descs(struct virtio_vq_info *vq)
 	    vq->avail->idx);
 }
 
+/**
+ * @brief Ask the guest to notify us when it adds available descriptors.
+ *
+ * Clears VRING_USED_F_NO_NOTIFY and, if VIRTIO_RING_F_EVENT_IDX was
+ * negotiated, moves the avail event index to the guest's current avail
+ * index so the next addition triggers a kick. Followed by a full barrier
+ * so the caller can safely re-check the avail ring afterwards.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return NULL
+ */
+static inline void
+vq_kick_enable(struct virtio_vq_info *vq)
+{
+	vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vq->base->negotiated_caps & VIRTIO_RING_F_EVENT_IDX)
+		VQ_AVAIL_EVENT_IDX(vq) = vq->avail->idx;
+	mb();
+}
+
+/**
+ * @brief Tell the guest not to notify us of new available descriptors.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return NULL
+ */
+static inline void
+vq_kick_disable(struct virtio_vq_info *vq)
+{
+	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
 /**
  * @brief Deliver an interrupt to guest on the given virtqueue.
  *
@@ -651,6 +755,7 @@ vq_has_descs(struct virtio_vq_info *vq)
 static inline void
 vq_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq)
 {
+	vq->stats.intr_sent++;
 	if (pci_msix_enabled(vb->dev))
 		pci_generate_msix(vb->dev, vq->msix_idx);
 	else {
@@ -783,6 +888,17 @@ int vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
  */
 void vq_retchain(struct virtio_vq_info *vq);
 
+/**
+ * @brief Return the most recently obtained request chains back to the
+ * available ring.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param n_chains Number of chains to return.
+ *
+ * @return N/A
+ */
+void vq_retchains(struct virtio_vq_info *vq, uint16_t n_chains);
+
 /**
  * @brief Return specified request chain to the guest,
  * setting its I/O length to the provided value.
@@ -795,6 +911,20 @@ void vq_retchain(struct virtio_vq_info *vq);
  */
 void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
 
+/**
+ * @brief Return several request chains to the guest, publishing them
+ * with a single used index update.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param idx Array of available ring positions, returned by vq_getchain().
+ * @param iolen Array of data bytes to be returned for each chain.
+ * @param n Number of chains.
+ *
+ * @return N/A
+ */
+void vq_relchains(struct virtio_vq_info *vq, uint16_t *idx, uint32_t *iolen,
+		  int n);
+
 /**
  * @brief Driver has finished processing "available" chains and calling
  * vq_relchain on each one.
@@ -845,6 +975,65 @@ uint64_t virtio_pci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 void virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		      int baridx, uint64_t offset, int size, uint64_t value);
 
+/**
+ * @brief Initialize a virtqueue pair.
+ *
+ * Pair idx covers queues 2 * idx and 2 * idx + 1 of the virtio_base,
+ * which must have been linked up with virtio_linkup() before.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param vqp Pointer to struct virtio_vq_pair to initialize.
+ * @param idx Index of the pair.
+ * @param handler Function run on the worker thread when kicked.
+ * @param priv Device private data, available as vqp->priv.
+ *
+ * @return N/A
+ */
+void virtio_vq_pair_init(struct virtio_base *base, struct virtio_vq_pair *vqp,
+			 int idx, void (*handler)(void *,
+			 struct virtio_vq_pair *), void *priv);
+
+/**
+ * @brief Spawn the worker thread of a virtqueue pair.
+ *
+ * @param vqp Pointer to struct virtio_vq_pair.
+ * @param name Thread name, for diagnostics.
+ * @param cpu Host CPU to pin the worker to, or -1 for no pinning.
+ *
+ * @return 0 on success and non-zero on fail.
+ */
+int virtio_vq_pair_start(struct virtio_vq_pair *vqp, const char *name,
+			 int cpu);
+
+/**
+ * @brief Kick the worker thread of a virtqueue pair.
+ *
+ * Safe to call from any thread, including vq notify callbacks.
+ *
+ * @param vqp Pointer to struct virtio_vq_pair.
+ *
+ * @return N/A
+ */
+void virtio_vq_pair_kick(struct virtio_vq_pair *vqp);
+
+/**
+ * @brief Wait until the handler of a virtqueue pair is not running.
+ *
+ * @param vqp Pointer to struct virtio_vq_pair.
+ *
+ * @return N/A
+ */
+void virtio_vq_pair_wait_idle(struct virtio_vq_pair *vqp);
+
+/**
+ * @brief Stop the worker thread of a virtqueue pair and wait for it.
+ *
+ * @param vqp Pointer to struct virtio_vq_pair.
+ *
+ * @return N/A
+ */
+void virtio_vq_pair_stop(struct virtio_vq_pair *vqp);
+
 /**
  * @brief Indicate the device has experienced an error.
  *